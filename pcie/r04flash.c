@@ -1,8 +1,9 @@
 #include "linux/cleanup.h"
 #include "linux/gfp_types.h"
 #include "linux/kern_levels.h"
-#include "linux/mutex.h"
 #include "linux/stddef.h"
+#include <linux/blkdev.h>
+#include <linux/debugfs.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/pci.h>
@@ -12,11 +13,21 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/fs.h>
+#include <linux/io.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
 
 #include "r04flash.h"
 
+#define CREATE_TRACE_POINTS
+#include "r04flash_trace.h"
+
 #define DEVICE_NAME "r04flash"
 #define DRIVER "r04flash_driver"
+#define BLK_DEVICE_NAME "r04blk"
 
 #define R04FLASH_CSR_BAR_NO 0
 #define R04FLASH_CSR_BAR_MASK (1 << R04FLASH_CSR_BAR_NO)
@@ -24,6 +35,10 @@
 #define R04FLASH_DATA_BAR_NO 2
 #define R04FLASH_DATA_BAR_MASK (1 << R04FLASH_DATA_BAR_NO)
 
+// необязательный bar с содержимым хранилища (отображается через mmap)
+#define R04FLASH_STORAGE_BAR_NO PCIE_STORAGE_BAR_NO
+#define R04FLASH_STORAGE_BAR_MASK (1 << R04FLASH_STORAGE_BAR_NO)
+
 #define DATA_OFFSET 8
 
 static struct pci_device_id r04flash_id_table[] = {
@@ -48,24 +63,30 @@ int destroy_char_devs(void);
 static int r04flash_open(struct inode *inode, struct file *file);
 static int r04flash_release(struct inode *inode, struct file *file);
 static long r04flash_ioctl(struct file *file, unsigned int cmd, u64 arg);
-static ssize_t r04flash_read(struct file *file, char __user *buf, size_t count,
-			     loff_t *offset);
-static ssize_t r04flash_write(struct file *file, const char __user *buf,
-			      size_t count, loff_t *offset);
+static ssize_t r04flash_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t r04flash_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static int r04flash_fsync(struct file *file, loff_t start, loff_t end,
+			  int datasync);
+static int r04flash_mmap(struct file *file, struct vm_area_struct *vma);
+static loff_t r04flash_llseek(struct file *file, loff_t offset, int whence);
 
 static const struct file_operations r04flash_fops = {
 	.owner = THIS_MODULE,
 	.open = r04flash_open,
 	.release = r04flash_release,
+	.llseek = r04flash_llseek,
 	.unlocked_ioctl = (void *)r04flash_ioctl,
-	.read = r04flash_read,
-	.write = r04flash_write
+	.read_iter = r04flash_read_iter,
+	.write_iter = r04flash_write_iter,
+	.fsync = r04flash_fsync,
+	.mmap = r04flash_mmap
 };
 
 static int dev_major = 0;
 static struct class *r04flashclass = NULL;
 static struct r04flash_data *r04flash_priv = NULL;
 static struct r04flash_global_data r04flash_sync;
+static DEFINE_PER_CPU(struct r04flash_stats[PCIE_QUEUES_NUM], r04flash_stats);
 
 static ssize_t disk_size_show(struct device *dev, struct device_attribute *attr,
 			      char *buf)
@@ -73,6 +94,12 @@ static ssize_t disk_size_show(struct device *dev, struct device_attribute *attr,
 	return sprintf(buf, "%d\n", ioread32(&r04flash_priv->csr->disk_size));
 }
 
+static ssize_t win_size_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	return sprintf(buf, "%u\n", r04flash_priv->win_size);
+}
+
 static ssize_t rd_addr_show(struct device *dev, struct device_attribute *attr,
 			    char *buf)
 {
@@ -106,8 +133,8 @@ static ssize_t rd_size_store(struct device *dev, struct device_attribute *attr,
 	if (kstrtou32(buf, 0, &new_value) != 0)
 		return -EINVAL;
 
-	if (new_value == 0 || new_value > WIN_SIZE)
-		new_value = WIN_SIZE;
+	if (new_value == 0 || new_value > r04flash_priv->win_size)
+		new_value = r04flash_priv->win_size;
 	r04flash_priv->rd_max_size = new_value;
 
 	printk(KERN_INFO "r04flash: set max read size to %d\n", new_value);
@@ -171,8 +198,8 @@ static ssize_t wr_size_store(struct device *dev, struct device_attribute *attr,
 	if (kstrtou32(buf, 0, &new_value) != 0)
 		return -EINVAL;
 
-	if (new_value == 0 || new_value > WIN_SIZE)
-		new_value = WIN_SIZE;
+	if (new_value == 0 || new_value > r04flash_priv->win_size)
+		new_value = r04flash_priv->win_size;
 
 	r04flash_priv->wr_max_size = new_value;
 
@@ -204,13 +231,48 @@ static ssize_t wr_timeout_store(struct device *dev,
 	return count;
 }
 
+/*
+ * Пороги объединения прерываний хранятся в регистрах bar0 и читаются
+ * устройством при каждом завершении, поэтому меняются без остановки очередей.
+ */
+#define R04FLASH_CSR_ATTR(_name)                                              \
+	static ssize_t _name##_show(struct device *dev,                       \
+				    struct device_attribute *attr, char *buf) \
+	{                                                                     \
+		return sprintf(buf, "%u\n",                                   \
+			       ioread32(&r04flash_priv->csr->_name));         \
+	}                                                                     \
+                                                                              \
+	static ssize_t _name##_store(struct device *dev,                      \
+				     struct device_attribute *attr,           \
+				     const char *buf, size_t count)           \
+	{                                                                     \
+		u32 new_value;                                                \
+                                                                              \
+		if (kstrtou32(buf, 0, &new_value) != 0)                       \
+			return -EINVAL;                                       \
+                                                                              \
+		iowrite32(new_value, &r04flash_priv->csr->_name);             \
+		printk(KERN_INFO "r04flash: set " #_name " to %u\n",          \
+		       new_value);                                            \
+		return count;                                                 \
+	}
+
+R04FLASH_CSR_ATTR(irq_coalesce_count)
+R04FLASH_CSR_ATTR(irq_coalesce_usec)
+
 static DEVICE_ATTR(disk_size, 0444, disk_size_show, NULL);
+static DEVICE_ATTR(win_size, 0444, win_size_show, NULL);
 static DEVICE_ATTR(rd_addr, 0664, rd_addr_show, rd_addr_store);
 static DEVICE_ATTR(wr_addr, 0664, wr_addr_show, wr_addr_store);
 static DEVICE_ATTR(rd_timeout, 0664, rd_timeout_show, rd_timeout_store);
 static DEVICE_ATTR(wr_timeout, 0664, wr_timeout_show, wr_timeout_store);
 static DEVICE_ATTR(rd_max_size, 0664, rd_size_show, rd_size_store);
 static DEVICE_ATTR(wr_max_size, 0664, wr_size_show, wr_size_store);
+static DEVICE_ATTR(irq_coalesce_count, 0664, irq_coalesce_count_show,
+		   irq_coalesce_count_store);
+static DEVICE_ATTR(irq_coalesce_usec, 0664, irq_coalesce_usec_show,
+		   irq_coalesce_usec_store);
 
 #define CREATE_SYSFS_ATTR(_cls, _attr)                                       \
 	err = device_create_file(_cls, &dev_attr_##_attr);                   \
@@ -244,196 +306,1117 @@ int create_char_devs(struct r04flash_data *drv)
 
 	// Создаем sysfs атрибут
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, disk_size);
+	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, win_size);
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, rd_addr);
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, wr_addr);
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, rd_max_size);
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, wr_max_size);
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, rd_timeout);
 	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, wr_timeout);
+	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, irq_coalesce_count);
+	CREATE_SYSFS_ATTR(r04flash_priv->r04flash, irq_coalesce_usec);
 
 	r04flash_priv->rd_timeout = R04FLASH_DEFAULT_TIMEOUT_U;
 	r04flash_priv->wr_timeout = R04FLASH_DEFAULT_TIMEOUT_U;
 	r04flash_priv->rd_addr = 0;
 	r04flash_priv->wr_addr = 0;
-	r04flash_priv->rd_max_size = WIN_SIZE;
-	r04flash_priv->wr_max_size = WIN_SIZE;
+	r04flash_priv->rd_max_size = drv->win_size;
+	r04flash_priv->wr_max_size = drv->win_size;
 
 	return 0;
 }
 
 static int r04flash_open(struct inode *inode, struct file *file)
 {
-	file->private_data =
-		kmemdup(r04flash_priv, sizeof(*r04flash_priv), GFP_KERNEL);
-	if (!file->private_data)
+	struct r04flash_data *priv;
+
+	priv = kmemdup(r04flash_priv, sizeof(*r04flash_priv), GFP_KERNEL);
+	if (!priv)
 		return -ENOMEM;
+	// резервы окон принадлежат файлу и не копируются
+	memset(priv->resv, 0, sizeof(priv->resv));
+	file->private_data = priv;
+	// io_uring и RWF_NOWAIT: вместо ожидания места в окне - -EAGAIN
+	file->f_mode |= FMODE_NOWAIT;
 	return 0;
 }
 
-static irqreturn_t r04flash_irq(int irq, void *dev_id)
+static void r04flash_queue_init(struct r04flash_queue *q,
+				enum pcie_queue_id qid,
+				__iomem struct pcie_queue *regs,
+				__iomem u32 *db, u32 win_size)
 {
-	irqreturn_t ret = IRQ_NONE;
-	if (get_pcie_bar0_rd_status_comp(r04flash_priv->csr)) {
-		unset_pcie_bar0_rd_status_comp(r04flash_priv->csr);
-		complete(&r04flash_priv->read_complete);
-		ret = IRQ_HANDLED;
-		printk(KERN_INFO "r04flash: got read complete IRQ\n");
+	u32 cq_tail;
+	int cid;
+
+	spin_lock_init(&q->lock);
+	q->qid = qid;
+	q->regs = regs;
+	q->db = db;
+
+	// продолжаем с того места очередей, на котором остановилось устройство
+	q->sq_tail = ioread32(&regs->sq_head);
+	cq_tail = ioread32(&regs->cq_tail);
+	q->cq_head = cq_tail & ~PCIE_CQ_TAIL_PHASE_MASK;
+	q->phase = !!(cq_tail & PCIE_CQ_TAIL_PHASE_MASK);
+
+	iowrite32(q->sq_tail, &regs->sq_tail);
+	iowrite32(q->cq_head, &regs->cq_head);
+
+	bitmap_zero(q->cid_map, QUEUE_DEPTH - 1);
+	bitmap_zero(q->win_map, R04FLASH_WIN_BLOCKS);
+	bitmap_zero(q->resv_map, R04FLASH_WIN_BLOCKS);
+	q->win_block = win_size / R04FLASH_WIN_BLOCKS;
+	init_waitqueue_head(&q->wait);
+	for (cid = 0; cid < QUEUE_DEPTH - 1; ++cid)
+		init_completion(&q->cmds[cid].done);
+}
+
+/*
+ * Выделяет идентификатор команды и участок окна под её данные (size == 0 -
+ * команда без данных). Участок выделяется блоками q->win_block: если
+ * fixed - ровно [*ofst, *ofst + *size) (участок из резерва файла, его
+ * проверяет вызывающий), иначе первый свободный вне резервов, при нехватке
+ * места запрос уменьшается вдвое, а в *size и *ofst возвращается выделенное.
+ */
+static int r04flash_cmd_try(struct r04flash_queue *q, u32 *size, u32 *ofst,
+			    bool fixed)
+{
+	DECLARE_BITMAP(busy, R04FLASH_WIN_BLOCKS);
+	struct r04flash_cmd *cmd;
+	unsigned long flags, pos = 0;
+	unsigned int n = 0;
+	int cid;
+
+	spin_lock_irqsave(&q->lock, flags);
+	cid = find_first_zero_bit(q->cid_map, QUEUE_DEPTH - 1);
+	if (cid >= QUEUE_DEPTH - 1) {
+		cid = -EBUSY;
+		goto out;
 	}
-	if (get_pcie_bar0_wr_status_comp(r04flash_priv->csr)) {
-		unset_pcie_bar0_wr_status_comp(r04flash_priv->csr);
-		complete(&r04flash_priv->write_complete);
-		ret = IRQ_HANDLED;
-		printk(KERN_INFO "r04flash: got write complete IRQ\n");
+
+	if (*size && fixed) {
+		pos = *ofst / q->win_block;
+		n = DIV_ROUND_UP(*ofst + *size, q->win_block) - pos;
+		if (find_next_bit(q->win_map, pos + n, pos) < pos + n) {
+			cid = -EBUSY;
+			goto out;
+		}
+	} else if (*size) {
+		bitmap_or(busy, q->win_map, q->resv_map, R04FLASH_WIN_BLOCKS);
+		for (n = DIV_ROUND_UP(*size, q->win_block); n; n /= 2) {
+			pos = bitmap_find_next_zero_area(
+				busy, R04FLASH_WIN_BLOCKS, 0, n, 0);
+			if (pos < R04FLASH_WIN_BLOCKS)
+				break;
+		}
+		if (!n) {
+			cid = -EBUSY;
+			goto out;
+		}
+		*ofst = pos * q->win_block;
+		*size = min_t(u32, *size, n * q->win_block);
 	}
 
-	return ret;
+	bitmap_set(q->win_map, pos, n);
+	__set_bit(cid, q->cid_map);
+
+	cmd = &q->cmds[cid];
+	cmd->buf_ofst = *ofst;
+	cmd->size = *size;
+	cmd->win_first = pos;
+	cmd->win_blocks = n;
+	cmd->sgl_ofst = 0;
+	cmd->sgl_num = 0;
+	cmd->aio = NULL;
+	cmd->rq = NULL;
+	cmd->abandoned = false;
+	reinit_completion(&cmd->done);
+out:
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return cid;
 }
 
-static ssize_t r04flash_read(struct file *file, char __user *buf, size_t count,
-			     loff_t *offset)
+// r04flash_cmd_try с ожиданием освобождения ресурсов, с nowait вместо
+// ожидания -EAGAIN
+static int r04flash_cmd_get(struct r04flash_queue *q, u32 *size, u32 *ofst,
+			    bool fixed, bool nowait)
 {
-	struct r04flash_data *dev = file->private_data;
-	int timeout, ret = 0, err;
-	u64 addr = dev->rd_addr;
-	u32 size;
+	int cid, err;
 
-	printk(KERN_INFO "r04flash: read(addr=0x%llx, size=0x%lx)", addr,
-	       count);
+	cid = r04flash_cmd_try(q, size, ofst, fixed);
+	if (cid != -EBUSY)
+		return cid;
+	if (nowait)
+		return -EAGAIN;
 
-	while (count) {
-		err = mutex_lock_interruptible(&r04flash_sync.read_lock);
-		if (err)
-			return err;
+	err = wait_event_interruptible(
+		q->wait, (cid = r04flash_cmd_try(q, size, ofst, fixed)) != -EBUSY);
+	return err ? err : cid;
+}
 
-		size = count < dev->rd_max_size ? count : dev->rd_max_size;
-		printk(KERN_INFO "r04flash: read_chuck(addr=0x%llx, size=0x%x)",
-		       addr, size);
+// освобождение идентификатора и участка окна, вызывается под q->lock
+static void __r04flash_cmd_free(struct r04flash_queue *q, int cid)
+{
+	struct r04flash_cmd *cmd = &q->cmds[cid];
 
-		reinit_completion(&r04flash_priv->read_complete);
+	bitmap_clear(q->win_map, cmd->win_first, cmd->win_blocks);
+	cmd->win_blocks = 0;
+	__clear_bit(cid, q->cid_map);
+	wake_up(&q->wait);
+}
 
-		iowrite32(size, &dev->csr->rd_desc.size);
-		iowrite32(addr >> 32, &dev->csr->rd_desc.addr_high);
-		iowrite32(addr, &dev->csr->rd_desc.addr_low);
+// освобождение так и не отправленной команды
+static void r04flash_cmd_free(struct r04flash_queue *q, int cid)
+{
+	unsigned long flags;
 
-		set_pcie_bar0_rd_ctrl_start(dev->csr);
+	spin_lock_irqsave(&q->lock, flags);
+	__r04flash_cmd_free(q, cid);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
 
-		timeout = wait_for_completion_interruptible_timeout(
-			&r04flash_priv->read_complete, dev->rd_timeout);
-		if (timeout == 0) {
-			ret = -ETIMEDOUT;
-			goto err;
-		} else if (timeout < 0) {
-			ret = -EFAULT;
-			goto err;
-		}
+/*
+ * Освобождает идентификатор команды. Если завершение ещё не получено,
+ * команда помечается брошенной и освобождается обработчиком прерывания
+ * (вместе с участком окна, в который устройство ещё может писать).
+ */
+static void r04flash_cmd_put(struct r04flash_queue *q, int cid)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (completion_done(&q->cmds[cid].done))
+		__r04flash_cmd_free(q, cid);
+	else
+		q->cmds[cid].abandoned = true;
+	spin_unlock_irqrestore(&q->lock, flags);
+}
 
-		memcpy_fromio(r04flash_sync.rd_data_buf, dev->data->rd_data,
-			      size);
+// данные команды (buf_ofst) берутся из выделения r04flash_cmd_get, список
+// экстентов (sgl_ofst/sgl_num) - из r04flash_cmd
+static void r04flash_cmd_submit(struct r04flash_queue *q, int cid, u8 opcode,
+				u8 sqe_flags, u64 addr, u32 size)
+{
+	__iomem struct pcie_sqe *sqe;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	sqe = &q->regs->sq[q->sq_tail];
+	iowrite8(opcode, &sqe->opcode);
+	iowrite8(sqe_flags, &sqe->flags);
+	iowrite16(cid, &sqe->cid);
+	iowrite32(size, &sqe->size);
+	iowrite32(addr, &sqe->addr_low);
+	iowrite32(addr >> 32, &sqe->addr_high);
+	iowrite32(q->cmds[cid].buf_ofst, &sqe->buf_ofst);
+	iowrite32(q->cmds[cid].sgl_ofst, &sqe->sgl_ofst);
+	iowrite32(q->cmds[cid].sgl_num, &sqe->sgl_num);
+	q->sq_tail = (q->sq_tail + 1) % QUEUE_DEPTH;
+	q->cmds[cid].submit_ns = ktime_get_ns();
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	trace_r04flash_submit(q->qid, cid, opcode, addr, size);
+}
 
-		if (copy_to_user(buf, r04flash_sync.rd_data_buf, size)) {
-			ret = -EFAULT;
-			goto err;
-		}
+// публикует все отправленные команды одной записью в doorbell
+static void r04flash_queue_ring(struct r04flash_queue *q)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	trace_r04flash_doorbell(q->qid, q->sq_tail);
+	iowrite32(q->sq_tail, &q->regs->sq_tail);
+	// запись в перехватываемый doorbell будит эмулятор
+	if (q->db)
+		iowrite32(q->sq_tail, q->db);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static __iomem struct pcie_db *r04flash_find_doorbell(__iomem void *csr,
+						       unsigned long len)
+{
+	__iomem struct pcie_db *db;
+
+	if (len < sizeof(struct pcie_bar0) + PCIE_DB_SIZE)
+		return NULL;
+
+	db = csr + len - PCIE_DB_SIZE;
+	if (ioread32(&db->magic) != PCIE_DB_MAGIC)
+		return NULL;
+
+	return db;
+}
+
+static int r04flash_status_to_err(u8 status)
+{
+	if (status & PCIE_CQE_STATUS_ADDR_ERROR_MASK)
+		return R04_ADDRINVAL;
+	if (status & PCIE_CQE_STATUS_SIZE_ERROR_MASK)
+		return R04_SIZEINVAL;
+	if (status & PCIE_CQE_STATUS_OP_ERROR_MASK)
+		return R04_OPINVAL;
+	if (status & PCIE_CQE_STATUS_IO_ERROR_MASK)
+		return R04_IOERR;
+	return 0;
+}
+
+// ожидание завершения, идентификатор освобождает вызывающий (r04flash_cmd_put)
+static int r04flash_cmd_wait(struct r04flash_queue *q, int cid, int timeout)
+{
+	long left;
+
+	left = wait_for_completion_interruptible_timeout(&q->cmds[cid].done,
+							 timeout);
+	if (left == 0) {
+		this_cpu_inc(r04flash_stats[q->qid].timeouts);
+		return -ETIMEDOUT;
+	}
+	else if (left < 0)
+		return -EFAULT;
+
+	// ошибки устройства (R04_*) - не errno, процессу они видны как -EIO
+	return r04flash_status_to_err(q->cmds[cid].status) ? -EIO : 0;
+}
+
+// учёт завершённой команды в статистике направления (на текущем процессоре)
+static void r04flash_cmd_account(struct r04flash_queue *q, int cid)
+{
+	struct r04flash_cmd *cmd = &q->cmds[cid];
+	u64 latency = ktime_get_ns() - cmd->submit_ns;
+	int bucket = min_t(int, fls64(div_u64(latency, NSEC_PER_USEC)),
+			   R04FLASH_LAT_BUCKETS - 1);
+
+	trace_r04flash_complete(q->qid, cid, cmd->status, cmd->result,
+				latency);
+
+	this_cpu_inc(r04flash_stats[q->qid].ops);
+	this_cpu_inc(r04flash_stats[q->qid].latency[bucket]);
+	if (r04flash_status_to_err(cmd->status))
+		this_cpu_inc(r04flash_stats[q->qid].errors);
+	else
+		this_cpu_add(r04flash_stats[q->qid].bytes, cmd->result);
+}
 
-		if (get_pcie_bar0_rd_status_addr_error(dev->csr)) {
-			ret = R04_ADDRINVAL;
-			goto err;
+/*
+ * Обработка очереди завершения, вызывается из обработчика прерывания.
+ * Запросы блочного устройства завершаются после снятия q->lock: обработчик
+ * завершения блочного уровня может выполниться сразу и освобождает команду.
+ */
+static bool r04flash_queue_complete(struct r04flash_queue *q)
+{
+	struct request *rqs[QUEUE_DEPTH - 1];
+	__iomem struct pcie_cqe *cqe;
+	struct r04flash_cmd *cmd;
+	int i, nr_rqs = 0, handled = 0;
+	u16 cid;
+
+	spin_lock(&q->lock);
+	for (;;) {
+		cqe = &q->regs->cq[q->cq_head];
+		if (get_pcie_cqe_status_phase(cqe) != q->phase)
+			break;
+
+		cid = ioread16(&cqe->cid);
+		if (cid < QUEUE_DEPTH - 1 && test_bit(cid, q->cid_map)) {
+			cmd = &q->cmds[cid];
+			cmd->status = ioread8(&cqe->status);
+			cmd->result = ioread32(&cqe->result);
+			r04flash_cmd_account(q, cid);
+			if (cmd->abandoned) {
+				__r04flash_cmd_free(q, cid);
+			} else {
+				complete(&cmd->done);
+				// данные асинхронного запроса забирает рабочий поток
+				if (cmd->aio)
+					queue_work(system_unbound_wq,
+						   &cmd->aio->work);
+				else if (cmd->rq)
+					rqs[nr_rqs++] = cmd->rq;
+			}
 		}
-		if (get_pcie_bar0_rd_status_size_error(dev->csr)) {
-			ret = R04_SIZEINVAL;
-			goto err;
+
+		if (++q->cq_head == QUEUE_DEPTH) {
+			q->cq_head = 0;
+			q->phase ^= 1;
 		}
+		++handled;
+	}
 
-		ret += size;
-		count -= size;
-		addr += size;
-		buf += size;
-		mutex_unlock(&r04flash_sync.read_lock);
+	if (handled)
+		iowrite32(q->cq_head, &q->regs->cq_head);
+	spin_unlock(&q->lock);
+
+	if (handled)
+		trace_r04flash_irq(q->qid, handled);
+
+	for (i = 0; i < nr_rqs; ++i)
+		blk_mq_complete_request(rqs[i]);
+
+	return handled > 0;
+}
+
+static irqreturn_t r04flash_irq(int irq, void *dev_id)
+{
+	irqreturn_t ret = IRQ_NONE;
+	int qid;
+
+	for (qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+		if (r04flash_queue_complete(&r04flash_sync.queues[qid]))
+			ret = IRQ_HANDLED;
 	}
 
 	return ret;
-err:
-	mutex_unlock(&r04flash_sync.read_lock);
-	return err;
 }
 
-static ssize_t r04flash_write(struct file *file, const char __user *buf,
-			      size_t count, loff_t *offset)
+// обработчик вектора одной очереди (dev_id - очередь)
+static irqreturn_t r04flash_queue_irq(int irq, void *dev_id)
 {
-	struct r04flash_data *dev = file->private_data;
-	int timeout, ret = 0, err;
-	u64 addr = dev->wr_addr;
-	u32 size;
+	return r04flash_queue_complete(dev_id) ? IRQ_HANDLED : IRQ_NONE;
+}
 
-	printk(KERN_INFO "r04flash: write(addr=0x%llx, size=0x%lx)", addr,
-	       count);
+static const char *const r04flash_irq_names[PCIE_QUEUES_NUM] = {
+	[PCIE_RD_QUEUE] = "r04flash-rd",
+	[PCIE_WR_QUEUE] = "r04flash-wr",
+};
 
-	while (count) {
-		err = mutex_lock_interruptible(&r04flash_sync.write_lock);
+/*
+ * Если устройство выделило вектор на каждую очередь, обработчики вешаются
+ * по одному на очередь, иначе единственный вектор разбирает все очереди.
+ */
+static int r04flash_request_irqs(struct pci_dev *pdev,
+				 struct r04flash_data *dev)
+{
+	int qid, err;
+
+	if (dev->nr_vectors < PCIE_QUEUES_NUM)
+		return request_irq(pci_irq_vector(pdev, 0), r04flash_irq, 0,
+				   DEVICE_NAME, pdev);
+
+	for (qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+		err = request_irq(pci_irq_vector(pdev, qid),
+				  r04flash_queue_irq, 0, r04flash_irq_names[qid],
+				  &r04flash_sync.queues[qid]);
 		if (err)
+			goto err_free;
+	}
+
+	return 0;
+err_free:
+	while (--qid >= 0)
+		free_irq(pci_irq_vector(pdev, qid), &r04flash_sync.queues[qid]);
+	return err;
+}
+
+static void r04flash_free_irqs(struct pci_dev *pdev, struct r04flash_data *dev)
+{
+	int qid;
+
+	if (dev->nr_vectors < PCIE_QUEUES_NUM) {
+		free_irq(pci_irq_vector(pdev, 0), pdev);
+		return;
+	}
+
+	for (qid = 0; qid < PCIE_QUEUES_NUM; ++qid)
+		free_irq(pci_irq_vector(pdev, qid), &r04flash_sync.queues[qid]);
+}
+
+/*
+ * Синхронные read/write идут конвейером: запрос режется на части не больше
+ * слота окна (R04FLASH_WIN_SLOTS), и пока устройство обрабатывает одну
+ * часть, драйвер копирует данные соседней. Части завершаются по порядку,
+ * место в окне освободившейся части сразу занимает следующая.
+ */
+static u32 r04flash_chunk_size(struct r04flash_data *dev, u32 max_size)
+{
+	return min_t(u32, max_size, dev->win_size / R04FLASH_WIN_SLOTS);
+}
+
+static ssize_t r04flash_read_sync(struct r04flash_data *dev,
+				  struct iov_iter *to, u64 addr, bool nowait)
+{
+	struct r04flash_queue *q = &r04flash_sync.queues[PCIE_RD_QUEUE];
+	u32 chunk = r04flash_chunk_size(dev, dev->rd_max_size);
+	struct r04flash_cmd *cmd;
+	int pipe[QUEUE_DEPTH - 1];
+	int head = 0, n = 0, cid = 0, err;
+	bool submitted;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	u32 size, ofst;
+
+	while (count || n) {
+		// дозаполняем конвейер, пока есть место в окне и очереди;
+		// освобождения ждём, только если в работе ничего нет
+		for (submitted = false; count; submitted = true) {
+			size = min_t(size_t, count, chunk);
+			cid = r04flash_cmd_get(q, &size, &ofst, false,
+					       n > 0 || nowait);
+			if (cid < 0)
+				break;
+
+			r04flash_cmd_submit(q, cid, PCIE_OP_READ, 0, addr, size);
+			pipe[(head + n++) % (QUEUE_DEPTH - 1)] = cid;
+
+			addr += size;
+			count -= size;
+		}
+		if (n == 0)
+			return ret ?: cid;
+		if (submitted)
+			r04flash_queue_ring(q);
+
+		// забираем данные самой старой части
+		cmd = &q->cmds[pipe[head]];
+		size = cmd->size;
+		err = r04flash_cmd_wait(q, pipe[head], dev->rd_timeout);
+		if (!err &&
+		    copy_to_iter(dev->rd_win + cmd->buf_ofst, size, to) != size)
+			err = -EFAULT;
+		r04flash_cmd_put(q, pipe[head]);
+		head = (head + 1) % (QUEUE_DEPTH - 1);
+		--n;
+
+		if (err) {
+			for (; n; --n, head = (head + 1) % (QUEUE_DEPTH - 1))
+				r04flash_cmd_put(q, pipe[head]);
 			return err;
+		}
+		ret += size;
+	}
 
-		size = count < dev->wr_max_size ? count : dev->wr_max_size;
-		printk(KERN_INFO
-		       "r04flash: write_chuck(addr=0x%llx, size=0x%x)",
-		       addr, size);
+	return ret;
+}
 
-		reinit_completion(&r04flash_priv->write_complete);
+static ssize_t r04flash_write_sync(struct r04flash_data *dev,
+				   struct iov_iter *from, u64 addr,
+				   u8 sqe_flags, bool nowait)
+{
+	struct r04flash_queue *q = &r04flash_sync.queues[PCIE_WR_QUEUE];
+	u32 chunk = r04flash_chunk_size(dev, dev->wr_max_size);
+	int pipe[QUEUE_DEPTH - 1];
+	int head = 0, n = 0, cid = 0, err;
+	bool submitted;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	u32 size, ofst;
+
+	while (count || n) {
+		// дозаполняем конвейер, пока есть место в окне и очереди;
+		// освобождения ждём, только если в работе ничего нет
+		for (submitted = false; count; submitted = true) {
+			size = min_t(size_t, count, chunk);
+			cid = r04flash_cmd_get(q, &size, &ofst, false,
+					       n > 0 || nowait);
+			if (cid < 0)
+				break;
+
+			if (copy_from_iter(dev->wr_win + ofst, size, from) !=
+			    size) {
+				// отправленные части дописываются, новые - нет
+				r04flash_cmd_free(q, cid);
+				cid = -EFAULT;
+				count = 0;
+				break;
+			}
+
+			r04flash_cmd_submit(q, cid, PCIE_OP_WRITE, sqe_flags,
+					    addr, size);
+			pipe[(head + n++) % (QUEUE_DEPTH - 1)] = cid;
+
+			addr += size;
+			count -= size;
+		}
+		if (n == 0)
+			return ret && cid != -EFAULT ? ret : cid;
+		if (submitted) {
+			// данные в окне записи видны устройству до doorbell
+			wmb();
+			r04flash_queue_ring(q);
+		}
 
-		iowrite32(size, &dev->csr->wr_desc.size);
-		iowrite32(addr >> 32, &dev->csr->wr_desc.addr_high);
-		iowrite32(addr, &dev->csr->wr_desc.addr_low);
+		// дожидаемся самой старой части
+		size = q->cmds[pipe[head]].size;
+		err = r04flash_cmd_wait(q, pipe[head], dev->wr_timeout);
+		r04flash_cmd_put(q, pipe[head]);
+		head = (head + 1) % (QUEUE_DEPTH - 1);
+		--n;
 
-		if (copy_from_user(r04flash_sync.wr_data_buf, buf, size)) {
-			ret = -EFAULT;
-			goto err;
+		if (err) {
+			for (; n; --n, head = (head + 1) % (QUEUE_DEPTH - 1))
+				r04flash_cmd_put(q, pipe[head]);
+			return err;
 		}
+		ret += size;
+	}
 
-		memcpy_toio(dev->data->wr_data, r04flash_sync.wr_data_buf,
-			    size);
+	return cid == -EFAULT ? -EFAULT : ret;
+}
 
-		set_pcie_bar0_wr_ctrl_start(dev->csr);
+static void r04flash_aio_free(struct r04flash_aio *aio)
+{
+	if (aio->mm)
+		mmdrop(aio->mm);
+	kfree(aio->iov);
+	kfree(aio);
+}
 
-		timeout = wait_for_completion_interruptible_timeout(
-			&r04flash_priv->write_complete, dev->wr_timeout);
-		if (timeout == 0) {
-			ret = -ETIMEDOUT;
-			goto err;
-		} else if (timeout < 0) {
-			ret = -EFAULT;
-			goto err;
+// отправка очередной команды запроса (не больше max_size байт)
+static int r04flash_aio_step(struct r04flash_aio *aio, bool nowait)
+{
+	struct r04flash_data *dev = aio->dev;
+	struct r04flash_queue *q = aio->q;
+	u32 size, ofst;
+	int cid;
+
+	size = min_t(size_t, iov_iter_count(&aio->iter),
+		     aio->opcode == PCIE_OP_READ ? dev->rd_max_size :
+						   dev->wr_max_size);
+	cid = r04flash_cmd_get(q, &size, &ofst, false, nowait);
+	if (cid < 0)
+		return cid;
+
+	if (aio->opcode == PCIE_OP_WRITE) {
+		if (copy_from_iter(dev->wr_win + ofst, size, &aio->iter) !=
+		    size) {
+			r04flash_cmd_free(q, cid);
+			return -EFAULT;
 		}
+		wmb();
+	}
+
+	// после doorbell запрос принадлежит обработчику завершения
+	aio->cid = cid;
+	q->cmds[cid].aio = aio;
+	r04flash_cmd_submit(q, cid, aio->opcode, aio->sqe_flags, aio->addr,
+			    size);
+	r04flash_queue_ring(q);
+	return 0;
+}
 
-		if (get_pcie_bar0_wr_status_addr_error(dev->csr)) {
-			ret = R04_ADDRINVAL;
-			goto err;
+// завершение команды асинхронного запроса, выполняется в рабочем потоке
+static void r04flash_aio_work(struct work_struct *work)
+{
+	struct r04flash_aio *aio =
+		container_of(work, struct r04flash_aio, work);
+	struct r04flash_queue *q = aio->q;
+	struct r04flash_cmd *cmd = &q->cmds[aio->cid];
+	struct mm_struct *mm = NULL;
+	struct kiocb *iocb = aio->iocb;
+	u32 size = cmd->size;
+	long err = 0;
+
+	if (r04flash_status_to_err(cmd->status))
+		err = -EIO;
+
+	// итератор ссылается на память процесса, работаем в его адресном
+	// пространстве (если процесс ещё жив)
+	if (!err && aio->mm) {
+		if (mmget_not_zero(aio->mm)) {
+			mm = aio->mm;
+			kthread_use_mm(mm);
+		} else {
+			err = -EFAULT;
 		}
-		if (get_pcie_bar0_wr_status_size_error(dev->csr)) {
-			ret = R04_SIZEINVAL;
-			goto err;
+	}
+
+	if (!err && aio->opcode == PCIE_OP_READ &&
+	    copy_to_iter(aio->dev->rd_win + cmd->buf_ofst, size, &aio->iter) !=
+		    size)
+		err = -EFAULT;
+	r04flash_cmd_put(q, aio->cid);
+
+	if (!err) {
+		aio->done += size;
+		aio->addr += size;
+		// запрос продолжается, следующее завершение снова придёт сюда
+		if (iov_iter_count(&aio->iter)) {
+			err = r04flash_aio_step(aio, false);
+			if (!err)
+				goto out;
 		}
+	}
 
-		ret += size;
-		count -= size;
-		addr += size;
-		buf += size;
-		mutex_unlock(&r04flash_sync.write_lock);
+	err = err ?: aio->done;
+	r04flash_aio_free(aio);
+	iocb->ki_complete(iocb, err);
+out:
+	if (mm) {
+		kthread_unuse_mm(mm);
+		mmput(mm);
+	}
+}
+
+static ssize_t r04flash_aio_submit(struct kiocb *iocb, struct iov_iter *iter,
+				   enum pcie_queue_id qid, u8 opcode,
+				   u8 sqe_flags, u64 addr)
+{
+	struct r04flash_aio *aio;
+	int err;
+
+	if (!iov_iter_count(iter))
+		return 0;
+
+	aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+	if (!aio)
+		return -ENOMEM;
+
+	// вектор вызывающего может не пережить возврат из вызова
+	aio->iov = dup_iter(&aio->iter, iter, GFP_KERNEL);
+	if (!aio->iov && !iter_is_ubuf(iter)) {
+		kfree(aio);
+		return -ENOMEM;
+	}
+	if (user_backed_iter(iter)) {
+		aio->mm = current->mm;
+		mmgrab(aio->mm);
 	}
 
+	aio->iocb = iocb;
+	aio->dev = iocb->ki_filp->private_data;
+	aio->q = &r04flash_sync.queues[qid];
+	INIT_WORK(&aio->work, r04flash_aio_work);
+	aio->opcode = opcode;
+	aio->sqe_flags = sqe_flags;
+	aio->addr = addr;
+
+	err = r04flash_aio_step(aio, iocb->ki_flags & IOCB_NOWAIT);
+	if (err) {
+		r04flash_aio_free(aio);
+		return err;
+	}
+
+	return -EIOCBQUEUED;
+}
+
+/*
+ * Позиция файла - смещение от базового адреса направления (rd_addr/wr_addr,
+ * по умолчанию 0), так что pread/pwrite адресуют устройство без отдельной
+ * установки адреса. Запрос обрезается по размеру диска: чтение за концом
+ * возвращает 0, запись - -ENOSPC.
+ */
+static ssize_t r04flash_io_prep(struct r04flash_data *dev, u64 base,
+				loff_t pos, struct iov_iter *iter, u64 *addr)
+{
+	u64 disk_size = ioread32(&dev->csr->disk_size);
+
+	if (pos < 0)
+		return -EINVAL;
+
+	*addr = base + pos;
+	if (*addr < base || *addr >= disk_size)
+		return 0;
+
+	iov_iter_truncate(iter, disk_size - *addr);
+	return iov_iter_count(iter);
+}
+
+static ssize_t r04flash_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct r04flash_data *dev = iocb->ki_filp->private_data;
+	ssize_t ret;
+	u64 addr;
+
+	ret = r04flash_io_prep(dev, dev->rd_addr, iocb->ki_pos, to, &addr);
+	if (ret <= 0)
+		return ret;
+
+	if (!is_sync_kiocb(iocb))
+		return r04flash_aio_submit(iocb, to, PCIE_RD_QUEUE,
+					   PCIE_OP_READ, 0, addr);
+
+	ret = r04flash_read_sync(dev, to, addr, iocb->ki_flags & IOCB_NOWAIT);
+	if (ret > 0)
+		iocb->ki_pos += ret;
 	return ret;
-err:
-	mutex_unlock(&r04flash_sync.write_lock);
+}
+
+static ssize_t r04flash_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct r04flash_data *dev = iocb->ki_filp->private_data;
+	// O_SYNC/O_DSYNC и RWF_DSYNC - запись сразу сбрасывается на носитель
+	u8 sqe_flags = (iocb->ki_flags & IOCB_DSYNC) ? PCIE_SQE_FLAG_FUA : 0;
+	ssize_t ret;
+	u64 addr;
+
+	if (!iov_iter_count(from))
+		return 0;
+
+	ret = r04flash_io_prep(dev, dev->wr_addr, iocb->ki_pos, from, &addr);
+	if (ret <= 0)
+		return ret ?: -ENOSPC;
+
+	if (!is_sync_kiocb(iocb))
+		return r04flash_aio_submit(iocb, from, PCIE_WR_QUEUE,
+					   PCIE_OP_WRITE, sqe_flags, addr);
+
+	ret = r04flash_write_sync(dev, from, addr, sqe_flags,
+				  iocb->ki_flags & IOCB_NOWAIT);
+	if (ret > 0)
+		iocb->ki_pos += ret;
 	return ret;
 }
 
+// SEEK_END отсчитывается от размера диска
+static loff_t r04flash_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct r04flash_data *dev = file->private_data;
+
+	return fixed_size_llseek(file, offset, whence,
+				 ioread32(&dev->csr->disk_size));
+}
+
+/*
+ * Сбрасывает на носитель устройства все завершённые записи командой FLUSH:
+ * записи, вернувшиеся из write до вызова, и асинхронные записи, завершение
+ * которых уже получено.
+ */
+static int r04flash_fsync(struct file *file, loff_t start, loff_t end,
+			  int datasync)
+{
+	struct r04flash_data *dev = file->private_data;
+	struct r04flash_queue *q = &r04flash_sync.queues[PCIE_WR_QUEUE];
+	u32 size = 0, ofst = 0;
+	int cid, err;
+
+	cid = r04flash_cmd_get(q, &size, &ofst, false, false);
+	if (cid < 0)
+		return cid;
+
+	r04flash_cmd_submit(q, cid, PCIE_OP_FLUSH, 0, 0, 0);
+	r04flash_queue_ring(q);
+	err = r04flash_cmd_wait(q, cid, dev->wr_timeout);
+	r04flash_cmd_put(q, cid);
+
+	return err;
+}
+
+/*
+ * Отображает хранилище из bar4 в адресное пространство процесса, смещение
+ * отображения равно адресу на диске. Чтение и запись идут напрямую, без
+ * команд, и не упорядочены с read/write. Сохранение на носителе - через
+ * msync/fsync (команда FLUSH).
+ */
+static int r04flash_mmap_storage(struct r04flash_data *dev,
+				 struct vm_area_struct *vma)
+{
+	u64 len;
+
+	if (!dev->storage_len)
+		return -ENODEV;
+
+	// bar дополнен до степени двойки, за размером диска памяти нет
+	len = min_t(u64, dev->storage_len,
+		    PAGE_ALIGN((u64)ioread32(&dev->csr->disk_size)));
+	if (!len)
+		return -ENODEV;
+
+	// bar prefetchable: записи объединяются, побочных эффектов у чтения нет
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	return vm_iomap_memory(vma, dev->storage_start, len);
+}
+
+/*
+ * Отображает окно передачи для работы через R04FLASH_IOCTL_CMD. Тип памяти -
+ * тот же, что у отображения окна в ядре (memremap в probe): окно чтения
+ * кэшируемое, окно записи write-combining.
+ */
+static int r04flash_mmap_windows(struct r04flash_data *dev,
+				 struct vm_area_struct *vma)
+{
+	phys_addr_t start;
+
+	if (vma->vm_pgoff >= R04FLASH_MMAP_WR_WIN >> PAGE_SHIFT) {
+		vma->vm_pgoff -= R04FLASH_MMAP_WR_WIN >> PAGE_SHIFT;
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+		start = dev->wr_win_start;
+	} else {
+		vma->vm_pgoff -= R04FLASH_MMAP_RD_WIN >> PAGE_SHIFT;
+		start = dev->rd_win_start;
+	}
+	return vm_iomap_memory(vma, start, dev->win_size);
+}
+
+static int r04flash_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct r04flash_data *dev = file->private_data;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (vma->vm_pgoff >= R04FLASH_MMAP_RD_WIN >> PAGE_SHIFT)
+		return r04flash_mmap_windows(dev, vma);
+	return r04flash_mmap_storage(dev, vma);
+}
+
+// снятие резерва файла в окне очереди q
+static void r04flash_resv_drop(struct r04flash_data *dev,
+			       struct r04flash_queue *q)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (dev->resv[q->qid].blocks) {
+		bitmap_clear(q->resv_map, dev->resv[q->qid].first,
+			     dev->resv[q->qid].blocks);
+		dev->resv[q->qid].blocks = 0;
+		wake_up(&q->wait);
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+// резервирование блоков [first, first + blocks), если их не занимают ни
+// команды, ни резервы других файлов
+static bool r04flash_resv_try(struct r04flash_data *dev,
+			      struct r04flash_queue *q, u32 first, u32 blocks)
+{
+	u32 end = first + blocks;
+	unsigned long flags;
+	bool ok;
+
+	spin_lock_irqsave(&q->lock, flags);
+	ok = find_next_bit(q->win_map, end, first) >= end &&
+	     find_next_bit(q->resv_map, end, first) >= end;
+	if (ok) {
+		bitmap_set(q->resv_map, first, blocks);
+		dev->resv[q->qid].first = first;
+		dev->resv[q->qid].blocks = blocks;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return ok;
+}
+
+// лежит ли участок окна [ofst, ofst + size) внутри резерва файла
+static bool r04flash_resv_covers(struct r04flash_data *dev,
+				 struct r04flash_queue *q, u32 ofst, u32 size)
+{
+	unsigned long flags;
+	u64 start, end;
+
+	spin_lock_irqsave(&q->lock, flags);
+	start = (u64)dev->resv[q->qid].first * q->win_block;
+	end = start + (u64)dev->resv[q->qid].blocks * q->win_block;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return ofst >= start && (u64)ofst + size <= end;
+}
+
+/*
+ * Резервирует за файлом участок окна, прежний резерв того же окна снимается.
+ * Пока участок занят командами или резервом другого файла, ждёт.
+ */
+static long r04flash_ioctl_reserve(struct r04flash_data *dev,
+				   struct r04flash_ioctl_resv __user *uresv)
+{
+	struct r04flash_ioctl_resv resv;
+	struct r04flash_queue *q;
+	u32 first, blocks;
+
+	if (copy_from_user(&resv, uresv, sizeof(resv)))
+		return -EFAULT;
+
+	// первый слот окна не резервируется: там всегда найдётся место для
+	// read/write и запроса блочного устройства
+	if (resv.qid >= PCIE_QUEUES_NUM ||
+	    (resv.size &&
+	     (resv.ofst < dev->win_size / R04FLASH_WIN_SLOTS ||
+	      resv.ofst >= dev->win_size ||
+	      resv.size > dev->win_size - resv.ofst)))
+		return -EINVAL;
+
+	q = &r04flash_sync.queues[resv.qid];
+	r04flash_resv_drop(dev, q);
+	if (!resv.size)
+		return 0;
+
+	first = resv.ofst / q->win_block;
+	blocks = DIV_ROUND_UP(resv.ofst + resv.size, q->win_block) - first;
+
+	return wait_event_interruptible(
+		q->wait, r04flash_resv_try(dev, q, first, blocks));
+}
+
+/*
+ * Выполняет одну команду над отображёнными окнами. Участок окна
+ * [buf_ofst, buf_ofst + size) должен лежать в резерве файла, так что
+ * read/write и асинхронные запросы его не занимают ни во время команды, ни
+ * пока процесс готовит или забирает данные. Возвращает 0, если устройство
+ * завершило команду (статус - в cmd.status), иначе ошибку ожидания.
+ */
+static long r04flash_ioctl_cmd(struct r04flash_data *dev,
+			       struct r04flash_ioctl_cmd __user *ucmd)
+{
+	struct r04flash_ioctl_cmd cmd;
+	struct r04flash_queue *q;
+	u32 win_size = 0, ofst;
+	int cid, timeout;
+	long err;
+
+	if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+		return -EFAULT;
+
+	switch (cmd.opcode) {
+	case PCIE_OP_READ:
+	case PCIE_OP_WRITE:
+		if (!cmd.size || cmd.buf_ofst >= dev->win_size ||
+		    cmd.size > dev->win_size - cmd.buf_ofst)
+			return -EINVAL;
+		win_size = cmd.size;
+		break;
+	case PCIE_OP_FLUSH:
+	case PCIE_OP_DISCARD:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (cmd.opcode == PCIE_OP_READ) {
+		q = &r04flash_sync.queues[PCIE_RD_QUEUE];
+		timeout = dev->rd_timeout;
+	} else {
+		q = &r04flash_sync.queues[PCIE_WR_QUEUE];
+		timeout = dev->wr_timeout;
+	}
+
+	if (win_size && !r04flash_resv_covers(dev, q, cmd.buf_ofst, win_size))
+		return -EINVAL;
+
+	ofst = cmd.buf_ofst;
+	cid = r04flash_cmd_get(q, &win_size, &ofst, true, false);
+	if (cid < 0)
+		return cid;
+
+	// данные процесса в окне (через WC отображение) видны до doorbell
+	wmb();
+	r04flash_cmd_submit(q, cid, cmd.opcode, cmd.flags, cmd.addr, cmd.size);
+	r04flash_queue_ring(q);
+
+	err = r04flash_cmd_wait(q, cid, timeout);
+	if (err != -ETIMEDOUT && err != -EFAULT) {
+		cmd.status = q->cmds[cid].status;
+		cmd.result = q->cmds[cid].result;
+		err = copy_to_user(ucmd, &cmd, sizeof(cmd)) ? -EFAULT : 0;
+	}
+	r04flash_cmd_put(q, cid);
+
+	return err;
+}
+
+/*
+ * Выполняет команду с PCIE_SQE_FLAG_SGL над отображёнными окнами: вместо
+ * отдельной команды на каждый экстент устройство за одну команду собирает их
+ * данные в окно (чтение) или раскладывает из окна (запись). В резерв файла
+ * должен входить и участок данных, и список экстентов, который драйвер кладёт
+ * за данными.
+ */
+static long r04flash_ioctl_cmdv(struct r04flash_data *dev,
+				struct r04flash_ioctl_cmdv __user *ucmd)
+{
+	struct r04flash_ioctl_cmdv cmd;
+	struct r04flash_ioctl_vec *vecs;
+	struct pcie_sgl_entry *sgl;
+	struct r04flash_queue *q;
+	u32 size = 0, sgl_ofst, win_size, ofst, i;
+	int cid, timeout;
+	long err;
+
+	if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+		return -EFAULT;
+
+	if ((cmd.opcode != PCIE_OP_READ && cmd.opcode != PCIE_OP_WRITE) ||
+	    !cmd.nr_vecs || cmd.nr_vecs > PCIE_SGL_MAX ||
+	    cmd.buf_ofst >= dev->win_size)
+		return -EINVAL;
+
+	vecs = memdup_user(u64_to_user_ptr(cmd.vecs),
+			   array_size(cmd.nr_vecs, sizeof(*vecs)));
+	if (IS_ERR(vecs))
+		return PTR_ERR(vecs);
+
+	for (i = 0; i < cmd.nr_vecs; ++i) {
+		if (!vecs[i].size || vecs[i].size > dev->win_size - size) {
+			err = -EINVAL;
+			goto out;
+		}
+		size += vecs[i].size;
+	}
+
+	// список - сразу за данными, выровненный на размер элемента
+	sgl_ofst = ALIGN(cmd.buf_ofst + size, sizeof(*sgl));
+	if (sgl_ofst > dev->win_size ||
+	    cmd.nr_vecs * sizeof(*sgl) > dev->win_size - sgl_ofst) {
+		err = -EINVAL;
+		goto out;
+	}
+	win_size = sgl_ofst + cmd.nr_vecs * sizeof(*sgl) - cmd.buf_ofst;
+
+	if (cmd.opcode == PCIE_OP_READ) {
+		q = &r04flash_sync.queues[PCIE_RD_QUEUE];
+		sgl = dev->rd_win + sgl_ofst;
+		timeout = dev->rd_timeout;
+	} else {
+		q = &r04flash_sync.queues[PCIE_WR_QUEUE];
+		sgl = dev->wr_win + sgl_ofst;
+		timeout = dev->wr_timeout;
+	}
+
+	if (!r04flash_resv_covers(dev, q, cmd.buf_ofst, win_size)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	ofst = cmd.buf_ofst;
+	cid = r04flash_cmd_get(q, &win_size, &ofst, true, false);
+	if (cid < 0) {
+		err = cid;
+		goto out;
+	}
+
+	for (i = 0; i < cmd.nr_vecs; ++i) {
+		sgl[i].addr_low = lower_32_bits(vecs[i].addr);
+		sgl[i].addr_high = upper_32_bits(vecs[i].addr);
+		sgl[i].size = vecs[i].size;
+		sgl[i].rsvd = 0;
+	}
+	q->cmds[cid].sgl_ofst = sgl_ofst;
+	q->cmds[cid].sgl_num = cmd.nr_vecs;
+
+	// список и данные процесса в окне видны устройству до doorbell
+	wmb();
+	r04flash_cmd_submit(q, cid, cmd.opcode, cmd.flags | PCIE_SQE_FLAG_SGL,
+			    vecs[0].addr, size);
+	r04flash_queue_ring(q);
+
+	err = r04flash_cmd_wait(q, cid, timeout);
+	if (err != -ETIMEDOUT && err != -EFAULT) {
+		cmd.status = q->cmds[cid].status;
+		cmd.result = q->cmds[cid].result;
+		err = copy_to_user(ucmd, &cmd, sizeof(cmd)) ? -EFAULT : 0;
+	}
+	r04flash_cmd_put(q, cid);
+out:
+	kfree(vecs);
+	return err;
+}
+
 static long r04flash_ioctl(struct file *file, unsigned int cmd, u64 arg)
 {
 	struct r04flash_data *dev = file->private_data;
 	switch (cmd) {
+	case R04FLASH_IOCTL_CMD:
+		return r04flash_ioctl_cmd(dev, (void __user *)arg);
+	case R04FLASH_IOCTL_CMDV:
+		return r04flash_ioctl_cmdv(dev, (void __user *)arg);
+	case R04FLASH_IOCTL_RESERVE:
+		return r04flash_ioctl_reserve(dev, (void __user *)arg);
 	case R04FLASH_IOCTL_SET_RD_ADDR:
 		dev->rd_addr = arg;
 		break;
 	case R04FLASH_IOCTL_SET_RD_SIZE:
+		if (arg == 0 || arg > dev->win_size)
+			arg = dev->win_size;
 		dev->rd_max_size = arg;
 		break;
 	case R04FLASH_IOCTL_SET_RD_TIMEOUT:
@@ -443,6 +1426,8 @@ static long r04flash_ioctl(struct file *file, unsigned int cmd, u64 arg)
 		dev->wr_addr = arg;
 		break;
 	case R04FLASH_IOCTL_SET_WR_SIZE:
+		if (arg == 0 || arg > dev->win_size)
+			arg = dev->win_size;
 		dev->wr_max_size = arg;
 		break;
 	case R04FLASH_IOCTL_SET_WR_TIMEOUT:
@@ -459,7 +1444,10 @@ static long r04flash_ioctl(struct file *file, unsigned int cmd, u64 arg)
 static int r04flash_release(struct inode *inode, struct file *file)
 {
 	struct r04flash_data *priv = file->private_data;
+	int qid;
 
+	for (qid = 0; qid < PCIE_QUEUES_NUM; ++qid)
+		r04flash_resv_drop(priv, &r04flash_sync.queues[qid]);
 	kfree(priv);
 
 	file->private_data = NULL;
@@ -471,12 +1459,15 @@ int destroy_char_devs(void)
 {
 	// Удаляем sysfs атрибут
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_disk_size);
+	device_remove_file(r04flash_priv->r04flash, &dev_attr_win_size);
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_rd_addr);
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_rd_timeout);
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_rd_max_size);
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_wr_addr);
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_wr_timeout);
 	device_remove_file(r04flash_priv->r04flash, &dev_attr_wr_max_size);
+	device_remove_file(r04flash_priv->r04flash, &dev_attr_irq_coalesce_count);
+	device_remove_file(r04flash_priv->r04flash, &dev_attr_irq_coalesce_usec);
 
 	device_destroy(r04flashclass, MKDEV(dev_major, 0));
 
@@ -487,6 +1478,289 @@ int destroy_char_devs(void)
 	return 0;
 }
 
+/*
+ * Статистика направлений в debugfs (/sys/kernel/debug/r04flash/{rd,wr}_stats):
+ * счётчики суммируются по процессорам при чтении, гистограмма задержек от
+ * отправки команды до её завершения выводится по непустым корзинам.
+ */
+static int r04flash_stats_show(struct seq_file *m, void *v)
+{
+	struct r04flash_queue *q = m->private;
+	struct r04flash_stats sum = {};
+	struct r04flash_stats *st;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		st = &per_cpu(r04flash_stats, cpu)[q->qid];
+		sum.ops += st->ops;
+		sum.bytes += st->bytes;
+		sum.errors += st->errors;
+		sum.timeouts += st->timeouts;
+		for (i = 0; i < R04FLASH_LAT_BUCKETS; ++i)
+			sum.latency[i] += st->latency[i];
+	}
+
+	seq_printf(m, "ops %llu\nbytes %llu\nerrors %llu\ntimeouts %llu\n",
+		   sum.ops, sum.bytes, sum.errors, sum.timeouts);
+	seq_puts(m, "latency_us count\n");
+	for (i = 0; i < R04FLASH_LAT_BUCKETS; ++i) {
+		if (!sum.latency[i])
+			continue;
+		if (i == 0)
+			seq_printf(m, "<1 %llu\n", sum.latency[i]);
+		else if (i == R04FLASH_LAT_BUCKETS - 1)
+			seq_printf(m, ">=%llu %llu\n", 1ull << (i - 1),
+				   sum.latency[i]);
+		else
+			seq_printf(m, "%llu-%llu %llu\n", 1ull << (i - 1),
+				   (1ull << i) - 1, sum.latency[i]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(r04flash_stats);
+
+static void r04flash_debugfs_init(struct r04flash_data *dev)
+{
+	dev->debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+	debugfs_create_file("rd_stats", 0444, dev->debugfs,
+			    &r04flash_sync.queues[PCIE_RD_QUEUE],
+			    &r04flash_stats_fops);
+	debugfs_create_file("wr_stats", 0444, dev->debugfs,
+			    &r04flash_sync.queues[PCIE_WR_QUEUE],
+			    &r04flash_stats_fops);
+}
+
+/*
+ * -----------------------------  BLOCK DEVICE  ---------------------------------
+ * r04blk0 - блочное устройство blk-mq поверх тех же очередей команд, что и
+ * символьное. Один аппаратный контекст на весь диск, глубина - число
+ * идентификаторов команд. Чтение уходит в очередь чтения, остальные операции
+ * - в очередь записи. Каждый запрос - одна команда, данные целиком занимают
+ * участок окна (max_hw_sectors ограничен нерезервируемым первым слотом окна,
+ * чтобы запрос помещался при любых резервах). Завершение приходит
+ * из обработчика прерывания через blk_mq_complete_request.
+ */
+
+// публикует команды пачки, прерванной до последнего запроса
+static void r04blk_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	int qid;
+
+	for (qid = 0; qid < PCIE_QUEUES_NUM; ++qid)
+		r04flash_queue_ring(&r04flash_sync.queues[qid]);
+}
+
+static blk_status_t r04blk_queue_rq(struct blk_mq_hw_ctx *hctx,
+				    const struct blk_mq_queue_data *bd)
+{
+	struct r04flash_data *dev = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+	struct r04blk_rq *brq = blk_mq_rq_to_pdu(rq);
+	struct r04flash_queue *q = &r04flash_sync.queues[PCIE_WR_QUEUE];
+	u32 len = blk_rq_bytes(rq), size = 0, ofst = 0;
+	struct req_iterator iter;
+	struct bio_vec bv;
+	u8 opcode, flags = 0;
+	int cid;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		q = &r04flash_sync.queues[PCIE_RD_QUEUE];
+		opcode = PCIE_OP_READ;
+		size = len;
+		break;
+	case REQ_OP_WRITE:
+		opcode = PCIE_OP_WRITE;
+		if (rq->cmd_flags & REQ_FUA)
+			flags |= PCIE_SQE_FLAG_FUA;
+		size = len;
+		break;
+	case REQ_OP_FLUSH:
+		opcode = PCIE_OP_FLUSH;
+		len = 0;
+		break;
+	case REQ_OP_DISCARD:
+		opcode = PCIE_OP_DISCARD;
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+
+	// место в окне может быть занято символьным устройством, тогда блочный
+	// уровень повторит запрос позже
+	cid = r04flash_cmd_try(q, &size, &ofst, false);
+	if (cid < 0)
+		return BLK_STS_RESOURCE;
+	if (size < (opcode == PCIE_OP_READ || opcode == PCIE_OP_WRITE ? len : 0)) {
+		r04flash_cmd_free(q, cid);
+		return BLK_STS_RESOURCE;
+	}
+
+	if (opcode == PCIE_OP_WRITE) {
+		rq_for_each_segment(bv, rq, iter) {
+			memcpy_from_bvec(dev->wr_win + ofst, &bv);
+			ofst += bv.bv_len;
+		}
+		wmb();
+	}
+
+	brq->q = q;
+	brq->cid = cid;
+	q->cmds[cid].rq = rq;
+	blk_mq_start_request(rq);
+	r04flash_cmd_submit(q, cid, opcode, flags,
+			    (u64)blk_rq_pos(rq) << SECTOR_SHIFT, len);
+
+	/*
+	 * doorbell - один на пачку запросов. Пачка может задеть обе очереди
+	 * (запись, затем последнее - чтение), а commit_rqs после последнего
+	 * запроса не вызывается, поэтому звоним во все очереди.
+	 */
+	if (bd->last)
+		r04blk_commit_rqs(hctx);
+
+	return BLK_STS_OK;
+}
+
+static void r04blk_complete_rq(struct request *rq)
+{
+	struct r04flash_data *dev = rq->q->queuedata;
+	struct r04blk_rq *brq = blk_mq_rq_to_pdu(rq);
+	struct r04flash_cmd *cmd = &brq->q->cmds[brq->cid];
+	blk_status_t status = BLK_STS_OK;
+	struct req_iterator iter;
+	struct bio_vec bv;
+	u32 ofst = cmd->buf_ofst;
+
+	if (r04flash_status_to_err(cmd->status))
+		status = BLK_STS_IOERR;
+
+	if (status == BLK_STS_OK && req_op(rq) == REQ_OP_READ) {
+		rq_for_each_segment(bv, rq, iter) {
+			memcpy_to_bvec(&bv, dev->rd_win + ofst);
+			ofst += bv.bv_len;
+		}
+	}
+
+	r04flash_cmd_put(brq->q, brq->cid);
+	blk_mq_end_request(rq, status);
+}
+
+/*
+ * Устройство не умеет отменять команды: запрос завершается с ошибкой, а
+ * команда бросается и освобождается (вместе с участком окна) при получении
+ * её завершения.
+ */
+static enum blk_eh_timer_return r04blk_timeout(struct request *rq)
+{
+	struct r04blk_rq *brq = blk_mq_rq_to_pdu(rq);
+	struct r04flash_queue *q = brq->q;
+	struct r04flash_cmd *cmd = &q->cmds[brq->cid];
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	// завершение уже получено и будет обработано
+	if (completion_done(&cmd->done)) {
+		spin_unlock_irqrestore(&q->lock, flags);
+		return BLK_EH_RESET_TIMER;
+	}
+	cmd->rq = NULL;
+	cmd->abandoned = true;
+	spin_unlock_irqrestore(&q->lock, flags);
+	this_cpu_inc(r04flash_stats[q->qid].timeouts);
+
+	dev_warn(disk_to_dev(rq->q->disk), "command %d timed out\n",
+		 brq->cid);
+	blk_mq_end_request(rq, BLK_STS_TIMEOUT);
+	return BLK_EH_DONE;
+}
+
+static const struct blk_mq_ops r04blk_mq_ops = {
+	.queue_rq = r04blk_queue_rq,
+	.commit_rqs = r04blk_commit_rqs,
+	.complete = r04blk_complete_rq,
+	.timeout = r04blk_timeout,
+};
+
+static const struct block_device_operations r04blk_fops = {
+	.owner = THIS_MODULE,
+};
+
+static int r04blk_major = 0;
+
+static int r04blk_create(struct r04flash_data *dev)
+{
+	struct queue_limits lim = {
+		.logical_block_size = SECTOR_SIZE,
+		.max_hw_sectors = (dev->win_size / R04FLASH_WIN_SLOTS) >>
+				  SECTOR_SHIFT,
+		.max_segments = USHRT_MAX,
+		.max_hw_discard_sectors = UINT_MAX >> SECTOR_SHIFT,
+		// устройство подтверждает запись до сохранения на носителе
+		// (политики periodic/ondemand), сброс - командой FLUSH или FUA
+		.features = BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA,
+	};
+	struct gendisk *disk;
+	int err;
+
+	err = register_blkdev(0, BLK_DEVICE_NAME);
+	if (err < 0)
+		return err;
+	r04blk_major = err;
+
+	dev->tag_set.ops = &r04blk_mq_ops;
+	dev->tag_set.nr_hw_queues = 1;
+	dev->tag_set.queue_depth = QUEUE_DEPTH - 1;
+	dev->tag_set.numa_node = NUMA_NO_NODE;
+	dev->tag_set.cmd_size = sizeof(struct r04blk_rq);
+	dev->tag_set.timeout = R04FLASH_DEFAULT_TIMEOUT_U;
+	err = blk_mq_alloc_tag_set(&dev->tag_set);
+	if (err)
+		goto err_unregister;
+
+	disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
+	if (IS_ERR(disk)) {
+		err = PTR_ERR(disk);
+		goto err_free_tag_set;
+	}
+
+	disk->major = r04blk_major;
+	disk->first_minor = 0;
+	disk->minors = 1;
+	disk->fops = &r04blk_fops;
+	disk->private_data = dev;
+	snprintf(disk->disk_name, DISK_NAME_LEN, BLK_DEVICE_NAME "0");
+	set_capacity(disk, ioread32(&dev->csr->disk_size) >> SECTOR_SHIFT);
+
+	err = add_disk(disk);
+	if (err)
+		goto err_put_disk;
+
+	dev->disk = disk;
+	return 0;
+
+err_put_disk:
+	put_disk(disk);
+err_free_tag_set:
+	blk_mq_free_tag_set(&dev->tag_set);
+err_unregister:
+	unregister_blkdev(r04blk_major, BLK_DEVICE_NAME);
+	return err;
+}
+
+static void r04blk_destroy(struct r04flash_data *dev)
+{
+	if (!dev->disk)
+		return;
+
+	del_gendisk(dev->disk);
+	put_disk(dev->disk);
+	blk_mq_free_tag_set(&dev->tag_set);
+	unregister_blkdev(r04blk_major, BLK_DEVICE_NAME);
+	dev->disk = NULL;
+}
+
 static int __init r04flash_driver_init(void)
 {
 	return pci_register_driver(&r04flash);
@@ -499,15 +1773,16 @@ static void __exit r04flash_driver_exit(void)
 
 static int r04flash_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 {
-	int bar, err, irq;
+	int bar, err, nvec, qid;
 	u16 vendor, device;
 	unsigned long csr_bar_start, csr_bar_len;
 	unsigned long data_bar_start, data_bar_len;
 	struct r04flash_data *dev = NULL;
 	__iomem void *csr_hwmem;
-	__iomem void *data_hwmem;
-	u8 *rd_data = NULL;
-	u8 *wr_data = NULL;
+	__iomem struct pcie_db *db;
+	u32 win_size, rd_win_ofst, wr_win_ofst;
+	void *rd_win;
+	void *wr_win;
 
 	pci_read_config_word(pdev, PCI_VENDOR_ID, &vendor);
 	pci_read_config_word(pdev, PCI_DEVICE_ID, &device);
@@ -530,7 +1805,7 @@ static int r04flash_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 	if (err)
 		return err;
 
-	err = pci_request_region(pdev, bar, DRIVER);
+	err = pci_request_selected_regions(pdev, bar, DRIVER);
 	if (err) {
 		dev_err(&pdev->dev, "Failed to request region for bars\n");
 		goto err_disable_device;
@@ -542,98 +1817,164 @@ static int r04flash_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 		goto err_disable_region;
 	}
 
-	err = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI);
-	if (err < 0) {
+	/*
+	 * По вектору на очередь (MSI-X, иначе MSI), ядро распределяет их
+	 * привязку по процессорам. Старая версия устройства даёт один вектор.
+	 */
+	nvec = pci_alloc_irq_vectors(pdev, 1, PCIE_QUEUES_NUM,
+				     PCI_IRQ_MSIX | PCI_IRQ_MSI |
+					     PCI_IRQ_AFFINITY);
+	if (nvec < 0) {
 		dev_err(&pdev->dev, "Failed to allocate IRQ vectors\n");
+		err = nvec;
 		goto err_disable_region;
 	}
-
-	irq = pci_irq_vector(pdev, 0);
-
-	// Регистрируем обработчик прерывания
-	err = request_irq(irq, r04flash_irq, 0, "r04flash", pdev);
-	if (err) {
-		dev_err(&pdev->dev, "Failed to request IRQ\n");
-		goto err_free_irq;
-	}
+	dev_info(&pdev->dev, "R04FLASH uses %d %s vector(s)\n", nvec,
+		 pdev->msix_enabled ? "MSI-X" : "MSI");
 
 	csr_bar_start = pci_resource_start(pdev, R04FLASH_CSR_BAR_NO);
 	csr_bar_len = pci_resource_len(pdev, R04FLASH_CSR_BAR_NO);
 	data_bar_start = pci_resource_start(pdev, R04FLASH_DATA_BAR_NO);
 	data_bar_len = pci_resource_len(pdev, R04FLASH_DATA_BAR_NO);
 
-	dev = kzalloc(sizeof(struct r04flash_data), GFP_KERNEL);
-	if (!dev) {
-		err = -ENOMEM;
-		goto err_disable_irq;
-	}
-
-	rd_data = kzalloc(WIN_SIZE, GFP_KERNEL);
-	if (!rd_data) {
-		err = -ENOMEM;
-		goto err_free_dev;
+	if (csr_bar_len < sizeof(struct pcie_bar0)) {
+		dev_err(&pdev->dev, "CSR bar is too small for queues\n");
+		err = -ENODEV;
+		goto err_free_vectors;
 	}
 
-	wr_data = kzalloc(WIN_SIZE, GFP_KERNEL);
-	if (!wr_data) {
+	dev = kzalloc(sizeof(struct r04flash_data), GFP_KERNEL);
+	if (!dev) {
 		err = -ENOMEM;
-		goto err_free_rd_data;
+		goto err_free_vectors;
 	}
 
 	csr_hwmem = ioremap(csr_bar_start, csr_bar_len);
 	if (!csr_hwmem) {
 		dev_err(&pdev->dev, "Failed to map csr bar\n");
 		err = -EIO;
-		goto err_free_wr_data;
+		goto err_free_dev;
 	}
 	dev_info(&pdev->dev, "R04FLASH mapped resource 0x%lx to 0x%p\n",
 		 csr_bar_start, csr_hwmem);
 
-	data_hwmem = ioremap(data_bar_start, data_bar_len);
-	if (!data_hwmem) {
-		dev_err(&pdev->dev, "Failed to map data bar\n");
+	dev->csr = csr_hwmem;
+
+	// раскладку окон объявляет устройство, старое - окнами WIN_SIZE
+	win_size = ioread32(&dev->csr->win_size);
+	if (win_size) {
+		rd_win_ofst = ioread32(&dev->csr->rd_win_ofst);
+		wr_win_ofst = ioread32(&dev->csr->wr_win_ofst);
+	} else {
+		win_size = WIN_SIZE;
+		rd_win_ofst = offsetof(struct pcie_bar2, rd_data);
+		wr_win_ofst = offsetof(struct pcie_bar2, wr_data);
+	}
+	// окна отображаются в процессы постранично и с разным типом памяти,
+	// поэтому не должны делить страницы
+	if (win_size < WIN_SIZE || win_size % R04FLASH_WIN_BLOCKS ||
+	    !PAGE_ALIGNED(win_size) || !PAGE_ALIGNED(rd_win_ofst) ||
+	    !PAGE_ALIGNED(wr_win_ofst) ||
+	    (u64)rd_win_ofst + win_size > data_bar_len ||
+	    (u64)wr_win_ofst + win_size > data_bar_len ||
+	    abs((s64)rd_win_ofst - wr_win_ofst) < win_size) {
+		dev_err(&pdev->dev,
+			"Invalid transfer windows: size 0x%x at 0x%x/0x%x\n",
+			win_size, rd_win_ofst, wr_win_ofst);
+		err = -ENODEV;
+		goto err_unmap_csr;
+	}
+
+	/*
+	 * Окна копируются напрямую из/в пользовательскую память. Окно чтения
+	 * отображается кэшируемым: устройство эмулируется процессором хоста,
+	 * который пишет в ту же память когерентно с кэшем. Окно записи - с
+	 * объединением записей, перед doorbell нужен wmb().
+	 */
+	rd_win = memremap(data_bar_start + rd_win_ofst, win_size, MEMREMAP_WB);
+	if (!rd_win) {
+		dev_err(&pdev->dev, "Failed to map read window\n");
 		err = -EIO;
 		goto err_unmap_csr;
 	}
-	dev_info(&pdev->dev, "R04FLASH mapped resource 0x%lx to 0x%p\n",
-		 data_bar_start, data_hwmem);
 
-	dev->irq = irq;
+	wr_win = memremap(data_bar_start + wr_win_ofst, win_size, MEMREMAP_WC);
+	if (!wr_win) {
+		dev_err(&pdev->dev, "Failed to map write window\n");
+		err = -EIO;
+		goto err_unmap_rd_win;
+	}
+	dev_info(&pdev->dev,
+		 "R04FLASH mapped 0x%x byte windows 0x%lx to 0x%p/0x%p\n",
+		 win_size, data_bar_start, rd_win, wr_win);
+
+	dev->rd_win_start = data_bar_start + rd_win_ofst;
+	dev->wr_win_start = data_bar_start + wr_win_ofst;
+
+	if (bar & R04FLASH_STORAGE_BAR_MASK) {
+		dev->storage_start =
+			pci_resource_start(pdev, R04FLASH_STORAGE_BAR_NO);
+		dev->storage_len =
+			pci_resource_len(pdev, R04FLASH_STORAGE_BAR_NO);
+		dev_info(&pdev->dev,
+			 "R04FLASH storage bar 0x%llx (0x%llx bytes) is mappable\n",
+			 (u64)dev->storage_start, dev->storage_len);
+	}
 
-	dev->csr = csr_hwmem;
-	dev->data = data_hwmem;
-	r04flash_sync.rd_data_buf = rd_data;
-	r04flash_sync.wr_data_buf = wr_data;
+	dev->nr_vectors = nvec;
 
-	create_char_devs(dev);
+	dev->rd_win = rd_win;
+	dev->wr_win = wr_win;
+	dev->win_size = win_size;
 
-	init_completion(&dev->read_complete);
-	init_completion(&dev->write_complete);
+	db = r04flash_find_doorbell(csr_hwmem, csr_bar_len);
+	if (db)
+		dev_info(&pdev->dev, "R04FLASH uses trapped doorbell page\n");
+	else
+		dev_info(&pdev->dev,
+			 "R04FLASH has no doorbell page, device must poll\n");
 
-	mutex_init(&r04flash_sync.read_lock);
-	mutex_init(&r04flash_sync.write_lock);
+	for (qid = 0; qid < PCIE_QUEUES_NUM; ++qid)
+		r04flash_queue_init(&r04flash_sync.queues[qid], qid,
+				    &dev->csr->queues[qid],
+				    db ? &db->sq_tail[qid] : NULL, win_size);
+
+	create_char_devs(dev);
+	r04flash_debugfs_init(dev);
+
+	// Регистрируем обработчики прерываний после инициализации очередей
+	err = r04flash_request_irqs(pdev, dev);
+	if (err) {
+		dev_err(&pdev->dev, "Failed to request IRQ\n");
+		goto err_destroy_char_devs;
+	}
 
 	pci_set_drvdata(pdev, dev);
 
+	// блочное устройство необязательно, символьное работает и без него
+	err = r04blk_create(dev);
+	if (err)
+		dev_warn(&pdev->dev, "Failed to create block device: %d\n",
+			 err);
+
 	dev_info(&pdev->dev, "R04FLASH probe success\n");
 
 	return 0;
-	// err_unmap_data:
-	pci_iounmap(pdev, data_hwmem);
+err_destroy_char_devs:
+	debugfs_remove_recursive(dev->debugfs);
+	destroy_char_devs();
+	memunmap(wr_win);
+err_unmap_rd_win:
+	memunmap(rd_win);
 err_unmap_csr:
 	pci_iounmap(pdev, csr_hwmem);
-err_free_wr_data:
-	kfree(wr_data);
-err_free_rd_data:
-	kfree(rd_data);
 err_free_dev:
 	kfree(dev);
-err_disable_irq:
+err_free_vectors:
 	pci_free_irq_vectors(pdev);
-err_free_irq:
-	free_irq(irq, pdev);
 err_disable_region:
-	pci_release_region(pdev, pci_select_bars(pdev, IORESOURCE_MEM));
+	pci_release_selected_regions(pdev,
+				     pci_select_bars(pdev, IORESOURCE_MEM));
 err_disable_device:
 	pci_disable_device(pdev);
 	return err;
@@ -643,30 +1984,29 @@ static void r04flash_remove(struct pci_dev *pdev)
 {
 	struct r04flash_data *dev = pci_get_drvdata(pdev);
 
+	// запросы блочного устройства завершаются до снятия прерывания
+	r04blk_destroy(dev);
+	debugfs_remove_recursive(dev->debugfs);
 	destroy_char_devs();
 
-	if (dev->irq)
-		free_irq(dev->irq, pdev);
+	if (dev->nr_vectors)
+		r04flash_free_irqs(pdev, dev);
 
 	pci_free_irq_vectors(pdev);
 
 	if (dev) {
 		if (dev->csr)
 			pci_iounmap(pdev, dev->csr);
-		if (dev->data)
-			pci_iounmap(pdev, dev->data);
+		if (dev->rd_win)
+			memunmap(dev->rd_win);
+		if (dev->wr_win)
+			memunmap(dev->wr_win);
 		kfree(dev);
 	}
 
-	if (r04flash_sync.rd_data_buf)
-		kfree(r04flash_sync.rd_data_buf);
-	if (r04flash_sync.wr_data_buf)
-		kfree(r04flash_sync.wr_data_buf);
-
-	mutex_destroy(&r04flash_sync.read_lock);
-	mutex_destroy(&r04flash_sync.write_lock);
 
-	pci_release_region(pdev, pci_select_bars(pdev, IORESOURCE_MEM));
+	pci_release_selected_regions(pdev,
+				     pci_select_bars(pdev, IORESOURCE_MEM));
 	pci_disable_device(pdev);
 }
 
@@ -1,13 +1,22 @@
 #pragma once
 #include "linux/completion.h"
+#include "linux/spinlock.h"
+#include <linux/bitmap.h>
+#include <linux/blk-mq.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/compiler_attributes.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "asm-generic/iomap.h"
 
 #define R04FLASH_VENDOR_ID 0x1B36
 #define R04FLASH_PRODUCT_ID 0x0005
 
+// RD_ADDR/WR_ADDR - базовые адреса направлений, read/write обращаются к
+// устройству по адресу base + позиция файла (pread/pwrite, lseek)
 #define R04FLASH_IOCTL_SET_RD_ADDR    0x0001
 #define R04FLASH_IOCTL_SET_RD_SIZE    0x0002
 #define R04FLASH_IOCTL_SET_RD_TIMEOUT 0x0003
@@ -16,63 +25,355 @@
 #define R04FLASH_IOCTL_SET_WR_SIZE    0x0102
 #define R04FLASH_IOCTL_SET_WR_TIMEOUT 0x0103
 
+// отправка команды над отображёнными окнами, arg - struct r04flash_ioctl_cmd *
+#define R04FLASH_IOCTL_CMD 0x0201
+// команда над несколькими экстентами хранилища,
+// arg - struct r04flash_ioctl_cmdv *
+#define R04FLASH_IOCTL_CMDV 0x0202
+// резервирование участка окна за файлом, arg - struct r04flash_ioctl_resv *
+#define R04FLASH_IOCTL_RESERVE 0x0203
+
+// Смещения mmap окон передачи из bar2, размер окна - в sysfs атрибуте
+// win_size. Окно чтения отображается кэшируемым, окно записи -
+// write-combining: так же, как их отображает ядро, PAT не допускает разных
+// типов памяти у отображений одного участка. Меньшие смещения отображают
+// хранилище из bar4.
+#define R04FLASH_MMAP_RD_WIN (1ull << 44)
+#define R04FLASH_MMAP_WR_WIN (2ull << 44)
+
 #define R04FLASH_DEFAULT_TIMEOUT_U 2000
 
+// минимальный размер окна передачи, действительный размер объявляет
+// устройство в pcie_bar0.win_size
 #define WIN_SIZE 32 * 1024
+#define BAR0_SIZE 16 * 1024
+
+// количество элементов в каждой из очередей (одна ячейка всегда свободна)
+#define QUEUE_DEPTH 64
 
 #define __field __aligned(64)
 #define __window(_name) __aligned(WIN_SIZE) u8 _name[WIN_SIZE]
 
-struct pcie_desc {
+enum pcie_queue_id {
+	PCIE_RD_QUEUE = 0,
+	PCIE_WR_QUEUE,
+	PCIE_QUEUES_NUM,
+};
+
+enum pcie_opcode {
+	PCIE_OP_READ = 1,
+	PCIE_OP_WRITE = 2,
+	// сброс всех завершённых записей на носитель
+	PCIE_OP_FLUSH = 3,
+	// освобождение диапазона addr/size, после чего он читается нулями
+	PCIE_OP_DISCARD = 4,
+};
+
+// запись завершается только после сброса её данных на носитель
+#define PCIE_SQE_FLAG_FUA (1 << 0)
+// данные READ/WRITE занимают несколько экстентов хранилища, список
+// (struct pcie_sgl_entry) - в окне команды по смещению sgl_ofst
+#define PCIE_SQE_FLAG_SGL (1 << 1)
+
+// максимальное количество элементов списка SGL
+#define PCIE_SGL_MAX 256
+
+// элемент очереди отправки (заполняет хост)
+struct pcie_sqe {
+	u8 opcode;
+	u8 flags;
+	// идентификатор команды, возвращается в элементе очереди завершения
+	u16 cid;
+	u32 size;
+	u32 addr_low;
+	u32 addr_high;
+	// смещение данных команды внутри окна передачи
+	u32 buf_ofst;
+	// список экстентов для PCIE_SQE_FLAG_SGL: смещение в том же окне и
+	// количество элементов
+	u32 sgl_ofst;
+	u32 sgl_num;
+	u32 rsvd;
+};
+
+// элемент списка экстентов команды с PCIE_SQE_FLAG_SGL
+struct pcie_sgl_entry {
 	u32 addr_low;
 	u32 addr_high;
 	u32 size;
+	u32 rsvd;
 };
 
+// элемент очереди завершения (заполняет устройство)
+struct pcie_cqe {
+	// количество обработанных байт
+	u32 result;
+	// голова очереди отправки на момент завершения команды
+	u16 sq_head;
+	u16 cid;
+	u8 rsvd[7];
+
+	// регистр статуса команды (записывается последним)
+	// - phase
+	// - io_error
+	// - op_error
+	// - addr_error
+	// - size_error
+	u8 status;
+};
+
+struct pcie_queue {
+	// doorbell регистры (пишет хост)
+	__field u32 sq_tail;
+	u32 cq_head;
+
+	// состояние очередей (пишет устройство)
+	__field u32 sq_head;
+	// 31 бит - текущая фаза очереди завершения
+	u32 cq_tail;
+
+	__field struct pcie_sqe sq[QUEUE_DEPTH];
+	__field struct pcie_cqe cq[QUEUE_DEPTH];
+};
+
+#define PCIE_CQ_TAIL_PHASE_OFST (31)
+#define PCIE_CQ_TAIL_PHASE_MASK (1u << PCIE_CQ_TAIL_PHASE_OFST)
+
 struct pcie_bar0 {
 	// размер диска
 	__field u32 disk_size;
+	// объединение прерываний (0 - значение устройства по умолчанию):
+	// прерывание после irq_coalesce_count завершений очереди либо через
+	// irq_coalesce_usec после первого завершения без прерывания
+	u32 irq_coalesce_count;
+	u32 irq_coalesce_usec;
+	// размер окон передачи и их смещения в bar2 (пишет устройство),
+	// 0 в win_size - раскладка struct pcie_bar2 с окнами WIN_SIZE
+	u32 win_size;
+	u32 rd_win_ofst;
+	u32 wr_win_ofst;
+
+	// пары очередей отправки/завершения, по одной на направление
+	__field struct pcie_queue queues[PCIE_QUEUES_NUM];
+};
 
-	__field struct {
-		// регистр статуса чтения
-		// - start
-		u8 rd_ctrl;
-
-		// регистр ошибки чтения
-		// - comp
-		// - addr_error
-		// - size_error
-		u8 rd_status;
-
-		// регистр статуса записи
-		// - start
-		u8 wr_ctrl;
-
-		// регистр ошибки записи
-		// - comp
-		// - addr_error
-		// - size_error
-		u8 wr_status;
-	};
-
-	// дескриптор чтения
-	__field struct pcie_desc rd_desc;
-
-	// дескриптор записи
-	__field struct pcie_desc wr_desc;
+// Страница doorbell регистров, перехватываемых QEMU (последняя страница bar0).
+// Запись в sq_tail[qid] пересылается эмулятору, само значение хвоста
+// дублируется в pcie_queue.sq_tail.
+#define PCIE_DB_SIZE 0x1000
+#define PCIE_DB_MAGIC 0x52304442
+
+struct pcie_db {
+	u32 sq_tail[PCIE_QUEUES_NUM];
+	u8 rsvd[PCIE_DB_SIZE - PCIE_QUEUES_NUM * 4 - 4];
+	// при чтении возвращает PCIE_DB_MAGIC
+	u32 magic;
 };
 
+// раскладка bar2 устройства, не объявляющего размер окон
 struct pcie_bar2 {
 	__window(rd_data);
 	__window(wr_data);
 };
 
-struct r04flash_global_data {
-	struct mutex read_lock;
-	struct mutex write_lock;
+// Необязательный bar4 - файл хранилища целиком, отображается в процессы
+// через mmap. Записи через него не упорядочены с командами и сохраняются на
+// носителе только командой FLUSH.
+#define PCIE_STORAGE_BAR_NO 4
+
+/*
+ * Резервирование R04FLASH_IOCTL_RESERVE. Участок [ofst, ofst + size) окна
+ * чтения (qid = PCIE_RD_QUEUE) или записи (PCIE_WR_QUEUE), расширенный до
+ * блоков окна, закрепляется за открытым файлом до следующего резервирования
+ * того же окна или закрытия файла: read/write, асинхронные запросы и блочное
+ * устройство его не занимают. size == 0 снимает резервирование. Если участок
+ * занят командами, ioctl ждёт их завершения. Резервировать можно только
+ * [win_size / R04FLASH_WIN_SLOTS, win_size), первый слот окна остаётся ядру,
+ * иначе -EINVAL.
+ */
+struct r04flash_ioctl_resv {
+	u32 qid;
+	u32 ofst;
+	u32 size;
+	u32 rsvd;
+};
+
+/*
+ * Команда R04FLASH_IOCTL_CMD. Данные записи процесс заранее кладёт в
+ * отображённое окно записи (R04FLASH_MMAP_WR_WIN) по смещению buf_ofst,
+ * данные чтения забирает из окна чтения (R04FLASH_MMAP_RD_WIN) после
+ * возврата. Участок [buf_ofst, buf_ofst + size) должен лежать
+ * внутри резервирования файла (R04FLASH_IOCTL_RESERVE) в окне направления
+ * команды, иначе -EINVAL: только так ядро не займёт его до того, как процесс
+ * положит данные или после того, как заберёт их.
+ */
+struct r04flash_ioctl_cmd {
+	// PCIE_OP_*, flags - PCIE_SQE_FLAG_*
+	u8 opcode;
+	u8 flags;
+	// заполняется драйвером: регистр статуса из элемента завершения
+	u8 status;
+	u8 rsvd;
+	u32 size;
+	u64 addr;
+	u32 buf_ofst;
+	// заполняется драйвером: количество обработанных байт
+	u32 result;
+};
+
+struct r04flash_ioctl_vec {
+	u64 addr;
+	u32 size;
+	u32 rsvd;
+};
+
+/*
+ * Команда R04FLASH_IOCTL_CMDV - чтение или запись нескольких экстентов
+ * хранилища одной командой устройства. Данные экстентов лежат в окне подряд
+ * начиная с buf_ofst (в порядке vecs), в остальном - как R04FLASH_IOCTL_CMD.
+ * Список экстентов драйвер кладёт в окно сразу за данными (с выравниванием),
+ * поэтому там должно оставаться место под nr_vecs элементов pcie_sgl_entry,
+ * и в резервирование файла должны входить и данные, и список.
+ */
+struct r04flash_ioctl_cmdv {
+	// PCIE_OP_READ или PCIE_OP_WRITE, flags - PCIE_SQE_FLAG_*
+	u8 opcode;
+	u8 flags;
+	// заполняется драйвером: регистр статуса из элемента завершения
+	u8 status;
+	u8 rsvd;
+	// количество экстентов, не больше PCIE_SGL_MAX
+	u32 nr_vecs;
+	// массив struct r04flash_ioctl_vec[nr_vecs] в памяти процесса
+	u64 vecs;
+	u32 buf_ofst;
+	// заполняется драйвером: количество обработанных байт
+	u32 result;
+};
+
+// окна делятся между командами блоками (см. r04flash_queue.win_map) по
+// win_size / R04FLASH_WIN_BLOCKS байт: блоков хватает на каждую команду
+// очереди при любом размере окна
+#define R04FLASH_WIN_BLOCKS 64
+// read/write режут запрос на части не больше win_size / R04FLASH_WIN_SLOTS,
+// чтобы копирование одной части перекрывалось с обработкой другой. Первый
+// слот окна не резервируется (R04FLASH_IOCTL_RESERVE), так что место под
+// часть или запрос блочного устройства есть всегда
+#define R04FLASH_WIN_SLOTS 2
+
+struct r04flash_aio;
+
+struct r04flash_cmd {
+	struct completion done;
+
+	// данные команды в окне
+	u32 buf_ofst;
+	u32 size;
+	// занятые командой блоки окна
+	u32 win_first;
+	u32 win_blocks;
+	// список экстентов в окне (sgl_num == 0 - команда без списка)
+	u32 sgl_ofst;
+	u32 sgl_num;
+
+	// момент отправки (ktime_get_ns), для задержки завершения
+	u64 submit_ns;
+
+	// асинхронный запрос, которому принадлежит команда (NULL - синхронная)
+	struct r04flash_aio *aio;
+	// запрос блочного устройства, которому принадлежит команда
+	struct request *rq;
+
+	// заполняется обработчиком прерывания
+	u32 result;
+	u8 status;
+
+	// команда брошена ожидающим (таймаут или сигнал), идентификатор будет
+	// освобождён при получении завершения
+	bool abandoned;
+};
+
+struct r04flash_queue {
+	spinlock_t lock;
+	enum pcie_queue_id qid;
+	__iomem struct pcie_queue *regs;
+	// перехватываемый doorbell, NULL если QEMU его не предоставляет
+	__iomem u32 *db;
+
+	u32 sq_tail;
+	u32 cq_head;
+	u8 phase;
+
+	// одна ячейка очереди отправки всегда свободна, поэтому идентификаторов
+	// на один меньше, чем элементов
+	DECLARE_BITMAP(cid_map, QUEUE_DEPTH - 1);
+	struct r04flash_cmd cmds[QUEUE_DEPTH - 1];
+
+	// занятые блоки окна направления, освобождаются вместе с командой
+	DECLARE_BITMAP(win_map, R04FLASH_WIN_BLOCKS);
+	// блоки, зарезервированные файлами (R04FLASH_IOCTL_RESERVE): команды
+	// ядра их не занимают, команды ioctl - только внутри своего резерва
+	DECLARE_BITMAP(resv_map, R04FLASH_WIN_BLOCKS);
+	// размер блока окна
+	u32 win_block;
+	// ожидание свободного идентификатора или места в окне
+	wait_queue_head_t wait;
+};
+
+// корзина i гистограммы задержек - [2^(i-1), 2^i) мкс, корзина 0 - < 1 мкс,
+// последняя - всё остальное
+#define R04FLASH_LAT_BUCKETS 24
+
+// статистика направления, ведётся на каждом процессоре отдельно
+struct r04flash_stats {
+	u64 ops;
+	u64 bytes;
+	// завершения с ошибкой в статусе
+	u64 errors;
+	// команды, брошенные по таймауту ожидания
+	u64 timeouts;
+	u64 latency[R04FLASH_LAT_BUCKETS];
+};
+
+/*
+ * Асинхронный запрос (io_uring, libaio). Выполняется по одной команде:
+ * следующая отправляется рабочим потоком после завершения предыдущей.
+ * Копирование между окном и памятью процесса выполняется там же в адресном
+ * пространстве процесса.
+ */
+struct r04flash_aio {
+	struct kiocb *iocb;
+	struct r04flash_data *dev;
+	struct r04flash_queue *q;
+	struct work_struct work;
+
+	// копия итератора запроса, iov - скопированный вектор (или NULL)
+	struct iov_iter iter;
+	const void *iov;
+	// адресное пространство процесса, NULL для буферов ядра
+	struct mm_struct *mm;
+
+	u8 opcode;
+	u8 sqe_flags;
+	u64 addr;
+	// команда в работе
+	int cid;
+	ssize_t done;
+};
+
+// данные драйвера в запросе блочного устройства (blk_mq_rq_to_pdu)
+struct r04blk_rq {
+	struct r04flash_queue *q;
+	int cid;
+};
 
-	u8 *rd_data_buf;
-	u8 *wr_data_buf;
+/*
+ * Общие для всех файлов и блочного устройства очереди команд. Каждая
+ * команда владеет своим идентификатором, участком окна и completion, поэтому
+ * процессы отправляют команды параллельно, без блокировки направления.
+ */
+struct r04flash_global_data {
+	struct r04flash_queue queues[PCIE_QUEUES_NUM];
 };
 
 struct r04flash_data {
@@ -80,8 +381,21 @@ struct r04flash_data {
 	struct device *r04flash;
 
 	__iomem struct pcie_bar0 *csr;
-	__iomem struct pcie_bar2 *data;
-	int irq;
+	// окна передачи bar2: чтения - кэшируемое, записи - write-combining
+	void *rd_win;
+	void *wr_win;
+	// размер каждого из окон (pcie_bar0.win_size)
+	u32 win_size;
+	// выделенные векторы прерываний: по одному на очередь или один общий
+	int nr_vectors;
+
+	// bar хранилища для mmap, storage_len == 0 если устройство его не
+	// предоставляет
+	phys_addr_t storage_start;
+	u64 storage_len;
+	// физические адреса окон передачи для mmap
+	phys_addr_t rd_win_start;
+	phys_addr_t wr_win_start;
 
 	u32 rd_max_size;
 	u32 wr_max_size;
@@ -92,214 +406,135 @@ struct r04flash_data {
 	int rd_timeout;
 	int wr_timeout;
 
-	struct completion read_complete;
-	struct completion write_complete;
+	// участки окон, зарезервированные файлом (R04FLASH_IOCTL_RESERVE), в
+	// блоках окна, blocks == 0 - резерва нет. Меняются под lock очереди
+	struct {
+		u32 first;
+		u32 blocks;
+	} resv[PCIE_QUEUES_NUM];
+
+	// каталог статистики в debugfs
+	struct dentry *debugfs;
+
+	// блочное устройство r04blk0 поверх тех же очередей команд
+	struct blk_mq_tag_set tag_set;
+	struct gendisk *disk;
 };
 
 enum r04flash_error {
 	R04_ADDRINVAL = 0xc0ffee01,
 	R04_SIZEINVAL = 0xc0ffee02,
+	R04_OPINVAL = 0xc0ffee03,
+	R04_IOERR = 0xc0ffee04,
 };
 
-#define PCIE_BAR0_RD_CTRL_START_OFST (0)
-#define PCIE_BAR0_RD_CTRL_START_MASK (1 << PCIE_BAR0_RD_CTRL_START_OFST)
-
-#define PCIE_BAR0_WR_CTRL_START_OFST (0)
-#define PCIE_BAR0_WR_CTRL_START_MASK (1 << PCIE_BAR0_WR_CTRL_START_OFST)
-
-#define PCIE_BAR0_RD_STATUS_COMP_OFST (0)
-#define PCIE_BAR0_RD_STATUS_COMP_MASK (1 << PCIE_BAR0_RD_STATUS_COMP_OFST)
+#define PCIE_CQE_STATUS_PHASE_OFST (0)
+#define PCIE_CQE_STATUS_PHASE_MASK (1 << PCIE_CQE_STATUS_PHASE_OFST)
 
-#define PCIE_BAR0_RD_STATUS_ADDR_ERROR_OFST (6)
-#define PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK \
-	(1 << PCIE_BAR0_RD_STATUS_ADDR_ERROR_OFST)
+#define PCIE_CQE_STATUS_IO_ERROR_OFST (4)
+#define PCIE_CQE_STATUS_IO_ERROR_MASK (1 << PCIE_CQE_STATUS_IO_ERROR_OFST)
 
-#define PCIE_BAR0_RD_STATUS_SIZE_ERROR_OFST (7)
-#define PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK \
-	(1 << PCIE_BAR0_RD_STATUS_SIZE_ERROR_OFST)
-
-#define PCIE_BAR0_WR_STATUS_COMP_OFST (0)
-#define PCIE_BAR0_WR_STATUS_COMP_MASK (1 << PCIE_BAR0_WR_STATUS_COMP_OFST)
-
-#define PCIE_BAR0_WR_STATUS_ADDR_ERROR_OFST (6)
-#define PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK \
-	(1 << PCIE_BAR0_WR_STATUS_ADDR_ERROR_OFST)
-
-#define PCIE_BAR0_WR_STATUS_SIZE_ERROR_OFST (7)
-#define PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK \
-	(1 << PCIE_BAR0_WR_STATUS_SIZE_ERROR_OFST)
-
-static inline int get_pcie_bar0_rd_ctrl_start(__iomem struct pcie_bar0 *pcie)
-{
-	return (ioread8(&pcie->rd_ctrl) & PCIE_BAR0_RD_CTRL_START_MASK) >>
-	       PCIE_BAR0_RD_CTRL_START_OFST;
-}
+#define PCIE_CQE_STATUS_OP_ERROR_OFST (5)
+#define PCIE_CQE_STATUS_OP_ERROR_MASK (1 << PCIE_CQE_STATUS_OP_ERROR_OFST)
 
-static inline void set_pcie_bar0_rd_ctrl_start(__iomem struct pcie_bar0 *pcie)
-{
-	int new_value = ioread8(&pcie->rd_ctrl) | PCIE_BAR0_RD_CTRL_START_MASK;
-	iowrite8(new_value, &pcie->rd_ctrl);
-}
+#define PCIE_CQE_STATUS_ADDR_ERROR_OFST (6)
+#define PCIE_CQE_STATUS_ADDR_ERROR_MASK (1 << PCIE_CQE_STATUS_ADDR_ERROR_OFST)
 
-static inline void unset_pcie_bar0_rd_ctrl_start(__iomem struct pcie_bar0 *pcie)
-{
-	int new_value = ioread8(&pcie->rd_ctrl) & ~PCIE_BAR0_RD_CTRL_START_MASK;
-	iowrite8(new_value, &pcie->rd_ctrl);
-}
+#define PCIE_CQE_STATUS_SIZE_ERROR_OFST (7)
+#define PCIE_CQE_STATUS_SIZE_ERROR_MASK (1 << PCIE_CQE_STATUS_SIZE_ERROR_OFST)
 
-static inline int get_pcie_bar0_wr_ctrl_start(__iomem struct pcie_bar0 *pcie)
+static inline int get_pcie_cqe_status_phase(__iomem struct pcie_cqe *cqe)
 {
-	return (ioread8(&pcie->wr_ctrl) & PCIE_BAR0_WR_CTRL_START_MASK) >>
-	       PCIE_BAR0_WR_CTRL_START_OFST;
+	return (ioread8(&cqe->status) & PCIE_CQE_STATUS_PHASE_MASK) >>
+	       PCIE_CQE_STATUS_PHASE_OFST;
 }
 
-static inline void set_pcie_bar0_wr_ctrl_start(__iomem struct pcie_bar0 *pcie)
+static inline void set_pcie_cqe_status_phase(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->wr_ctrl) | PCIE_BAR0_WR_CTRL_START_MASK;
-	iowrite8(new_value, &pcie->wr_ctrl);
+	int new_value = ioread8(&cqe->status) | PCIE_CQE_STATUS_PHASE_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline void unset_pcie_bar0_wr_ctrl_start(__iomem struct pcie_bar0 *pcie)
+static inline void unset_pcie_cqe_status_phase(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->wr_ctrl) & ~PCIE_BAR0_WR_CTRL_START_MASK;
-	iowrite8(new_value, &pcie->wr_ctrl);
+	int new_value = ioread8(&cqe->status) & ~PCIE_CQE_STATUS_PHASE_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline int get_pcie_bar0_rd_status_comp(__iomem struct pcie_bar0 *pcie)
+static inline int get_pcie_cqe_status_io_error(__iomem struct pcie_cqe *cqe)
 {
-	return (ioread8(&pcie->rd_status) & PCIE_BAR0_RD_STATUS_COMP_MASK) >>
-	       PCIE_BAR0_RD_STATUS_COMP_OFST;
+	return (ioread8(&cqe->status) & PCIE_CQE_STATUS_IO_ERROR_MASK) >>
+	       PCIE_CQE_STATUS_IO_ERROR_OFST;
 }
 
-static inline void set_pcie_bar0_rd_status_comp(__iomem struct pcie_bar0 *pcie)
+static inline void set_pcie_cqe_status_io_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->rd_status) |
-			PCIE_BAR0_RD_STATUS_COMP_MASK;
-	iowrite8(new_value, &pcie->rd_status);
+	int new_value = ioread8(&cqe->status) | PCIE_CQE_STATUS_IO_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline void
-unset_pcie_bar0_rd_status_comp(__iomem struct pcie_bar0 *pcie)
+static inline void unset_pcie_cqe_status_io_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->rd_status) &
-			~PCIE_BAR0_RD_STATUS_COMP_MASK;
-	iowrite8(new_value, &pcie->rd_status);
+	int new_value = ioread8(&cqe->status) & ~PCIE_CQE_STATUS_IO_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline int
-get_pcie_bar0_rd_status_addr_error(__iomem struct pcie_bar0 *pcie)
+static inline int get_pcie_cqe_status_op_error(__iomem struct pcie_cqe *cqe)
 {
-	return (ioread8(&pcie->rd_status) &
-		PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK) >>
-	       PCIE_BAR0_RD_STATUS_ADDR_ERROR_OFST;
+	return (ioread8(&cqe->status) & PCIE_CQE_STATUS_OP_ERROR_MASK) >>
+	       PCIE_CQE_STATUS_OP_ERROR_OFST;
 }
 
-static inline void
-set_pcie_bar0_rd_status_addr_error(__iomem struct pcie_bar0 *pcie)
+static inline void set_pcie_cqe_status_op_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->rd_status) |
-			PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK;
-	iowrite8(new_value, &pcie->rd_status);
+	int new_value = ioread8(&cqe->status) | PCIE_CQE_STATUS_OP_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline void
-unset_pcie_bar0_rd_status_addr_error(__iomem struct pcie_bar0 *pcie)
+static inline void unset_pcie_cqe_status_op_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->rd_status) &
-			~PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK;
-	iowrite8(new_value, &pcie->rd_status);
+	int new_value = ioread8(&cqe->status) & ~PCIE_CQE_STATUS_OP_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline int
-get_pcie_bar0_rd_status_size_error(__iomem struct pcie_bar0 *pcie)
+static inline int get_pcie_cqe_status_addr_error(__iomem struct pcie_cqe *cqe)
 {
-	return (ioread8(&pcie->rd_status) &
-		PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK) >>
-	       PCIE_BAR0_RD_STATUS_SIZE_ERROR_OFST;
+	return (ioread8(&cqe->status) & PCIE_CQE_STATUS_ADDR_ERROR_MASK) >>
+	       PCIE_CQE_STATUS_ADDR_ERROR_OFST;
 }
 
-static inline void
-set_pcie_bar0_rd_status_size_error(__iomem struct pcie_bar0 *pcie)
+static inline void set_pcie_cqe_status_addr_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->rd_status) |
-			PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK;
-	iowrite8(new_value, &pcie->rd_status);
+	int new_value = ioread8(&cqe->status) |
+			PCIE_CQE_STATUS_ADDR_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
 static inline void
-unset_pcie_bar0_rd_status_size_error(__iomem struct pcie_bar0 *pcie)
+unset_pcie_cqe_status_addr_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->rd_status) &
-			~PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK;
-	iowrite8(new_value, &pcie->rd_status);
+	int new_value = ioread8(&cqe->status) &
+			~PCIE_CQE_STATUS_ADDR_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
-static inline int get_pcie_bar0_wr_status_comp(__iomem struct pcie_bar0 *pcie)
+static inline int get_pcie_cqe_status_size_error(__iomem struct pcie_cqe *cqe)
 {
-	return (ioread8(&pcie->wr_status) & PCIE_BAR0_WR_STATUS_COMP_MASK) >>
-	       PCIE_BAR0_WR_STATUS_COMP_OFST;
+	return (ioread8(&cqe->status) & PCIE_CQE_STATUS_SIZE_ERROR_MASK) >>
+	       PCIE_CQE_STATUS_SIZE_ERROR_OFST;
 }
 
-static inline void set_pcie_bar0_wr_status_comp(__iomem struct pcie_bar0 *pcie)
+static inline void set_pcie_cqe_status_size_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->wr_status) |
-			PCIE_BAR0_WR_STATUS_COMP_MASK;
-	iowrite8(new_value, &pcie->wr_status);
+	int new_value = ioread8(&cqe->status) |
+			PCIE_CQE_STATUS_SIZE_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
 
 static inline void
-unset_pcie_bar0_wr_status_comp(__iomem struct pcie_bar0 *pcie)
+unset_pcie_cqe_status_size_error(__iomem struct pcie_cqe *cqe)
 {
-	int new_value = ioread8(&pcie->wr_status) &
-			~PCIE_BAR0_WR_STATUS_COMP_MASK;
-	iowrite8(new_value, &pcie->wr_status);
+	int new_value = ioread8(&cqe->status) &
+			~PCIE_CQE_STATUS_SIZE_ERROR_MASK;
+	iowrite8(new_value, &cqe->status);
 }
-
-static inline int
-get_pcie_bar0_wr_status_addr_error(__iomem struct pcie_bar0 *pcie)
-{
-	return (ioread8(&pcie->wr_status) &
-		PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK) >>
-	       PCIE_BAR0_WR_STATUS_ADDR_ERROR_OFST;
-}
-
-static inline void
-set_pcie_bar0_wr_status_addr_error(__iomem struct pcie_bar0 *pcie)
-{
-	int new_value = ioread8(&pcie->wr_status) |
-			PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK;
-	iowrite8(new_value, &pcie->wr_status);
-}
-
-static inline void
-unset_pcie_bar0_wr_status_addr_error(__iomem struct pcie_bar0 *pcie)
-{
-	int new_value = ioread8(&pcie->wr_status) &
-			~PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK;
-	iowrite8(new_value, &pcie->wr_status);
-}
-
-static inline int
-get_pcie_bar0_wr_status_size_error(__iomem struct pcie_bar0 *pcie)
-{
-	return (ioread8(&pcie->wr_status) &
-		PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK) >>
-	       PCIE_BAR0_WR_STATUS_SIZE_ERROR_OFST;
-}
-
-static inline void
-set_pcie_bar0_wr_status_size_error(__iomem struct pcie_bar0 *pcie)
-{
-	int new_value = ioread8(&pcie->wr_status) |
-			PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK;
-	iowrite8(new_value, &pcie->wr_status);
-}
-
-static inline void
-unset_pcie_bar0_wr_status_size_error(__iomem struct pcie_bar0 *pcie)
-{
-	int new_value = ioread8(&pcie->wr_status) &
-			~PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK;
-	iowrite8(new_value, &pcie->wr_status);
-}
-
@@ -0,0 +1,106 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM r04flash
+
+#if !defined(_R04FLASH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _R04FLASH_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * События пути команды: отправка элемента sq, запись doorbell, прерывание
+ * очереди и завершение команды с задержкой от отправки.
+ * Включаются через /sys/kernel/tracing/events/r04flash/.
+ */
+
+TRACE_EVENT(r04flash_submit,
+	TP_PROTO(int qid, int cid, u8 opcode, u64 addr, u32 size),
+	TP_ARGS(qid, cid, opcode, addr, size),
+
+	TP_STRUCT__entry(
+		__field(int, qid)
+		__field(int, cid)
+		__field(u8, opcode)
+		__field(u64, addr)
+		__field(u32, size)
+	),
+
+	TP_fast_assign(
+		__entry->qid = qid;
+		__entry->cid = cid;
+		__entry->opcode = opcode;
+		__entry->addr = addr;
+		__entry->size = size;
+	),
+
+	TP_printk("qid=%d cid=%d opcode=%u addr=0x%llx size=0x%x",
+		  __entry->qid, __entry->cid, __entry->opcode, __entry->addr,
+		  __entry->size)
+);
+
+TRACE_EVENT(r04flash_doorbell,
+	TP_PROTO(int qid, u32 sq_tail),
+	TP_ARGS(qid, sq_tail),
+
+	TP_STRUCT__entry(
+		__field(int, qid)
+		__field(u32, sq_tail)
+	),
+
+	TP_fast_assign(
+		__entry->qid = qid;
+		__entry->sq_tail = sq_tail;
+	),
+
+	TP_printk("qid=%d sq_tail=%u", __entry->qid, __entry->sq_tail)
+);
+
+TRACE_EVENT(r04flash_irq,
+	TP_PROTO(int qid, int completions),
+	TP_ARGS(qid, completions),
+
+	TP_STRUCT__entry(
+		__field(int, qid)
+		__field(int, completions)
+	),
+
+	TP_fast_assign(
+		__entry->qid = qid;
+		__entry->completions = completions;
+	),
+
+	TP_printk("qid=%d completions=%d", __entry->qid,
+		  __entry->completions)
+);
+
+TRACE_EVENT(r04flash_complete,
+	TP_PROTO(int qid, int cid, u8 status, u32 result, u64 latency_ns),
+	TP_ARGS(qid, cid, status, result, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int, qid)
+		__field(int, cid)
+		__field(u8, status)
+		__field(u32, result)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->qid = qid;
+		__entry->cid = cid;
+		__entry->status = status;
+		__entry->result = result;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("qid=%d cid=%d status=0x%x result=0x%x latency=%lluns",
+		  __entry->qid, __entry->cid, __entry->status, __entry->result,
+		  __entry->latency_ns)
+);
+
+#endif /* _R04FLASH_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE r04flash_trace
+#include <trace/define_trace.h>
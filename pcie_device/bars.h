@@ -2,269 +2,323 @@
 #include <stdint.h>
 
 #define KiB           1024
+// минимальный размер окна передачи (прежний фиксированный)
 #define WIN_SIZE      32 * KiB
+// предельный размер окна передачи
+#define WIN_SIZE_MAX  (1u << 30)
+#define BAR0_SIZE     16 * KiB
 #define FIELD_SIZE    64
 #define POOLING_DELAY 200
 
+// количество элементов в каждой из очередей (одна ячейка всегда свободна,
+// поэтому одновременно в работе может находиться QUEUE_DEPTH - 1 команд)
+#define QUEUE_DEPTH 64
+
 #define ALIGNED(_size) __attribute__((aligned(_size)))
 
 #define __field         ALIGNED(FIELD_SIZE)
 #define __window(_name) ALIGNED(WIN_SIZE) uint8_t _name[WIN_SIZE]
 
-struct pcie_desc {
+enum pcie_queue_id {
+    PCIE_RD_QUEUE = 0,
+    PCIE_WR_QUEUE,
+    PCIE_QUEUES_NUM,
+};
+
+enum pcie_opcode {
+    PCIE_OP_READ = 1,
+    PCIE_OP_WRITE = 2,
+    // сброс всех завершённых записей на носитель, addr/size/buf_ofst не
+    // используются
+    PCIE_OP_FLUSH = 3,
+    // освобождение диапазона addr/size, после чего он читается нулями
+    PCIE_OP_DISCARD = 4,
+};
+
+// флаги элемента очереди отправки
+// FUA - запись завершается только после сброса её данных на носитель
+#define PCIE_SQE_FLAG_FUA (1 << 0)
+// SGL (только READ/WRITE) - данные команды занимают несколько экстентов
+// хранилища: их список (struct pcie_sgl_entry) лежит в окне передачи команды
+// по смещению sgl_ofst, addr не используется, size - суммарный размер.
+// Данные экстентов располагаются в окне подряд начиная с buf_ofst.
+#define PCIE_SQE_FLAG_SGL (1 << 1)
+
+// максимальное количество элементов списка SGL
+#define PCIE_SGL_MAX 256
+
+// элемент очереди отправки (заполняет хост)
+struct pcie_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    // идентификатор команды, возвращается в элементе очереди завершения
+    uint16_t cid;
+    uint32_t size;
+    uint32_t addr_low;
+    uint32_t addr_high;
+    // смещение данных команды внутри окна передачи
+    uint32_t buf_ofst;
+    // список экстентов для PCIE_SQE_FLAG_SGL: смещение в том же окне
+    // (выровнено на размер элемента) и количество элементов
+    uint32_t sgl_ofst;
+    uint32_t sgl_num;
+    uint32_t rsvd;
+};
+
+// элемент списка экстентов команды с PCIE_SQE_FLAG_SGL
+struct pcie_sgl_entry {
     uint32_t addr_low;
     uint32_t addr_high;
     uint32_t size;
+    uint32_t rsvd;
+};
+
+// элемент очереди завершения (заполняет устройство)
+struct pcie_cqe {
+    // количество обработанных байт
+    uint32_t result;
+    // голова очереди отправки на момент завершения команды
+    uint16_t sq_head;
+    uint16_t cid;
+    uint8_t rsvd[7];
+
+    // регистр статуса команды (записывается последним)
+    // - phase
+    // - io_error
+    // - op_error
+    // - addr_error
+    // - size_error
+    uint8_t status;
 };
 
+struct pcie_queue {
+    // doorbell регистры (пишет хост)
+    __field uint32_t sq_tail;
+    uint32_t cq_head;
+
+    // состояние очередей (пишет устройство)
+    __field uint32_t sq_head;
+    // 31 бит - текущая фаза очереди завершения
+    uint32_t cq_tail;
+
+    __field struct pcie_sqe sq[QUEUE_DEPTH];
+    __field struct pcie_cqe cq[QUEUE_DEPTH];
+};
+
+#define PCIE_CQ_TAIL_PHASE_OFST (31)
+#define PCIE_CQ_TAIL_PHASE_MASK (1u << PCIE_CQ_TAIL_PHASE_OFST)
+
 struct pcie_bar0 {
     // размер диска
     __field uint32_t disk_size;
+    // объединение прерываний (пишет хост, 0 - значение по умолчанию):
+    // прерывание отправляется после irq_coalesce_count завершений очереди
+    // (по умолчанию 1 - без объединения) либо через irq_coalesce_usec после
+    // первого завершения без прерывания. Без порога времени прерывание
+    // отправляется также, когда в очереди не остаётся команд в работе.
+    uint32_t irq_coalesce_count;
+    uint32_t irq_coalesce_usec;
+    // размер окон передачи и их смещения в bar2 (пишет устройство при
+    // запуске). 0 в win_size - раскладка struct pcie_bar2 с окнами WIN_SIZE
+    uint32_t win_size;
+    uint32_t rd_win_ofst;
+    uint32_t wr_win_ofst;
+
+    // пары очередей отправки/завершения, по одной на направление
+    __field struct pcie_queue queues[PCIE_QUEUES_NUM];
+};
+
+_Static_assert(sizeof(struct pcie_bar0) <= BAR0_SIZE, "bar0 is too small");
 
-    __field struct {
-        // регистр статуса чтения
-        // - start
-        uint8_t rd_ctrl;
-
-        // регистр ошибки чтения
-        // - comp
-        // - addr_error
-        // - size_error
-        uint8_t rd_status;
-
-        // регистр статуса записи
-        // - start
-        uint8_t wr_ctrl;
-
-        // регистр ошибки записи
-        // - comp
-        // - addr_error
-        // - size_error
-        uint8_t wr_status;
-    };
-
-    // дескриптор чтения
-    __field struct pcie_desc rd_desc;
-
-    // дескриптор записи
-    __field struct pcie_desc wr_desc;
+// Страница doorbell регистров, перехватываемых QEMU (последняя страница bar0).
+// Запись в sq_tail[qid] пересылается эмулятору сообщением `D<qid>\n`, само
+// значение хвоста хост дублирует в pcie_queue.sq_tail.
+#define PCIE_DB_SIZE  4 * KiB
+#define PCIE_DB_MAGIC 0x52304442
+
+struct pcie_db {
+    uint32_t sq_tail[PCIE_QUEUES_NUM];
+    uint8_t rsvd[PCIE_DB_SIZE - PCIE_QUEUES_NUM * 4 - 4];
+    // при чтении возвращает PCIE_DB_MAGIC
+    uint32_t magic;
 };
 
+// Наименьший bar2. Эмулятор делит bar2 на два окна наибольшего размера -
+// степени двойки (не больше WIN_SIZE_MAX) и сообщает раскладку в bar0.
 struct pcie_bar2 {
     __window(rd_data);
     __window(wr_data);
 };
 
+// Необязательный bar4 - файл хранилища целиком (эмулятор запускается с
+// --direct). Гость читает и пишет его напрямую, без команд; такие записи не
+// упорядочены с командами и сохраняются на носителе только командой FLUSH.
+#define PCIE_STORAGE_BAR_NO 4
+
 /*
  * -------------------------------  DEVICE  ------------------------------------
- * Алгоритм работы процесса произведения опреаций чтения:
- * - Ожидание бита rd_start в csr.
- * - Сброс прерывания rd_comp
- * - Сброс регистров: rd_err
- * - Проверка дескриптора
- *   - Если в дескрипторе не валиден адрес, установить addr_error бит в rd_err
- *   - Если в дескрипторе не валиден размер, установить size_error бит в rd_err
- *   - Если выполнено хотя бы что-то из вышеперечисленного, установить
- *     прерывание rd_comp и закончить алгоритм
- * - Блокировка данных по заданному адресу на заданный размер
- * - Копиросание данных из памяти в трансляционное пространство чтения
- * - Разблокировка адреса
- * - Сброс бита rd_start
- * - Установить прерывание rd_comp
+ * Обмен командами построен на парах кольцевых очередей (по образцу NVMe):
+ * очередь отправки (sq) заполняется хостом, очередь завершения (cq) -
+ * устройством. Каждую очередь отправки разбирает свой поток выборки, который
+ * раздаёт команды пулу исполнителей (деки исполнителей с кражей работы).
+ * Команды одной очереди могут завершаться не в порядке отправки, связь с
+ * отправленной командой - по cid.
+ *
+ * Алгоритм выборки из очереди отправки:
+ * - Ожидание, пока doorbell sq_tail не станет отличен от локального sq_head.
+ *   В режиме событий поток блокируется до прихода сообщения `D<qid>` от QEMU,
+ *   в режиме опроса - периодически перечитывает sq_tail.
+ * - Для каждого элемента от sq_head до sq_tail, пока в работе меньше
+ *   QUEUE_DEPTH - 1 команд:
+ *   - Копирование элемента и продвижение sq_head (публикуется в регистре)
+ *   - Передача команды очередному исполнителю
  *
- * Алгоритм работы процесса произведения опреаций записи:
- * - Ожидание бита wr_start в csr.
- * - Сброс прерывания wr_comp
- * - Сброс регистров: wr_err
- * - Проверка дескриптора
- *   - Если в дескрипторе не валиден адрес, установить addr_error бит в wr_err
- *   - Если в дескрипторе не валиден размер, установить size_error бит в wr_err
- *   - Если выполнено хотя бы что-то из вышеперечисленного, установить
- *     прерывание wr_comp и закончить алгоритм
- * - Блокировка данных по заданному адресу на заданный размер
- * - Копирование данных из трансляционного пространства записи в память
- * - Разблокировка адреса.
- * - Сброс бита wr_start
- * - Установить прерывание wr_comp
+ * Алгоритм исполнения команды:
+ *   - Проверка дескриптора
+ *     - Если в дескрипторе не валиден адрес, установить addr_error
+ *     - Если размер нулевой или данные не умещаются в окне, установить
+ *       size_error
+ *     - Если неизвестен код операции, установить op_error
+ *     - Для SGL - копирование списка из окна и та же проверка каждого
+ *       экстента; список должен умещаться в окне, не пересекаться с данными,
+ *       а сумма размеров экстентов - совпадать с size (иначе size_error)
+ *   - Блокировка данных по заданному адресу на заданный размер (расширенному
+ *     до выравнивания хранилища), для SGL - диапазона, охватывающего все
+ *     экстенты
+ *   - Копирование данных между хранилищем и окном по смещению buf_ofst
+ *     (для SGL - экстентов по очереди, подряд в окне; DISCARD - освобождение
+ *     диапазона, окно не используется)
+ *   - Для записи - сохранение согласно политике: сразу sync (sync, а также
+ *     любая запись с флагом FUA) либо отметка изменений хранилищем, которые
+ *     сбрасываются фоновым потоком (periodic) или командой FLUSH
+ *   - Разблокировка адреса
+ *   - Запись элемента очереди завершения с текущей фазой (под блокировкой
+ *     очереди завершения), статус пишется последним. При переходе через конец
+ *     очереди фаза инвертируется.
+ *   - Отправить прерывание согласно порогам irq_coalesce_count/usec (см.
+ *     struct pcie_bar0). У каждой очереди свой вектор MSI-X/MSI с номером qid
+ *     (сообщение `I<qid>` в сокет QEMU)
  *
- * Алгоритм блокировки адреса памяти для чтения (симетрично для записи):
- * - проверить, пересекается ли диапазон с тем, что заблокирован для записи
- *   - если не пересекается (или не установлен), установить блокировку чтения
- *   - если пересекается, установить эту блокировку при снятии блокировки чтения
+ * Размер окон передачи не зафиксирован: устройство выводит его из размера
+ * bar2 и публикует в win_size/rd_win_ofst/wr_win_ofst bar0, хост читает их
+ * при инициализации и ограничивает ими размер и смещения команд.
  *
- * Алгоритм снятия блокировки адреса памяти для чтения (симетрично для записи):
- * - если есть блокировака записи в очереди на установку, установить
- * - снять блокировку чтения
+ * Если очередь завершения заполнена (cq_tail + 1 == cq_head), устройство
+ * ждёт, пока хост не освободит элементы.
+ *
+ * Блокировка адресов памяти (range_lock): чтение берёт разделяемую блокировку
+ * диапазона, запись - исключительную.
+ * - запрос добавляется в дерево интервалов и считает более ранние
+ *   пересекающиеся запросы, с которыми конфликтует (хотя бы один из двух -
+ *   запись)
+ * - если таких нет, блокировка получена, иначе исполнитель ждёт на своей
+ *   условной переменной
+ * - при снятии блокировки узел удаляется из дерева, у более поздних
+ *   конфликтующих запросов уменьшается счётчик, обнулившиеся - будятся
  *
  * --------------------------------  HOST  -------------------------------------
- * Порядок инициализации чтения:
- * 1. Проверка бита rd_start регистра csr
- * 2. Установка дескриптора чтения
- * 3. Ожидание прерывания rd_comp
- * 4. Проверка rd_err регистра:
- *    - если не пустой, возврат кода ошибки
- * 5. Извлечение данных из пространства чтения
+ * Порядок отправки команд:
+ * 1. Выделение свободного идентификатора команды (cid)
+ * 2. Запись элемента sq[sq_tail] (для записи - предварительно заполнить окно
+ *    по смещению buf_ofst, для SGL - записать в окно список экстентов)
+ * 3. После формирования пачки - запись нового sq_tail в doorbell (и в
+ *    pcie_db.sq_tail[qid], если страница doorbell есть в bar0)
+ * 4. Ожидание прерывания
  *
- * Порядок инициализации записи:
- * 1. Проверка бита wr_start регистра csr
- * 2. Установка дескриптора записи
- * 3. Ожидание прерывания wr_comp
- * 4. Проверка wr_err регистра:
- *    - если не пустой, возврат кода ошибки
- * 5. Извлечение данных из пространства записи
+ * Порядок обработки завершений:
+ * 1. Пока фаза cq[cq_head] совпадает с ожидаемой:
+ *    - завершить команду cid со статусом из элемента
+ *    - продвинуть cq_head, при переходе через конец инвертировать фазу
+ * 2. Запись нового cq_head в doorbell
+ * 3. Для чтения - извлечение данных из окна по смещению buf_ofst
  *
  * */
-#define PCIE_BAR0_RD_CTRL_START_OFST (0)
-#define PCIE_BAR0_RD_CTRL_START_MASK (1 << PCIE_BAR0_RD_CTRL_START_OFST)
-
-#define PCIE_BAR0_WR_CTRL_START_OFST (0)
-#define PCIE_BAR0_WR_CTRL_START_MASK (1 << PCIE_BAR0_WR_CTRL_START_OFST)
-
-#define PCIE_BAR0_RD_STATUS_COMP_OFST (0)
-#define PCIE_BAR0_RD_STATUS_COMP_MASK (1 << PCIE_BAR0_RD_STATUS_COMP_OFST)
-
-#define PCIE_BAR0_RD_STATUS_ADDR_ERROR_OFST (6)
-#define PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK \
-    (1 << PCIE_BAR0_RD_STATUS_ADDR_ERROR_OFST)
+#define PCIE_CQE_STATUS_PHASE_OFST (0)
+#define PCIE_CQE_STATUS_PHASE_MASK (1 << PCIE_CQE_STATUS_PHASE_OFST)
 
-#define PCIE_BAR0_RD_STATUS_SIZE_ERROR_OFST (7)
-#define PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK \
-    (1 << PCIE_BAR0_RD_STATUS_SIZE_ERROR_OFST)
+#define PCIE_CQE_STATUS_IO_ERROR_OFST (4)
+#define PCIE_CQE_STATUS_IO_ERROR_MASK (1 << PCIE_CQE_STATUS_IO_ERROR_OFST)
 
-#define PCIE_BAR0_WR_STATUS_COMP_OFST (0)
-#define PCIE_BAR0_WR_STATUS_COMP_MASK (1 << PCIE_BAR0_WR_STATUS_COMP_OFST)
+#define PCIE_CQE_STATUS_OP_ERROR_OFST (5)
+#define PCIE_CQE_STATUS_OP_ERROR_MASK (1 << PCIE_CQE_STATUS_OP_ERROR_OFST)
 
-#define PCIE_BAR0_WR_STATUS_ADDR_ERROR_OFST (6)
-#define PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK \
-    (1 << PCIE_BAR0_WR_STATUS_ADDR_ERROR_OFST)
+#define PCIE_CQE_STATUS_ADDR_ERROR_OFST (6)
+#define PCIE_CQE_STATUS_ADDR_ERROR_MASK (1 << PCIE_CQE_STATUS_ADDR_ERROR_OFST)
 
-#define PCIE_BAR0_WR_STATUS_SIZE_ERROR_OFST (7)
-#define PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK \
-    (1 << PCIE_BAR0_WR_STATUS_SIZE_ERROR_OFST)
+#define PCIE_CQE_STATUS_SIZE_ERROR_OFST (7)
+#define PCIE_CQE_STATUS_SIZE_ERROR_MASK (1 << PCIE_CQE_STATUS_SIZE_ERROR_OFST)
 
-static inline int get_pcie_bar0_rd_ctrl_start(volatile struct pcie_bar0 *pcie) {
-    return (pcie->rd_ctrl & PCIE_BAR0_RD_CTRL_START_MASK)
-        >> PCIE_BAR0_RD_CTRL_START_OFST;
+static inline int get_pcie_cqe_status_phase(volatile struct pcie_cqe *cqe) {
+    return (cqe->status & PCIE_CQE_STATUS_PHASE_MASK)
+        >> PCIE_CQE_STATUS_PHASE_OFST;
 }
 
-static inline void
-set_pcie_bar0_rd_ctrl_start(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_ctrl |= PCIE_BAR0_RD_CTRL_START_MASK;
+static inline void set_pcie_cqe_status_phase(volatile struct pcie_cqe *cqe) {
+    cqe->status |= PCIE_CQE_STATUS_PHASE_MASK;
 }
 
-static inline void
-unset_pcie_bar0_rd_ctrl_start(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_ctrl &= ~PCIE_BAR0_RD_CTRL_START_MASK;
+static inline void unset_pcie_cqe_status_phase(volatile struct pcie_cqe *cqe) {
+    cqe->status &= ~PCIE_CQE_STATUS_PHASE_MASK;
 }
 
-static inline int get_pcie_bar0_wr_ctrl_start(volatile struct pcie_bar0 *pcie) {
-    return (pcie->wr_ctrl & PCIE_BAR0_WR_CTRL_START_MASK)
-        >> PCIE_BAR0_WR_CTRL_START_OFST;
+static inline int get_pcie_cqe_status_io_error(volatile struct pcie_cqe *cqe) {
+    return (cqe->status & PCIE_CQE_STATUS_IO_ERROR_MASK)
+        >> PCIE_CQE_STATUS_IO_ERROR_OFST;
 }
 
 static inline void
-set_pcie_bar0_wr_ctrl_start(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_ctrl |= PCIE_BAR0_WR_CTRL_START_MASK;
+set_pcie_cqe_status_io_error(volatile struct pcie_cqe *cqe) {
+    cqe->status |= PCIE_CQE_STATUS_IO_ERROR_MASK;
 }
 
 static inline void
-unset_pcie_bar0_wr_ctrl_start(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_ctrl &= ~PCIE_BAR0_WR_CTRL_START_MASK;
+unset_pcie_cqe_status_io_error(volatile struct pcie_cqe *cqe) {
+    cqe->status &= ~PCIE_CQE_STATUS_IO_ERROR_MASK;
 }
 
-static inline int
-get_pcie_bar0_rd_status_comp(volatile struct pcie_bar0 *pcie) {
-    return (pcie->rd_status & PCIE_BAR0_RD_STATUS_COMP_MASK)
-        >> PCIE_BAR0_RD_STATUS_COMP_OFST;
+static inline int get_pcie_cqe_status_op_error(volatile struct pcie_cqe *cqe) {
+    return (cqe->status & PCIE_CQE_STATUS_OP_ERROR_MASK)
+        >> PCIE_CQE_STATUS_OP_ERROR_OFST;
 }
 
 static inline void
-set_pcie_bar0_rd_status_comp(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_status |= PCIE_BAR0_RD_STATUS_COMP_MASK;
+set_pcie_cqe_status_op_error(volatile struct pcie_cqe *cqe) {
+    cqe->status |= PCIE_CQE_STATUS_OP_ERROR_MASK;
 }
 
 static inline void
-unset_pcie_bar0_rd_status_comp(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_status &= ~PCIE_BAR0_RD_STATUS_COMP_MASK;
+unset_pcie_cqe_status_op_error(volatile struct pcie_cqe *cqe) {
+    cqe->status &= ~PCIE_CQE_STATUS_OP_ERROR_MASK;
 }
 
 static inline int
-get_pcie_bar0_rd_status_addr_error(volatile struct pcie_bar0 *pcie) {
-    return (pcie->rd_status & PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK)
-        >> PCIE_BAR0_RD_STATUS_ADDR_ERROR_OFST;
+get_pcie_cqe_status_addr_error(volatile struct pcie_cqe *cqe) {
+    return (cqe->status & PCIE_CQE_STATUS_ADDR_ERROR_MASK)
+        >> PCIE_CQE_STATUS_ADDR_ERROR_OFST;
 }
 
 static inline void
-set_pcie_bar0_rd_status_addr_error(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_status |= PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK;
+set_pcie_cqe_status_addr_error(volatile struct pcie_cqe *cqe) {
+    cqe->status |= PCIE_CQE_STATUS_ADDR_ERROR_MASK;
 }
 
 static inline void
-unset_pcie_bar0_rd_status_addr_error(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_status &= ~PCIE_BAR0_RD_STATUS_ADDR_ERROR_MASK;
+unset_pcie_cqe_status_addr_error(volatile struct pcie_cqe *cqe) {
+    cqe->status &= ~PCIE_CQE_STATUS_ADDR_ERROR_MASK;
 }
 
 static inline int
-get_pcie_bar0_rd_status_size_error(volatile struct pcie_bar0 *pcie) {
-    return (pcie->rd_status & PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK)
-        >> PCIE_BAR0_RD_STATUS_SIZE_ERROR_OFST;
+get_pcie_cqe_status_size_error(volatile struct pcie_cqe *cqe) {
+    return (cqe->status & PCIE_CQE_STATUS_SIZE_ERROR_MASK)
+        >> PCIE_CQE_STATUS_SIZE_ERROR_OFST;
 }
 
 static inline void
-set_pcie_bar0_rd_status_size_error(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_status |= PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK;
+set_pcie_cqe_status_size_error(volatile struct pcie_cqe *cqe) {
+    cqe->status |= PCIE_CQE_STATUS_SIZE_ERROR_MASK;
 }
 
 static inline void
-unset_pcie_bar0_rd_status_size_error(volatile struct pcie_bar0 *pcie) {
-    pcie->rd_status &= ~PCIE_BAR0_RD_STATUS_SIZE_ERROR_MASK;
+unset_pcie_cqe_status_size_error(volatile struct pcie_cqe *cqe) {
+    cqe->status &= ~PCIE_CQE_STATUS_SIZE_ERROR_MASK;
 }
-
-static inline int
-get_pcie_bar0_wr_status_comp(volatile struct pcie_bar0 *pcie) {
-    return (pcie->wr_status & PCIE_BAR0_WR_STATUS_COMP_MASK)
-        >> PCIE_BAR0_WR_STATUS_COMP_OFST;
-}
-
-static inline void
-set_pcie_bar0_wr_status_comp(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_status |= PCIE_BAR0_WR_STATUS_COMP_MASK;
-}
-
-static inline void
-unset_pcie_bar0_wr_status_comp(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_status &= ~PCIE_BAR0_WR_STATUS_COMP_MASK;
-}
-
-static inline int
-get_pcie_bar0_wr_status_addr_error(volatile struct pcie_bar0 *pcie) {
-    return (pcie->wr_status & PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK)
-        >> PCIE_BAR0_WR_STATUS_ADDR_ERROR_OFST;
-}
-
-static inline void
-set_pcie_bar0_wr_status_addr_error(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_status |= PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK;
-}
-
-static inline void
-unset_pcie_bar0_wr_status_addr_error(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_status &= ~PCIE_BAR0_WR_STATUS_ADDR_ERROR_MASK;
-}
-
-static inline int
-get_pcie_bar0_wr_status_size_error(volatile struct pcie_bar0 *pcie) {
-    return (pcie->wr_status & PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK)
-        >> PCIE_BAR0_WR_STATUS_SIZE_ERROR_OFST;
-}
-
-static inline void
-set_pcie_bar0_wr_status_size_error(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_status |= PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK;
-}
-
-static inline void
-unset_pcie_bar0_wr_status_size_error(volatile struct pcie_bar0 *pcie) {
-    pcie->wr_status &= ~PCIE_BAR0_WR_STATUS_SIZE_ERROR_MASK;
-}
-
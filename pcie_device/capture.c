@@ -0,0 +1,137 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void capture_flush(struct capture *c, struct capture_buf *b) {
+    if (b->count == 0) return;
+    // O_APPEND: пачки разных очередей не перемешиваются
+    if (!write_all(c->fd, b->recs, b->count * sizeof(*b->recs)))
+        printf("capture write error: %s\n", strerror(errno));
+    b->count = 0;
+}
+
+int capture_open(struct capture *c, const char *path, uint64_t start_ns) {
+    struct capture_header hdr = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .record_size = sizeof(struct capture_record),
+    };
+
+    memset(c, 0, sizeof(*c));
+    c->start_ns = start_ns;
+    c->fd = open(
+        path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644
+    );
+    if (c->fd == -1) return -1;
+
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        c->bufs[qid].recs =
+            malloc(CAPTURE_BUF_SIZE * sizeof(struct capture_record));
+        if (!c->bufs[qid].recs) goto err;
+    }
+    if (!write_all(c->fd, &hdr, sizeof(hdr))) goto err;
+    return 0;
+
+err:
+    capture_close(c);
+    return -1;
+}
+
+void capture_add(
+    struct capture *c,
+    enum pcie_queue_id qid,
+    const struct pcie_sqe *sqe,
+    uint64_t ts_ns
+) {
+    struct capture_buf *b = &c->bufs[qid];
+    struct capture_record *r = &b->recs[b->count++];
+
+    memset(r, 0, sizeof(*r));
+    r->ts_ns = ts_ns - c->start_ns;
+    r->addr = (uint64_t)sqe->addr_low | ((uint64_t)sqe->addr_high << 32);
+    r->size = sqe->size;
+    r->buf_ofst = sqe->buf_ofst;
+    r->qid = qid;
+    r->opcode = sqe->opcode;
+    r->flags = sqe->flags;
+
+    if (b->count == CAPTURE_BUF_SIZE) capture_flush(c, b);
+}
+
+void capture_close(struct capture *c) {
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        if (c->fd != -1 && c->bufs[qid].recs) capture_flush(c, &c->bufs[qid]);
+        free(c->bufs[qid].recs);
+        c->bufs[qid].recs = NULL;
+    }
+    if (c->fd != -1) close(c->fd);
+    c->fd = -1;
+}
+
+static int record_cmp(const void *a, const void *b) {
+    uint64_t ta = ((const struct capture_record *)a)->ts_ns;
+    uint64_t tb = ((const struct capture_record *)b)->ts_ns;
+    return ta < tb ? -1 : ta > tb;
+}
+
+struct capture_record *capture_load(const char *path, size_t *count) {
+    struct capture_header hdr;
+    struct capture_record *recs = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) return NULL;
+    if (fstat(fd, &st) == -1) goto err;
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+        || hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION
+        || hdr.record_size != sizeof(struct capture_record)) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    // недописанный хвост (эмулятор аварийно завершился) отбрасывается
+    *count = (st.st_size - sizeof(hdr)) / sizeof(*recs);
+    recs = malloc((*count ? *count : 1) * sizeof(*recs));
+    if (!recs) goto err;
+
+    for (size_t done = 0, size = *count * sizeof(*recs); done < size;) {
+        ssize_t n = read(fd, (uint8_t *)recs + done, size - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            goto err;
+        }
+        done += n;
+    }
+    close(fd);
+
+    qsort(recs, *count, sizeof(*recs), record_cmp);
+    return recs;
+
+err:
+    free(recs);
+    close(fd);
+    return NULL;
+}
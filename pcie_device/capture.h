@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bars.h"
+
+// Запись дескрипторов, выбранных эмулятором из очередей отправки, для
+// последующего воспроизведения (dev_bench --replay).
+//
+// Каждый поток выборки копит записи своей очереди в собственном буфере и
+// дописывает его в файл одним write (O_APPEND), поэтому записи в файле
+// сгруппированы пачками по очередям; при загрузке они сортируются по времени.
+//
+// Списки экстентов (PCIE_SQE_FLAG_SGL) не записываются: такая команда
+// воспроизводится одним экстентом суммарного размера по адресу из addr.
+
+#define CAPTURE_MAGIC   0x52303443u // "R04C"
+#define CAPTURE_VERSION 1
+// записей в буфере очереди
+#define CAPTURE_BUF_SIZE 4096
+
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t rsvd;
+};
+
+struct capture_record {
+    // момент выборки от начала записи, нс
+    uint64_t ts_ns;
+    uint64_t addr;
+    uint32_t size;
+    uint32_t buf_ofst;
+    uint8_t qid;
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t rsvd[5];
+};
+
+_Static_assert(sizeof(struct capture_record) == 32, "capture record size");
+
+struct capture_buf {
+    struct capture_record *recs;
+    uint32_t count;
+};
+
+struct capture {
+    int fd;
+    uint64_t start_ns;
+    struct capture_buf bufs[PCIE_QUEUES_NUM];
+};
+
+// 0 - успех, -1 - ошибка (errno)
+int capture_open(struct capture *c, const char *path, uint64_t start_ns);
+
+// вызывается только потоком выборки очереди qid
+void capture_add(
+    struct capture *c,
+    enum pcie_queue_id qid,
+    const struct pcie_sqe *sqe,
+    uint64_t ts_ns
+);
+
+// дописывает оставшиеся записи, вызывается после остановки потоков выборки
+void capture_close(struct capture *c);
+
+// загрузка всех записей файла, отсортированных по времени; NULL - ошибка
+// (errno), освобождается free
+struct capture_record *capture_load(const char *path, size_t *count);
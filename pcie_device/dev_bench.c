@@ -0,0 +1,662 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "pcie_dev.h"
+
+// Нагрузочный тест эмулятора без гостя и QEMU.
+//
+// В каталоге создаются файлы bar0/bar2/хранилища, pcie_dev запускается в том
+// же процессе и подключается к локальной замене сокета QEMU. Программный
+// "драйвер" играет роль гостя: заполняет очереди отправки в bar0, сообщает о
+// doorbell сообщением `D<qid>`, ждёт `I<qid>` и разбирает очереди завершения.
+//
+// Перебираются размер передачи, доля чтений, последовательный или случайный
+// доступ и количество команд в работе (на обе очереди). Содержимое окон не
+// проверяется, поэтому при глубине больше числа блоков в окне команды
+// разделяют его области - на время обработки эмулятором это не влияет.
+//
+// С --replay вместо перебора воспроизводится запись dev_handle --capture:
+// дескрипторы отправляются в исходные очереди с записанными интервалами
+// (или без пауз с --fast), не более QUEUE_DEPTH - 1 команд в очереди.
+
+#define DEFAULT_OPS         10000
+#define DEFAULT_STORAGE_MIB 256
+#define DEFAULT_WINDOW_KIB  (WIN_SIZE / KiB)
+// без прерывания дольше этого считаем, что эмулятор завис
+#define IRQ_TIMEOUT_MS 5000
+
+static const uint32_t sizes[] = {512, 4 * KiB, WIN_SIZE};
+// доля чтений, %
+static const int read_pcts[] = {100, 0, 70};
+static const int depths[] = {1, 8, QUEUE_DEPTH - 1};
+
+struct bench_queue {
+    volatile struct pcie_queue *regs;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint8_t phase;
+    // в очереди есть элементы, о которых не сообщено doorbell
+    int doorbell;
+
+    uint16_t free_cids[QUEUE_DEPTH];
+    uint32_t free_num;
+    uint64_t submit_ns[QUEUE_DEPTH];
+    // передаваемые командой данные (0 у FLUSH/DISCARD)
+    uint32_t bytes[QUEUE_DEPTH];
+};
+
+struct bench {
+    struct pcie_dev dev;
+    // pcie_dev_init завершился успешно
+    int started;
+    struct mapped_file bar0_f;
+    volatile struct pcie_bar0 *csr;
+    uint64_t storage_size;
+    // размер окон передачи, объявленный эмулятором в bar0
+    uint32_t win_size;
+
+    // замена сокета QEMU: принятое соединение эмулятора
+    int listen_fd;
+    int conn_fd;
+    pthread_t irq_thread;
+    // взводится при каждом сообщении о прерывании
+    int irq_efd;
+
+    struct bench_queue queues[PCIE_QUEUES_NUM];
+    uint32_t inflight;
+    uint32_t rnd;
+
+    // задержки завершённых команд текущего прогона
+    uint64_t *lat;
+    uint32_t done;
+    uint32_t errors;
+    uint64_t bytes;
+};
+
+struct scenario {
+    uint32_t size;
+    int read_pct;
+    int random;
+    int depth;
+    int ops;
+};
+
+static inline uint32_t xorshift(uint32_t *rnd) {
+    *rnd ^= *rnd << 13;
+    *rnd ^= *rnd >> 17;
+    *rnd ^= *rnd << 5;
+    return *rnd;
+}
+
+// приём сообщений эмулятора (только `I<qid>`)
+static void *irq_thread_func(void *arg) {
+    struct bench *b = (struct bench *)arg;
+    uint64_t one = 1;
+    char buf[256];
+    ssize_t len;
+
+    while ((len = recv(b->conn_fd, buf, sizeof(buf), 0)) > 0) {
+        for (ssize_t i = 0; i < len; ++i) {
+            if (buf[i] == 'I' && write(b->irq_efd, &one, sizeof(one)) == -1)
+                fprintf(stderr, "irq eventfd error: %s\n", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+static int create_file(const char *dir, const char *name, uint64_t size) {
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        fprintf(stderr, "unable to create `%s`: %s\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+static int listen_local(struct bench *b, int *port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+
+    b->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (b->listen_fd == -1
+        || bind(b->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(b->listen_fd, 1) == -1
+        || getsockname(b->listen_fd, (struct sockaddr *)&addr, &len) == -1) {
+        fprintf(stderr, "socket error: %s\n", strerror(errno));
+        return 0;
+    }
+    *port = ntohs(addr.sin_port);
+    return 1;
+}
+
+static int bench_init(
+    struct bench *b,
+    const char *dir,
+    uint64_t size,
+    uint64_t win_size,
+    struct pcie_dev_opts *opts
+) {
+    char bar0[4096], bar2[4096], storage[4096];
+    int one = 1;
+
+    memset(b, 0, sizeof(*b));
+    b->listen_fd = b->conn_fd = b->irq_efd = -1;
+    b->storage_size = size;
+    b->rnd = 0x9e3779b9u;
+
+    snprintf(bar0, sizeof(bar0), "%s/bar0", dir);
+    snprintf(bar2, sizeof(bar2), "%s/bar2", dir);
+    snprintf(storage, sizeof(storage), "%s/storage", dir);
+    if (!create_file(dir, "bar0", BAR0_SIZE)
+        || !create_file(dir, "bar2", 2 * win_size)
+        || !create_file(dir, "storage", size))
+        return 0;
+
+    if (!listen_local(b, &opts->irq_port)) return 0;
+    b->irq_efd = eventfd(0, EFD_CLOEXEC);
+    if (b->irq_efd == -1) return 0;
+
+    // подключение эмулятора ждёт в очереди listen до accept
+    if (pcie_dev_init(&b->dev, bar0, bar2, storage, opts) != PCIE_DEV_OK) {
+        fprintf(stderr, "unable to start emulator: %s\n", strerror(errno));
+        return 0;
+    }
+    b->started = 1;
+    b->conn_fd = accept(b->listen_fd, NULL, NULL);
+    if (b->conn_fd == -1) return 0;
+    // как chardev QEMU с nodelay: doorbell не копятся алгоритмом Нейгла
+    setsockopt(b->conn_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (pthread_create(&b->irq_thread, NULL, irq_thread_func, b) != 0) {
+        b->irq_thread = 0;
+        return 0;
+    }
+
+    if (mf_init(&b->bar0_f, bar0, MF_POPULATE) != MF_OK) return 0;
+    b->csr = (volatile struct pcie_bar0 *)b->bar0_f.base;
+    b->win_size = b->csr->win_size;
+
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        struct bench_queue *q = &b->queues[qid];
+
+        q->regs = &b->csr->queues[qid];
+        q->phase = 1;
+        q->free_num = QUEUE_DEPTH;
+        for (int i = 0; i < QUEUE_DEPTH; ++i) q->free_cids[i] = i;
+    }
+    return 1;
+}
+
+static void bench_cleanup(struct bench *b) {
+    if (b->started) pcie_dev_cleanup(&b->dev);
+    if (b->conn_fd != -1) shutdown(b->conn_fd, SHUT_RDWR);
+    if (b->irq_thread) pthread_join(b->irq_thread, NULL);
+    if (b->conn_fd != -1) close(b->conn_fd);
+    if (b->listen_fd != -1) close(b->listen_fd);
+    if (b->irq_efd != -1) close(b->irq_efd);
+    if (b->bar0_f.base) mf_cleanup(&b->bar0_f);
+}
+
+// в очереди можно разместить ещё одну команду
+static inline int queue_has_room(const struct bench *b, int qid) {
+    return b->queues[qid].free_num > 1;
+}
+
+// запись элемента очереди отправки, buf_ofst < 0 - по cid
+static void submit_cmd(
+    struct bench *b,
+    enum pcie_queue_id qid,
+    uint8_t opcode,
+    uint8_t flags,
+    uint64_t addr,
+    uint32_t size,
+    int64_t buf_ofst
+) {
+    struct bench_queue *q = &b->queues[qid];
+    uint16_t cid = q->free_cids[--q->free_num];
+    volatile struct pcie_sqe *sqe = &q->regs->sq[q->sq_tail];
+
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->cid = cid;
+    sqe->size = size;
+    sqe->addr_low = (uint32_t)addr;
+    sqe->addr_high = (uint32_t)(addr >> 32);
+    sqe->buf_ofst = buf_ofst < 0 ? cid * size % b->win_size : buf_ofst;
+    sqe->sgl_ofst = 0;
+    sqe->sgl_num = 0;
+
+    q->bytes[cid] =
+        opcode == PCIE_OP_READ || opcode == PCIE_OP_WRITE ? size : 0;
+    q->submit_ns[cid] = poller_now_ns();
+    q->sq_tail = (q->sq_tail + 1) % QUEUE_DEPTH;
+    q->doorbell = 1;
+    b->inflight++;
+}
+
+static void
+submit_scenario(struct bench *b, const struct scenario *sc, uint64_t *seq) {
+    enum pcie_queue_id qid = (int)(xorshift(&b->rnd) % 100) < sc->read_pct
+                               ? PCIE_RD_QUEUE
+                               : PCIE_WR_QUEUE;
+    uint64_t blocks = b->storage_size / sc->size;
+    uint64_t addr;
+
+    if (sc->random) {
+        addr = xorshift(&b->rnd) % blocks * sc->size;
+    } else {
+        addr = *seq;
+        *seq = (*seq + sc->size) % (blocks * sc->size);
+    }
+
+    submit_cmd(
+        b,
+        qid,
+        qid == PCIE_RD_QUEUE ? PCIE_OP_READ : PCIE_OP_WRITE,
+        0,
+        addr,
+        sc->size,
+        -1
+    );
+}
+
+static void ring_doorbells(struct bench *b) {
+    char msg[16];
+
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        struct bench_queue *q = &b->queues[qid];
+
+        if (!q->doorbell) continue;
+        q->doorbell = 0;
+        __atomic_store_n(&q->regs->sq_tail, q->sq_tail, __ATOMIC_RELEASE);
+        // так QEMU пересылает запись в страницу doorbell
+        snprintf(msg, sizeof(msg), "D%d\n", qid);
+        if (send(b->conn_fd, msg, strlen(msg), 0) == -1)
+            fprintf(stderr, "doorbell send error: %s\n", strerror(errno));
+    }
+}
+
+// разбор очередей завершения, возвращает количество завершённых команд
+static uint32_t reap(struct bench *b) {
+    uint32_t n = 0;
+
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        struct bench_queue *q = &b->queues[qid];
+        uint32_t head = q->cq_head;
+
+        while (1) {
+            volatile struct pcie_cqe *cqe = &q->regs->cq[q->cq_head];
+            uint8_t status = __atomic_load_n(&cqe->status, __ATOMIC_ACQUIRE);
+
+            if ((status & PCIE_CQE_STATUS_PHASE_MASK) != q->phase) break;
+
+            b->lat[b->done++] = poller_now_ns() - q->submit_ns[cqe->cid];
+            if (status & ~PCIE_CQE_STATUS_PHASE_MASK) b->errors++;
+            else b->bytes += q->bytes[cqe->cid];
+            q->free_cids[q->free_num++] = cqe->cid;
+
+            q->cq_head = (q->cq_head + 1) % QUEUE_DEPTH;
+            if (q->cq_head == 0) q->phase ^= 1;
+            b->inflight--;
+            n++;
+        }
+        if (q->cq_head != head)
+            __atomic_store_n(&q->regs->cq_head, q->cq_head, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+// 1 - пришло прерывание, 0 - истёк timeout_ns, -1 - ошибка
+static int wait_irq(struct bench *b, uint64_t timeout_ns) {
+    struct pollfd pfd = {.fd = b->irq_efd, .events = POLLIN};
+    struct timespec ts = {
+        .tv_sec = timeout_ns / 1000000000,
+        .tv_nsec = timeout_ns % 1000000000,
+    };
+    uint64_t cnt;
+    int n;
+
+    do n = ppoll(&pfd, 1, &ts, NULL);
+    while (n == -1 && errno == EINTR);
+    if (n <= 0) return n;
+    return read(b->irq_efd, &cnt, sizeof(cnt)) == sizeof(cnt) ? 1 : -1;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+    return va < vb ? -1 : va > vb;
+}
+
+static inline double lat_us(const uint64_t *lat, uint32_t n, double q) {
+    uint32_t i = (uint32_t)(q * n);
+    return (i >= n ? lat[n - 1] : lat[i]) / 1000.0;
+}
+
+static inline void bench_reset(struct bench *b) {
+    b->done = 0;
+    b->errors = 0;
+    b->bytes = 0;
+}
+
+// IOPS, MiB/s, перцентили задержки и ошибки завершённого прогона
+static void print_result(struct bench *b, uint64_t elapsed) {
+    qsort(b->lat, b->done, sizeof(*b->lat), u64_cmp);
+    printf(
+        " %10.0f %10.1f %9.1f %9.1f %9.1f %6u\n",
+        b->done * 1e9 / elapsed,
+        (double)b->bytes / elapsed * 1e9 / (1 << 20),
+        lat_us(b->lat, b->done, 0.5),
+        lat_us(b->lat, b->done, 0.99),
+        lat_us(b->lat, b->done, 0.999),
+        b->errors
+    );
+    fflush(stdout);
+}
+
+static int run(struct bench *b, const struct scenario *sc) {
+    uint64_t seq = 0, start;
+    int submitted = 0;
+
+    bench_reset(b);
+    start = poller_now_ns();
+    while ((int)b->done < sc->ops) {
+        while (submitted < sc->ops && (int)b->inflight < sc->depth) {
+            submit_scenario(b, sc, &seq);
+            submitted++;
+        }
+        ring_doorbells(b);
+
+        if (reap(b) == 0 && wait_irq(b, IRQ_TIMEOUT_MS * 1000000ull) <= 0) {
+            fprintf(stderr, "no interrupt in %d ms\n", IRQ_TIMEOUT_MS);
+            return 0;
+        }
+    }
+
+    printf(
+        "%6u %5d %-4s %5d",
+        sc->size,
+        sc->read_pct,
+        sc->random ? "rand" : "seq",
+        sc->depth
+    );
+    print_result(b, poller_now_ns() - start);
+    return 1;
+}
+
+// воспроизведение записи; fast - без соблюдения интервалов
+static int replay(
+    struct bench *b, const struct capture_record *recs, size_t n, int fast
+) {
+    uint64_t start, now, elapsed, lag, lag_max = 0;
+    size_t next = 0;
+
+    bench_reset(b);
+    start = poller_now_ns();
+    while (b->done < n) {
+        uint64_t timeout = IRQ_TIMEOUT_MS * 1000000ull;
+        int paced = 0, r;
+
+        now = poller_now_ns() - start;
+        while (next < n && queue_has_room(b, recs[next].qid)
+               && (fast || recs[next].ts_ns <= now)) {
+            const struct capture_record *rec = &recs[next++];
+
+            lag = fast ? 0 : now - rec->ts_ns;
+            if (lag > lag_max) lag_max = lag;
+            submit_cmd(
+                b,
+                rec->qid,
+                rec->opcode,
+                rec->flags & ~PCIE_SQE_FLAG_SGL,
+                rec->addr,
+                rec->size,
+                rec->buf_ofst
+            );
+        }
+        ring_doorbells(b);
+
+        if (reap(b)) continue;
+
+        // следующую команду пора отправить раньше, чем придёт прерывание
+        if (!fast && next < n && queue_has_room(b, recs[next].qid)
+            && recs[next].ts_ns - now < timeout) {
+            timeout = recs[next].ts_ns - now;
+            paced = 1;
+        }
+        r = wait_irq(b, timeout);
+        if (r < 0 || (r == 0 && !paced)) {
+            fprintf(stderr, "no interrupt in %d ms\n", IRQ_TIMEOUT_MS);
+            return 0;
+        }
+    }
+
+    elapsed = poller_now_ns() - start;
+    printf("%8zu %10.3f %10.1f", n, elapsed / 1e9, lag_max / 1e3);
+    print_result(b, elapsed);
+    return 1;
+}
+
+static inline void print_usage(const char *argv0) {
+    printf(
+        "USAGE: %s [options] <dir>\n"
+        "  в <dir> (лучше на tmpfs) создаются файлы bar0, bar2 и storage\n"
+        "OPTIONS:\n"
+        "  -n, --ops=N                команд в каждом прогоне\n"
+        "  -s, --size=MIB             размер хранилища\n"
+        "  -W, --window=KIB           размер окон передачи (степень двойки)\n"
+        "  -w, --workers=N            количество исполнителей эмулятора\n"
+        "  -S, --storage=mmap|pio|uring\n"
+        "  -D, --durability=sync|periodic|ondemand\n"
+        "  -p, --poll                 опрос sq_tail вместо doorbell\n"
+        "  -r, --replay=FILE          воспроизвести запись dev_handle "
+        "--capture\n"
+        "  -F, --fast                 воспроизводить без записанных пауз\n",
+        argv0
+    );
+}
+
+static const struct option long_opts[] = {
+    {"ops",        required_argument, NULL, 'n'},
+    {"size",       required_argument, NULL, 's'},
+    {"window",     required_argument, NULL, 'W'},
+    {"workers",    required_argument, NULL, 'w'},
+    {"storage",    required_argument, NULL, 'S'},
+    {"durability", required_argument, NULL, 'D'},
+    {"poll",       no_argument,       NULL, 'p'},
+    {"replay",     required_argument, NULL, 'r'},
+    {"fast",       no_argument,       NULL, 'F'},
+    {"help",       no_argument,       NULL, 'h'},
+    {NULL,         0,                 NULL, 0  },
+};
+
+// перебор сценариев по размеру, доле чтений, адресам и глубине очереди;
+// окно больше WIN_SIZE добавляет прогоны команд размером в окно
+static int sweep(struct bench *b, int ops) {
+    uint32_t sz[sizeof(sizes) / sizeof(*sizes) + 1];
+    size_t sz_num = sizeof(sizes) / sizeof(*sizes);
+    struct scenario sc;
+    int ret = EXIT_SUCCESS;
+
+    memcpy(sz, sizes, sizeof(sizes));
+    if (b->win_size > WIN_SIZE) sz[sz_num++] = b->win_size;
+
+    printf(
+        "%6s %5s %-4s %5s %10s %10s %9s %9s %9s %6s\n",
+        "size",
+        "read%",
+        "mode",
+        "depth",
+        "IOPS",
+        "MiB/s",
+        "p50_us",
+        "p99_us",
+        "p999_us",
+        "errors"
+    );
+    sc.ops = ops;
+    for (size_t si = 0; si < sz_num; ++si) {
+        for (size_t ri = 0; ri < sizeof(read_pcts) / sizeof(*read_pcts);
+             ++ri) {
+            for (sc.random = 0; sc.random <= 1; ++sc.random) {
+                for (size_t di = 0; di < sizeof(depths) / sizeof(*depths);
+                     ++di) {
+                    sc.size = sz[si];
+                    sc.read_pct = read_pcts[ri];
+                    sc.depth = depths[di];
+                    if (!run(b, &sc)) return EXIT_FAILURE;
+                    if (b->errors) ret = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+// хранилище должно вместить все адреса записи
+static int
+replay_check(const struct capture_record *recs, size_t n, uint64_t *size) {
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t end = recs[i].addr + recs[i].size;
+
+        if (recs[i].qid >= PCIE_QUEUES_NUM) {
+            fprintf(stderr, "record %zu: bad queue %u\n", i, recs[i].qid);
+            return 0;
+        }
+        end = (end + (1 << 20) - 1) & ~(uint64_t)((1 << 20) - 1);
+        if (end > *size) *size = end;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    static struct bench b;
+    struct pcie_dev_opts opts;
+    struct capture_record *recs = NULL;
+    const char *replay_path = NULL;
+    size_t recs_num = 0;
+    uint64_t storage_size;
+    int ops = DEFAULT_OPS, mib = DEFAULT_STORAGE_MIB, fast = 0, opt, type;
+    int win_kib = DEFAULT_WINDOW_KIB;
+    int ret = EXIT_SUCCESS;
+
+    pcie_dev_opts_default(&opts);
+    while ((opt = getopt_long(argc, argv, "n:s:W:w:S:D:pr:Fh", long_opts, NULL))
+           != -1) {
+        switch (opt) {
+        case 'n': ops = atoi(optarg); break;
+        case 's': mib = atoi(optarg); break;
+        case 'W': win_kib = atoi(optarg); break;
+        case 'w': opts.workers = atoi(optarg); break;
+        case 'S':
+            if ((type = storage_type_parse(optarg)) < 0) {
+                fprintf(stderr, "unknown storage type `%s`\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.storage = type;
+            break;
+        case 'D':
+            if (strcmp(optarg, "sync") == 0) {
+                opts.durability = PCIE_DEV_DURABILITY_SYNC;
+            } else if (strcmp(optarg, "periodic") == 0) {
+                opts.durability = PCIE_DEV_DURABILITY_PERIODIC;
+            } else if (strcmp(optarg, "ondemand") == 0) {
+                opts.durability = PCIE_DEV_DURABILITY_ONDEMAND;
+            } else {
+                fprintf(stderr, "unknown durability policy `%s`\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p': opts.doorbell = PCIE_DEV_DOORBELL_POLL; break;
+        case 'r': replay_path = optarg; break;
+        case 'F': fast = 1; break;
+        default: print_usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || ops <= 0 || mib <= 0 || opts.workers <= 0
+        || win_kib < DEFAULT_WINDOW_KIB
+        || (uint64_t)win_kib * KiB > WIN_SIZE_MAX
+        || (win_kib & (win_kib - 1))) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    storage_size = (uint64_t)mib << 20;
+    if (replay_path) {
+        recs = capture_load(replay_path, &recs_num);
+        if (!recs) {
+            fprintf(
+                stderr,
+                "unable to load capture `%s`: %s\n",
+                replay_path,
+                strerror(errno)
+            );
+            return EXIT_FAILURE;
+        }
+        if (recs_num == 0 || !replay_check(recs, recs_num, &storage_size)) {
+            if (recs_num == 0) fprintf(stderr, "empty capture\n");
+            free(recs);
+            return EXIT_FAILURE;
+        }
+        ops = recs_num;
+    }
+
+    if (!bench_init(
+            &b, argv[optind], storage_size, (uint64_t)win_kib * KiB, &opts
+        )) {
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    b.lat = malloc((size_t)ops * sizeof(*b.lat));
+    if (!b.lat) {
+        fprintf(stderr, "Out of memory!\n");
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    if (recs) {
+        printf(
+            "%8s %10s %10s %10s %10s %9s %9s %9s %6s\n",
+            "cmds",
+            "time_s",
+            "lag_us",
+            "IOPS",
+            "MiB/s",
+            "p50_us",
+            "p99_us",
+            "p999_us",
+            "errors"
+        );
+        if (!replay(&b, recs, recs_num, fast) || b.errors) ret = EXIT_FAILURE;
+    } else {
+        ret = sweep(&b, ops);
+    }
+
+out:
+    bench_cleanup(&b);
+    free(b.lat);
+    free(recs);
+    return ret;
+}
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,18 +15,289 @@
 volatile sig_atomic_t done = 0;
 
 static inline void print_usage(const char *argv0) {
-    printf("USAGE: %s <bar2_file> <storage_file>\n", argv0);
+    printf(
+        "USAGE: %s [options] <bar0_file> <bar2_file> <storage_file>\n"
+        "OPTIONS:\n"
+        "  -d, --doorbell=event|poll  ожидание doorbell: сообщения от QEMU\n"
+        "                             (по умолчанию) или опрос sq_tail\n"
+        "  -D, --durability=sync|periodic|ondemand\n"
+        "                             сброс записей на носитель: после каждой\n"
+        "                             (по умолчанию), фоновый или только по\n"
+        "                             FLUSH/FUA\n"
+        "      --flush-interval=MSEC  период фонового сброса\n"
+        "  -S, --storage=mmap|pio|uring\n"
+        "                             доступ к хранилищу: отображение в\n"
+        "                             память (по умолчанию), pread/pwrite или\n"
+        "                             io_uring с O_DIRECT\n"
+        "  -M, --map=HINT[,HINT...]   работа с файлом хранилища: populate\n"
+        "                             (заранее отобразить), hugepage,\n"
+        "                             sequential или random\n"
+        "  -x, --direct               файл хранилища отображён гостю в bar4\n"
+        "                             (FLUSH сохраняет файл целиком,\n"
+        "                             несовместимо с uring)\n"
+        "  -s, --spin=USEC            активное ожидание после пачки команд\n"
+        "      --sleep-min=USEC       начальный интервал сна в режиме опроса\n"
+        "      --sleep-max=USEC       предельный интервал сна в режиме опроса\n"
+        "  -w, --workers=N            количество исполнителей команд\n"
+        "                             (по умолчанию - число ядер)\n"
+        "  -c, --cpus=RD[,WR[,SOCK]]  привязка потоков выборки и потока\n"
+        "                             сокета к ядрам (-1 - нет)\n"
+        "      --worker-cpu=FIRST     привязка исполнителей к ядрам начиная\n"
+        "                             с FIRST\n"
+        "  -f, --fifo=PRIO            SCHED_FIFO для потоков выборки и\n"
+        "                             исполнителей\n"
+        "  -m, --mlock                заблокировать память процесса в ОЗУ\n"
+        "      --metrics=PATH         выгружать метрики в файл в текстовом\n"
+        "                             формате Prometheus\n"
+        "      --metrics-interval=MSEC\n"
+        "                             период выгрузки метрик\n"
+        "      --trace=PATH           двоичная трасса команд (например,\n"
+        "                             /dev/shm/r04.trace, читается trace_dump)\n"
+        "      --trace-size=N         записей в кольце трассы исполнителя\n"
+        "      --capture=PATH         записать выбранные дескрипторы для\n"
+        "                             воспроизведения (dev_bench --replay)\n",
+        argv0
+    );
 }
 
-void term(int signum) { done = 1; }
+enum {
+    OPT_SLEEP_MIN = 0x100,
+    OPT_SLEEP_MAX,
+    OPT_WORKER_CPU,
+    OPT_FLUSH_INTERVAL,
+    OPT_METRICS,
+    OPT_METRICS_INTERVAL,
+    OPT_TRACE,
+    OPT_TRACE_SIZE,
+    OPT_CAPTURE,
+};
 
-int main(int argc, const char **argv) {
-    if (argc != 4) {
+static const struct option long_opts[] = {
+    {"doorbell",         required_argument, NULL, 'd'                 },
+    {"durability",       required_argument, NULL, 'D'                 },
+    {"flush-interval",   required_argument, NULL, OPT_FLUSH_INTERVAL  },
+    {"storage",          required_argument, NULL, 'S'                 },
+    {"map",              required_argument, NULL, 'M'                 },
+    {"direct",           no_argument,       NULL, 'x'                 },
+    {"spin",             required_argument, NULL, 's'                 },
+    {"sleep-min",        required_argument, NULL, OPT_SLEEP_MIN       },
+    {"sleep-max",        required_argument, NULL, OPT_SLEEP_MAX       },
+    {"workers",          required_argument, NULL, 'w'                 },
+    {"cpus",             required_argument, NULL, 'c'                 },
+    {"worker-cpu",       required_argument, NULL, OPT_WORKER_CPU      },
+    {"fifo",             required_argument, NULL, 'f'                 },
+    {"mlock",            no_argument,       NULL, 'm'                 },
+    {"metrics",          required_argument, NULL, OPT_METRICS         },
+    {"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+    {"trace",            required_argument, NULL, OPT_TRACE           },
+    {"trace-size",       required_argument, NULL, OPT_TRACE_SIZE      },
+    {"capture",          required_argument, NULL, OPT_CAPTURE         },
+    {"help",             no_argument,       NULL, 'h'                 },
+    {NULL,               0,                 NULL, 0                   },
+};
+
+static int parse_uint(const char *str, uint32_t *res) {
+    char *end;
+    unsigned long val;
+
+    errno = 0;
+    val = strtoul(str, &end, 10);
+    if (errno != 0 || end == str || *end != 0 || val > UINT32_MAX) {
+        fprintf(stderr, "invalid number `%s`\n", str);
+        return 0;
+    }
+    *res = val;
+    return 1;
+}
+
+static int parse_cpus(const char *str, int *cpus) {
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    char *end;
+
+    for (int i = 0; i < PCIE_DEV_THREADS_NUM && *str; ++i) {
+        cpus[i] = strtol(str, &end, 10);
+        if (end == str || (*end != ',' && *end != 0) || cpus[i] < -1
+            || cpus[i] >= ncpu) {
+            fprintf(stderr, "invalid cpu list `%s`\n", str);
+            return 0;
+        }
+        str = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+static int parse_map_hints(const char *str, unsigned *flags) {
+    static const struct {
+        const char *name;
+        unsigned flag;
+    } hints[] = {
+        {"populate",   STORAGE_POPULATE  },
+        {"hugepage",   STORAGE_HUGEPAGE  },
+        {"sequential", STORAGE_SEQUENTIAL},
+        {"random",     STORAGE_RANDOM    },
+    };
+    size_t len, i;
+
+    *flags = 0;
+    while (*str) {
+        len = strcspn(str, ",");
+        for (i = 0; i < sizeof(hints) / sizeof(*hints); ++i) {
+            if (strlen(hints[i].name) == len
+                && strncmp(str, hints[i].name, len) == 0)
+                break;
+        }
+        if (i == sizeof(hints) / sizeof(*hints)) {
+            fprintf(stderr, "unknown map hint `%.*s`\n", (int)len, str);
+            return 0;
+        }
+        *flags |= hints[i].flag;
+        str += len;
+        if (*str == ',') ++str;
+    }
+
+    if ((*flags & STORAGE_SEQUENTIAL) && (*flags & STORAGE_RANDOM)) {
+        fprintf(stderr, "`sequential` and `random` are mutually exclusive\n");
+        return 0;
+    }
+    return 1;
+}
+
+// возвращает индекс первого позиционного аргумента или -1 при ошибке
+static int parse_opts(
+    int argc, char **argv, struct pcie_dev_opts *opts, int *lock_memory
+) {
+    uint32_t val;
+    int opt;
+
+    pcie_dev_opts_default(opts);
+    *lock_memory = 0;
+
+    while (
+        (opt = getopt_long(argc, argv, "d:D:S:M:xs:w:c:f:mh", long_opts, NULL))
+        != -1
+    ) {
+        switch (opt) {
+        case 'd':
+            if (strcmp(optarg, "event") == 0) {
+                opts->doorbell = PCIE_DEV_DOORBELL_EVENT;
+            } else if (strcmp(optarg, "poll") == 0) {
+                opts->doorbell = PCIE_DEV_DOORBELL_POLL;
+            } else {
+                fprintf(stderr, "unknown doorbell mode `%s`\n", optarg);
+                return -1;
+            }
+            break;
+        case 'D':
+            if (strcmp(optarg, "sync") == 0) {
+                opts->durability = PCIE_DEV_DURABILITY_SYNC;
+            } else if (strcmp(optarg, "periodic") == 0) {
+                opts->durability = PCIE_DEV_DURABILITY_PERIODIC;
+            } else if (strcmp(optarg, "ondemand") == 0) {
+                opts->durability = PCIE_DEV_DURABILITY_ONDEMAND;
+            } else {
+                fprintf(stderr, "unknown durability policy `%s`\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_FLUSH_INTERVAL:
+            if (!parse_uint(optarg, &val) || val == 0 || val > INT32_MAX) {
+                fprintf(stderr, "invalid flush interval `%s`\n", optarg);
+                return -1;
+            }
+            opts->flush_interval_ms = val;
+            break;
+        case 'S': {
+            int type = storage_type_parse(optarg);
+            if (type < 0) {
+                fprintf(stderr, "unknown storage type `%s`\n", optarg);
+                return -1;
+            }
+            opts->storage = type;
+            break;
+        }
+        case 'M':
+            if (!parse_map_hints(optarg, &opts->storage_flags)) return -1;
+            break;
+        case 'x': opts->direct = 1; break;
+        case 's':
+            if (!parse_uint(optarg, &val) || val > UINT32_MAX / 1000)
+                return -1;
+            opts->poller.spin_ns = val * 1000;
+            break;
+        case OPT_SLEEP_MIN:
+            if (!parse_uint(optarg, &opts->poller.sleep_min_us)) return -1;
+            break;
+        case OPT_SLEEP_MAX:
+            if (!parse_uint(optarg, &opts->poller.sleep_max_us)) return -1;
+            break;
+        case 'w':
+            if (!parse_uint(optarg, &val) || val == 0 || val > 1024) {
+                fprintf(stderr, "invalid workers number `%s`\n", optarg);
+                return -1;
+            }
+            opts->workers = val;
+            break;
+        case 'c':
+            if (!parse_cpus(optarg, opts->cpus)) return -1;
+            break;
+        case OPT_WORKER_CPU:
+            if (!parse_uint(optarg, &val)
+                || val >= sysconf(_SC_NPROCESSORS_CONF)) {
+                fprintf(stderr, "invalid cpu `%s`\n", optarg);
+                return -1;
+            }
+            opts->worker_cpu = val;
+            break;
+        case 'f':
+            if (!parse_uint(optarg, &val)) return -1;
+            opts->fifo_prio = val;
+            break;
+        case 'm': *lock_memory = 1; break;
+        case OPT_METRICS: opts->metrics_path = optarg; break;
+        case OPT_METRICS_INTERVAL:
+            if (!parse_uint(optarg, &val) || val == 0 || val > INT32_MAX) {
+                fprintf(stderr, "invalid metrics interval `%s`\n", optarg);
+                return -1;
+            }
+            opts->metrics_interval_ms = val;
+            break;
+        case OPT_TRACE: opts->trace_path = optarg; break;
+        case OPT_TRACE_SIZE:
+            if (!parse_uint(optarg, &val) || val == 0 || val > (1u << 24)) {
+                fprintf(stderr, "invalid trace size `%s`\n", optarg);
+                return -1;
+            }
+            opts->trace_size = val;
+            break;
+        case OPT_CAPTURE: opts->capture_path = optarg; break;
+        default: return -1;
+        }
+    }
+
+    // O_DIRECT не видит данных, записанных гостем через page cache
+    if (opts->direct && opts->storage == STORAGE_URING) {
+        fprintf(stderr, "`--direct` is incompatible with uring storage\n");
+        return -1;
+    }
+
+    return optind;
+}
+
+void term(int signum) {
+    (void)signum;
+    done = 1;
+}
+
+int main(int argc, char **argv) {
+    struct pcie_dev_opts opts;
+    int lock_memory;
+    int argi = parse_opts(argc, argv, &opts, &lock_memory);
+
+    if (argi < 0 || argc - argi != 3) {
         print_usage(argv[0]);
         return EXIT_SUCCESS;
     }
 
-    enum pcie_dev_status stt;
     struct pcie_dev dev;
     struct sigaction action;
 
@@ -35,11 +307,17 @@ int main(int argc, const char **argv) {
     sigaction(SIGKILL, &action, NULL);
     sigaction(SIGINT, &action, NULL);
 
+    // исключаем page fault на mmap регистров и хранилища в потоках очередей
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        fprintf(stderr, "mlockall error: `%s`\n", strerror(errno));
+
     // libevent
     // read and write параллельно
     // https://www.man7.org/linux/man-pages/man7/inotify.7.html
 
-    switch (pcie_dev_init(&dev, argv[1], argv[2], argv[3])) {
+    switch (pcie_dev_init(
+        &dev, argv[argi], argv[argi + 1], argv[argi + 2], &opts
+    )) {
     case PCIE_DEV_FILE_ERROR:
         fprintf(stderr, "file error: `%s`\n", strerror(errno));
         break;
@@ -56,6 +334,9 @@ int main(int argc, const char **argv) {
     case PCIE_DEV_SOCKET_ERROR:
         fprintf(stderr, "socket error!: `%s`\n", strerror(errno));
         break;
+    case PCIE_DEV_SIZE_ERROR:
+        fprintf(stderr, "bar file is smaller than register layout!\n");
+        break;
     case PCIE_DEV_OK: goto loop;
     }
 
@@ -63,7 +344,7 @@ int main(int argc, const char **argv) {
     return EXIT_FAILURE;
 
 loop:
-    while (!done);
+    while (!done) pause();
     pcie_dev_cleanup(&dev);
     return EXIT_SUCCESS;
 }
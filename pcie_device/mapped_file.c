@@ -1,17 +1,53 @@
 #include "mapped_file.h"
 
 #include <fcntl.h>
+#include <linux/magic.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <unistd.h>
 
-#define MSYNC_MIN 64
+#define DIRTY_WORD_BITS 64
 
-enum mf_status mf_init(struct mapped_file *ctx, const char *filename) {
+static inline size_t page_size(void) { return sysconf(_SC_PAGESIZE); }
+
+// отображение, начало которого выровнено по align: резервируется область с
+// запасом, файл отображается поверх выровненной части, остаток освобождается
+static void *
+mf_map_aligned(size_t size, int prot, int flags, int fd, size_t align) {
+    size_t pg = page_size();
+    size_t len = (size + pg - 1) & ~(pg - 1);
+    uint8_t *res, *base;
+
+    res = mmap(
+        NULL,
+        len + align,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (res == MAP_FAILED) return MAP_FAILED;
+
+    base = (uint8_t *)(((uintptr_t)res + align - 1) & ~(uintptr_t)(align - 1));
+    if (mmap(base, len, prot, flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(res, len + align);
+        return MAP_FAILED;
+    }
+
+    if (base > res) munmap(res, base - res);
+    if (res + align > base) munmap(base + len, res + align - base);
+    return base;
+}
+
+enum mf_status
+mf_init(struct mapped_file *ctx, const char *filename, unsigned flags) {
     struct stat st;
-    int fd;
+    struct statfs sfs;
+    int fd, map_flags = MAP_SHARED;
     void *mapped_base;
 
     fd = open(filename, O_RDWR);
@@ -21,28 +57,131 @@ enum mf_status mf_init(struct mapped_file *ctx, const char *filename) {
         return MF_FILE_ERROR;
     }
 
-    mapped_base =
-        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ctx->hugetlb = fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC;
+    if (flags & MF_POPULATE) map_flags |= MAP_POPULATE;
+
+    // hugetlbfs сам выравнивает отображение по своему размеру страницы
+    if ((flags & MF_HUGEPAGE) && !ctx->hugetlb)
+        mapped_base = mf_map_aligned(
+            st.st_size,
+            PROT_READ | PROT_WRITE,
+            map_flags,
+            fd,
+            MF_HUGEPAGE_SIZE
+        );
+    else
+        mapped_base = mmap(
+            NULL, st.st_size, PROT_READ | PROT_WRITE, map_flags, fd, 0
+        );
 
     if (mapped_base == MAP_FAILED) {
         close(fd);
         return MF_MMAP_ERROR;
     }
+
+    // подсказки необязательны: ошибка (например, THP выключены) не мешает
+    // работе с отображением
+    if ((flags & MF_HUGEPAGE) && !ctx->hugetlb)
+        madvise(mapped_base, st.st_size, MADV_HUGEPAGE);
+    if (flags & MF_SEQUENTIAL)
+        madvise(mapped_base, st.st_size, MADV_SEQUENTIAL);
+    else if (flags & MF_RANDOM) madvise(mapped_base, st.st_size, MADV_RANDOM);
+
     ctx->fd = fd;
     ctx->base = mapped_base;
     ctx->file_size = st.st_size;
+    ctx->dirty = NULL;
+    ctx->dirty_words = 0;
     return MF_OK;
 }
 
 void mf_cleanup(struct mapped_file *ctx) {
+    free(ctx->dirty);
     if (ctx->base) munmap(ctx->base, ctx->file_size);
     if (ctx->fd && ctx->fd != -1) close(ctx->fd);
     memset(ctx, 0, sizeof(*ctx));
 }
 
 enum mf_status
-mf_sync(struct mapped_file *ctx, uint32_t addr, uint32_t size, int sync_flag) {
-    if (size < MSYNC_MIN) size = MSYNC_MIN;
-    if (msync(ctx->base + addr, size, sync_flag) == -1) return MF_MSYNC_ERROR;
+mf_sync(struct mapped_file *ctx, uint64_t addr, uint64_t size, int sync_flag) {
+    uint64_t pg = page_size();
+    uint64_t start = addr & ~(pg - 1);
+    uint64_t end = addr + size;
+
+    // msync требует выровненный по странице адрес
+    if (end > ctx->file_size) end = ctx->file_size;
+    if (start >= end) return MF_OK;
+    if (msync(ctx->base + start, end - start, sync_flag) == -1)
+        return MF_MSYNC_ERROR;
     return MF_OK;
 }
+
+enum mf_status mf_track_dirty(struct mapped_file *ctx) {
+    size_t pg = page_size();
+    size_t pages = (ctx->file_size + pg - 1) / pg;
+
+    ctx->dirty_words = (pages + DIRTY_WORD_BITS - 1) / DIRTY_WORD_BITS;
+    ctx->dirty = calloc(ctx->dirty_words, sizeof(*ctx->dirty));
+    if (!ctx->dirty) return MF_MEM_ERROR;
+    return MF_OK;
+}
+
+void mf_mark_dirty(struct mapped_file *ctx, uint64_t addr, uint64_t size) {
+    size_t pg = page_size();
+
+    if (!ctx->dirty || size == 0) return;
+
+    for (size_t p = addr / pg; p <= (addr + size - 1) / pg; ++p) {
+        __atomic_fetch_or(
+            &ctx->dirty[p / DIRTY_WORD_BITS],
+            1ull << (p % DIRTY_WORD_BITS),
+            __ATOMIC_RELAXED
+        );
+    }
+}
+
+// сброс подряд идущих страниц, при ошибке они снова отмечаются изменёнными,
+// чтобы следующий сброс повторил попытку
+static int mf_flush_run(struct mapped_file *ctx, size_t start, size_t len) {
+    size_t pg = page_size();
+
+    if (mf_sync(ctx, start * pg, len * pg, MS_SYNC) == MF_OK) return 1;
+    mf_mark_dirty(ctx, start * pg, len * pg);
+    return 0;
+}
+
+enum mf_status mf_flush_dirty(struct mapped_file *ctx, size_t *pages) {
+    enum mf_status stt = MF_OK;
+    size_t run_start = 0, run_len = 0, flushed = 0;
+
+    if (!ctx->dirty) goto end;
+
+    for (size_t w = 0; w < ctx->dirty_words; ++w) {
+        // страницы, изменённые после обнуления слова, попадут в следующий сброс
+        uint64_t bits = __atomic_exchange_n(&ctx->dirty[w], 0, __ATOMIC_ACQ_REL);
+
+        for (size_t b = 0; b < DIRTY_WORD_BITS; ++b) {
+            size_t p = w * DIRTY_WORD_BITS + b;
+
+            if (bits & (1ull << b)) {
+                if (run_len == 0) run_start = p;
+                run_len++;
+                continue;
+            }
+            if (run_len == 0) continue;
+
+            if (!mf_flush_run(ctx, run_start, run_len)) stt = MF_MSYNC_ERROR;
+            flushed += run_len;
+            run_len = 0;
+        }
+    }
+
+    if (run_len != 0) {
+        if (!mf_flush_run(ctx, run_start, run_len)) stt = MF_MSYNC_ERROR;
+        flushed += run_len;
+    }
+
+end:
+    if (pages) *pages = flushed;
+    return stt;
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,11 +14,49 @@ struct mapped_file {
     uint8_t *base;
     size_t file_size;
     int fd;
+
+    // битовая карта изменённых, но не сброшенных страниц (по 1 биту на
+    // страницу), NULL - отслеживание выключено
+    uint64_t *dirty;
+    size_t dirty_words;
+
+    // файл расположен на hugetlbfs
+    int hugetlb;
 };
 
-enum mf_status mf_init(struct mapped_file *ctx, const char *filename);
+// флаги отображения (mf_init)
+// - MF_POPULATE   - заранее отобразить все страницы (MAP_POPULATE), чтобы
+//                   первое обращение не приводило к page fault
+// - MF_HUGEPAGE   - выровнять отображение по 2 МиБ и запросить прозрачные
+//                   huge pages (MADV_HUGEPAGE, действует для tmpfs/shmem).
+//                   Файлы на hugetlbfs отображаются huge pages независимо от
+//                   флага
+// - MF_SEQUENTIAL - подсказка ядру о последовательном доступе
+// - MF_RANDOM     - подсказка ядру о случайном доступе
+#define MF_POPULATE   (1 << 0)
+#define MF_HUGEPAGE   (1 << 1)
+#define MF_SEQUENTIAL (1 << 2)
+#define MF_RANDOM     (1 << 3)
+
+// размер huge page для выравнивания отображения
+#define MF_HUGEPAGE_SIZE (2ul * 1024 * 1024)
+
+enum mf_status
+mf_init(struct mapped_file *ctx, const char *filename, unsigned flags);
 
+// синхронизация диапазона, границы выравниваются по страницам
 enum mf_status
-mf_sync(struct mapped_file *ctx, uint32_t addr, uint32_t size, int sync_flag);
+mf_sync(struct mapped_file *ctx, uint64_t addr, uint64_t size, int sync_flag);
+
+// включение отслеживания изменённых страниц
+enum mf_status mf_track_dirty(struct mapped_file *ctx);
+
+void mf_mark_dirty(struct mapped_file *ctx, uint64_t addr, uint64_t size);
+
+// сброс всех изменённых страниц, соседние страницы объединяются в один msync.
+// pages (если не NULL) - количество сброшенных страниц. Страницы, которые не
+// удалось сбросить, остаются отмеченными. Одновременные вызовы вызывающий
+// должен упорядочивать сам (storage_flush)
+enum mf_status mf_flush_dirty(struct mapped_file *ctx, size_t *pages);
 
 void mf_cleanup(struct mapped_file *ctx);
@@ -0,0 +1,218 @@
+#include "metrics.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *const stage_names[METRICS_STAGES_NUM] = {
+    [METRICS_DOORBELL] = "doorbell",
+    [METRICS_QUEUE] = "queue",
+    [METRICS_LOCK] = "lock",
+    [METRICS_COPY] = "copy",
+    [METRICS_SYNC] = "sync",
+    [METRICS_IRQ] = "irq",
+    [METRICS_TOTAL] = "total",
+};
+
+static const char *const queue_names[PCIE_QUEUES_NUM] = {
+    [PCIE_RD_QUEUE] = "read",
+    [PCIE_WR_QUEUE] = "write",
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static inline unsigned bucket_index(uint64_t v) {
+    unsigned msb, shift;
+
+    if (v < METRICS_SUB_BUCKETS) return v;
+
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - METRICS_SUB_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS
+         + ((v >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+// наибольшее значение, попадающее в корзину
+static inline uint64_t bucket_upper(unsigned i) {
+    unsigned shift;
+
+    if (i < METRICS_SUB_BUCKETS) return i;
+
+    shift = i / METRICS_SUB_BUCKETS - 1;
+    return (((uint64_t)(METRICS_SUB_BUCKETS + i % METRICS_SUB_BUCKETS) + 1)
+            << shift)
+         - 1;
+}
+
+void metrics_record(struct metrics_hist *h, uint64_t ns) {
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    while (ns > max
+           && !__atomic_compare_exchange_n(
+               &h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+           ))
+        ;
+}
+
+uint64_t metrics_quantile(const struct metrics_hist *h, double q) {
+    uint64_t total = 0, seen = 0, rank;
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < METRICS_BUCKETS; ++i)
+        total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+
+    rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+
+    for (unsigned i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        // граница корзины не превышает наблюдавшийся максимум
+        if (seen > rank) return bucket_upper(i) < max ? bucket_upper(i) : max;
+    }
+    return max;
+}
+
+static inline uint64_t load(const uint64_t *v) {
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+static void write_counter(
+    FILE *f,
+    const struct metrics *m,
+    const char *name,
+    const char *help,
+    size_t ofst
+) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        const uint64_t *v =
+            (const uint64_t *)((const char *)&m->queues[qid] + ofst);
+        fprintf(
+            f, "%s{queue=\"%s\"} %lu\n", name, queue_names[qid], load(v)
+        );
+    }
+}
+
+static void write_prom(FILE *f, const struct metrics *m) {
+    write_counter(
+        f,
+        m,
+        "pcie_dev_commands_total",
+        "Completed commands.",
+        offsetof(struct metrics_queue, cmds)
+    );
+    write_counter(
+        f,
+        m,
+        "pcie_dev_bytes_total",
+        "Bytes transferred by successful commands.",
+        offsetof(struct metrics_queue, bytes)
+    );
+    write_counter(
+        f,
+        m,
+        "pcie_dev_errors_total",
+        "Commands completed with an error status.",
+        offsetof(struct metrics_queue, errors)
+    );
+    write_counter(
+        f,
+        m,
+        "pcie_dev_interrupts_total",
+        "Interrupts sent to the guest.",
+        offsetof(struct metrics_queue, irqs)
+    );
+
+    fprintf(
+        f,
+        "# HELP pcie_dev_flushes_total Storage flushes.\n"
+        "# TYPE pcie_dev_flushes_total counter\n"
+        "pcie_dev_flushes_total %lu\n"
+        "# HELP pcie_dev_flushed_pages_total Pages written back by flushes.\n"
+        "# TYPE pcie_dev_flushed_pages_total counter\n"
+        "pcie_dev_flushed_pages_total %lu\n",
+        load(&m->flushes),
+        load(&m->flushed_pages)
+    );
+
+    fprintf(
+        f,
+        "# HELP pcie_dev_stage_seconds Duration of a command processing "
+        "stage.\n"
+        "# TYPE pcie_dev_stage_seconds summary\n"
+    );
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        for (int s = 0; s < METRICS_STAGES_NUM; ++s) {
+            const struct metrics_hist *h = &m->queues[qid].stages[s];
+            const char *qn = queue_names[qid], *sn = stage_names[s];
+
+            for (size_t i = 0; i < sizeof(quantiles) / sizeof(*quantiles);
+                 ++i)
+                fprintf(
+                    f,
+                    "pcie_dev_stage_seconds{queue=\"%s\",stage=\"%s\","
+                    "quantile=\"%g\"} %.9f\n",
+                    qn,
+                    sn,
+                    quantiles[i],
+                    metrics_quantile(h, quantiles[i]) / 1e9
+                );
+            fprintf(
+                f,
+                "pcie_dev_stage_seconds_sum{queue=\"%s\",stage=\"%s\"} "
+                "%.9f\n"
+                "pcie_dev_stage_seconds_count{queue=\"%s\",stage=\"%s\"} "
+                "%lu\n",
+                qn,
+                sn,
+                load(&h->sum_ns) / 1e9,
+                qn,
+                sn,
+                load(&h->count)
+            );
+        }
+    }
+
+    fprintf(
+        f,
+        "# HELP pcie_dev_stage_max_seconds Longest observed stage "
+        "duration.\n"
+        "# TYPE pcie_dev_stage_max_seconds gauge\n"
+    );
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        for (int s = 0; s < METRICS_STAGES_NUM; ++s)
+            fprintf(
+                f,
+                "pcie_dev_stage_max_seconds{queue=\"%s\",stage=\"%s\"} "
+                "%.9f\n",
+                queue_names[qid],
+                stage_names[s],
+                load(&m->queues[qid].stages[s].max_ns) / 1e9
+            );
+    }
+}
+
+int metrics_dump(const struct metrics *m, const char *path) {
+    char tmp[4096];
+    FILE *f;
+    int ok;
+
+    // читатель (textfile collector, cat) видит файл только целиком
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return 0;
+
+    f = fopen(tmp, "w");
+    if (!f) return 0;
+
+    write_prom(f, m);
+    ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+    return ok;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+
+#include "bars.h"
+
+// Метрики эмулятора: счётчики и гистограммы длительности стадий обработки
+// команды по каждой очереди. Обновляются исполнителями без блокировок
+// (атомарные сложения), читаются потоком выгрузки в формате Prometheus.
+
+enum metrics_stage {
+    // от записи doorbell (сообщение QEMU) до обнаружения команд выборкой
+    METRICS_DOORBELL = 0,
+    // от выборки команды до начала её исполнения
+    METRICS_QUEUE,
+    // ожидание блокировки диапазона хранилища
+    METRICS_LOCK,
+    // копирование между окном и хранилищем (DISCARD - освобождение)
+    METRICS_COPY,
+    // сохранение на носитель: sync записи, FLUSH
+    METRICS_SYNC,
+    // отправка сообщения о прерывании в сокет QEMU
+    METRICS_IRQ,
+    // от выборки команды до публикации элемента завершения
+    METRICS_TOTAL,
+    METRICS_STAGES_NUM,
+};
+
+// Log-linear гистограмма (по образцу HDR Histogram): значения до
+// METRICS_SUB_BUCKETS хранятся точно, каждая следующая октава [2^k, 2^(k+1))
+// делится на METRICS_SUB_BUCKETS равных корзин, относительная погрешность не
+// превышает 1 / METRICS_SUB_BUCKETS.
+#define METRICS_SUB_BITS    3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS     (64 * METRICS_SUB_BUCKETS)
+
+struct metrics_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics_queue {
+    uint64_t cmds;
+    uint64_t bytes;
+    // команды, завершённые с ошибкой в статусе
+    uint64_t errors;
+    uint64_t irqs;
+    struct metrics_hist stages[METRICS_STAGES_NUM];
+};
+
+struct metrics {
+    struct metrics_queue queues[PCIE_QUEUES_NUM];
+    // сбросы изменений хранилища на носитель
+    uint64_t flushes;
+    uint64_t flushed_pages;
+};
+
+void metrics_record(struct metrics_hist *h, uint64_t ns);
+
+static inline void metrics_add(uint64_t *counter, uint64_t val) {
+    __atomic_fetch_add(counter, val, __ATOMIC_RELAXED);
+}
+
+// значение квантиля q (0..1) в нс, с точностью до корзины
+uint64_t metrics_quantile(const struct metrics_hist *h, double q);
+
+// атомарная перезапись файла метриками в текстовом формате Prometheus:
+// 1 - успех, 0 - ошибка (errno)
+int metrics_dump(const struct metrics *m, const char *path);
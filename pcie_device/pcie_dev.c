@@ -1,16 +1,25 @@
+#define _GNU_SOURCE
 #include "pcie_dev.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "address_lock.h"
 #include "bars.h"
+#include "poller.h"
+#include "range_lock.h"
 #include "socket.h"
+#include "storage.h"
 
 #define TRY_PCIE_DEV(action, on_error)                 \
     {                                                  \
@@ -20,8 +29,13 @@
 
 #define TRY_MF(action, on_error) TRY_PCIE_DEV(mf_status_conv(action), on_error)
 
-static inline int send_interrupt(struct pcie_dev *ctx) {
-    return socket_send(&ctx->irq_socket, "I\n");
+// прерывание очереди qid - вектор с тем же номером
+static inline int
+send_interrupt(struct pcie_dev *ctx, enum pcie_queue_id qid) {
+    char msg[16];
+
+    snprintf(msg, sizeof(msg), "I%d\n", qid);
+    return socket_send(&ctx->irq_socket, msg);
 }
 
 static inline enum pcie_dev_status mf_status_conv(enum mf_status stt) {
@@ -37,186 +51,955 @@ static inline enum pcie_dev_status mf_status_conv(enum mf_status stt) {
 
 static inline enum pcie_dev_status
 pcie_dev_open_csr(struct pcie_dev *ctx, const char *filename) {
-    TRY_MF(mf_init(&ctx->bar2_f, filename), return error_status);
-    ctx->csr = (volatile struct pcie_bar0 *)ctx->bar2_f.base;
+    TRY_MF(
+        mf_init(&ctx->bar0_f, filename, MF_POPULATE), return error_status
+    );
+    if (ctx->bar0_f.file_size < sizeof(struct pcie_bar0))
+        return PCIE_DEV_SIZE_ERROR;
+    ctx->csr = (volatile struct pcie_bar0 *)ctx->bar0_f.base;
     return PCIE_DEV_OK;
 }
 
 static inline enum pcie_dev_status
 pcie_dev_open_data(struct pcie_dev *ctx, const char *filename) {
-    TRY_MF(mf_init(&ctx->bar2_f, filename), return error_status);
-    ctx->data = (volatile struct pcie_bar2 *)ctx->bar2_f.base;
+    TRY_MF(
+        mf_init(&ctx->bar2_f, filename, MF_POPULATE), return error_status
+    );
+    if (ctx->bar2_f.file_size < sizeof(struct pcie_bar2))
+        return PCIE_DEV_SIZE_ERROR;
+
+    // окна - наибольшая степень двойки, дважды умещающаяся в bar2
+    ctx->win_size = WIN_SIZE;
+    while (ctx->win_size < WIN_SIZE_MAX
+           && 4 * (uint64_t)ctx->win_size <= ctx->bar2_f.file_size)
+        ctx->win_size *= 2;
+    ctx->rd_win = (volatile uint8_t *)ctx->bar2_f.base;
+    ctx->wr_win = ctx->rd_win + ctx->win_size;
+    return PCIE_DEV_OK;
+}
+
+static inline enum pcie_dev_status storage_status_conv(enum storage_status stt
+) {
+    switch (stt) {
+    case STORAGE_OK: break;
+    case STORAGE_FILE_ERROR: return PCIE_DEV_FILE_ERROR;
+    case STORAGE_MMAP_ERROR: return PCIE_DEV_MMAP_ERROR;
+    case STORAGE_MEM_ERROR: return PCIE_DEV_MEM_ERROR;
+    case STORAGE_IO_ERROR: return PCIE_DEV_MSYNC_ERROR;
+    }
     return PCIE_DEV_OK;
 }
 
 static inline enum pcie_dev_status
 pcie_dev_open_storage(struct pcie_dev *ctx, const char *filename) {
-    TRY_MF(mf_init(&ctx->storage_f, filename), return error_status);
+    unsigned flags = ctx->opts.storage_flags;
+
+    if (ctx->opts.durability != PCIE_DEV_DURABILITY_SYNC)
+        flags |= STORAGE_TRACK_DIRTY;
+
+    TRY_PCIE_DEV(storage_status_conv(storage_open(
+                     &ctx->storage, ctx->opts.storage, filename, flags
+                 )),
+                 return error_status);
     return PCIE_DEV_OK;
 }
 
+static inline void pcie_dev_init_queues(struct pcie_dev *ctx) {
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        struct pcie_dev_queue *q = &ctx->queues[qid];
+        q->regs = &ctx->csr->queues[qid];
+        q->sq_head = 0;
+        q->cq_tail = 0;
+        q->phase = 1;
+        q->regs->cq_tail = PCIE_CQ_TAIL_PHASE_MASK;
+    }
+}
+
+static inline enum pcie_dev_status pcie_dev_open_events(struct pcie_dev *ctx) {
+    struct epoll_event ev = {.events = EPOLLIN};
+
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        ctx->queues[qid].efd = eventfd(0, EFD_CLOEXEC);
+        if (ctx->queues[qid].efd == -1) return PCIE_DEV_FILE_ERROR;
+    }
+
+    ctx->stop_efd = eventfd(0, EFD_CLOEXEC);
+    if (ctx->stop_efd == -1) return PCIE_DEV_FILE_ERROR;
+
+    ctx->irq_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->irq_efd == -1) return PCIE_DEV_FILE_ERROR;
+
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epoll_fd == -1) return PCIE_DEV_FILE_ERROR;
+
+    ev.data.fd = ctx->stop_efd;
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->stop_efd, &ev) == -1)
+        return PCIE_DEV_FILE_ERROR;
+
+    ev.data.fd = ctx->irq_socket.fd;
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->irq_socket.fd, &ev) == -1)
+        return PCIE_DEV_SOCKET_ERROR;
+
+    return PCIE_DEV_OK;
+}
+
+static inline void pcie_dev_close_events(struct pcie_dev *ctx) {
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        if (ctx->queues[qid].efd != -1) close(ctx->queues[qid].efd);
+        ctx->queues[qid].efd = -1;
+    }
+    if (ctx->stop_efd != -1) close(ctx->stop_efd);
+    if (ctx->irq_efd != -1) close(ctx->irq_efd);
+    if (ctx->epoll_fd != -1) close(ctx->epoll_fd);
+    ctx->stop_efd = -1;
+    ctx->irq_efd = -1;
+    ctx->epoll_fd = -1;
+}
+
+static inline void event_signal(int efd) {
+    uint64_t one = 1;
+    if (efd != -1 && write(efd, &one, sizeof(one)) == -1)
+        printf("unable to signal eventfd: %s\n", strerror(errno));
+}
+
+// обработка одного сообщения от QEMU
+static void handle_message(struct pcie_dev *dev, const char *msg) {
+    switch (msg[0]) {
+    case 'D': { // запись в doorbell очереди
+        int qid = atoi(msg + 1);
+        if (qid >= 0 && qid < PCIE_QUEUES_NUM) {
+            __atomic_store_n(
+                &dev->queues[qid].db_ns, poller_now_ns(), __ATOMIC_RELAXED
+            );
+            event_signal(dev->queues[qid].efd);
+        }
+        break;
+    }
+    // MSI/PONG/EOF - ответы QEMU на наши сообщения, только вычитываем их
+    default: break;
+    }
+}
+
+static void *sock_thread_func(void *arg) {
+    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    struct epoll_event events[2];
+    char buf[256];
+    char msg[32];
+    size_t msg_len = 0;
+
+    while (!__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(dev->epoll_fd, events, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            printf("epoll error: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == dev->stop_efd) goto end;
+
+            ssize_t len = recv(dev->irq_socket.fd, buf, sizeof(buf), 0);
+            if (len <= 0) {
+                printf("irq socket closed!\n");
+                goto end;
+            }
+
+            // сообщения разделены '\n' и могут приходить слитно
+            for (ssize_t j = 0; j < len; ++j) {
+                if (buf[j] != '\n') {
+                    if (msg_len < sizeof(msg) - 1) msg[msg_len++] = buf[j];
+                    continue;
+                }
+                msg[msg_len] = 0;
+                handle_message(dev, msg);
+                msg_len = 0;
+            }
+        }
+    }
+end:
+    printf("SOCKET EXIT!\n");
+    return NULL;
+}
+
+// ожидание очередного doorbell очереди: сначала активное ожидание в пределах
+// бюджета, затем блокировка на событии или сон с нарастающим интервалом
+static void queue_wait(struct pcie_dev *dev, struct pcie_dev_queue *q) {
+    uint64_t cnt;
+
+    if (poller_spin(&q->poller)) return;
+
+    switch (dev->opts.doorbell) {
+    case PCIE_DEV_DOORBELL_EVENT:
+        poller_block(&q->poller);
+        if (read(q->efd, &cnt, sizeof(cnt)) == -1 && errno != EINTR)
+            poller_sleep(&q->poller);
+        break;
+    case PCIE_DEV_DOORBELL_POLL: poller_sleep(&q->poller); break;
+    }
+}
+
+// экстент хранилища, занятый данными команды
+struct extent {
+    uint64_t addr;
+    uint32_t size;
+};
+
+static inline int validate_extent(
+    struct pcie_dev *dev, const struct extent *ext, struct pcie_cqe *cqe
+) {
+    if (ext->size == 0) {
+        set_pcie_cqe_status_size_error(cqe);
+        return 0;
+    }
+
+    if (ext->addr >= dev->storage.size
+        || ext->size > dev->storage.size - ext->addr) {
+        set_pcie_cqe_status_addr_error(cqe);
+        return 0;
+    }
+
+    return 1;
+}
+
+// разбор списка SGL: список копируется из окна до проверки, чтобы хост не
+// мог изменить его во время исполнения
+static int validate_sgl(
+    struct pcie_dev *dev,
+    const struct pcie_sqe *sqe,
+    struct pcie_cqe *cqe,
+    struct extent *ext
+) {
+    const volatile uint8_t *win = sqe->opcode == PCIE_OP_READ ? dev->rd_win
+                                                              : dev->wr_win;
+    uint64_t list_size = (uint64_t)sqe->sgl_num * sizeof(struct pcie_sgl_entry);
+    uint64_t total = 0;
+
+    if (sqe->sgl_num == 0 || sqe->sgl_num > PCIE_SGL_MAX
+        || sqe->sgl_ofst % sizeof(struct pcie_sgl_entry)
+        || sqe->sgl_ofst >= dev->win_size
+        || list_size > dev->win_size - sqe->sgl_ofst
+        || (sqe->sgl_ofst < sqe->buf_ofst + sqe->size
+            && sqe->buf_ofst < sqe->sgl_ofst + list_size)) {
+        set_pcie_cqe_status_size_error(cqe);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < sqe->sgl_num; ++i) {
+        struct pcie_sgl_entry e;
+
+        memcpy(
+            &e,
+            (const void *)(win + sqe->sgl_ofst + i * sizeof(e)),
+            sizeof(e)
+        );
+        ext[i].addr = (uint64_t)e.addr_low | ((uint64_t)e.addr_high << 32);
+        ext[i].size = e.size;
+        if (!validate_extent(dev, &ext[i], cqe)) return 0;
+        total += e.size;
+    }
+
+    if (total != sqe->size) {
+        set_pcie_cqe_status_size_error(cqe);
+        return 0;
+    }
+
+    return 1;
+}
+
+// проверка дескриптора и разбор экстентов команды в ext (*ext_num - их
+// количество, у FLUSH - 0)
 static inline int validate_descriptor(
-    struct pcie_dev *dev, uint64_t addr, uint32_t size, int is_write
+    struct pcie_dev *dev,
+    const struct pcie_sqe *sqe,
+    struct pcie_cqe *cqe,
+    struct extent *ext,
+    uint32_t *ext_num
 ) {
-    if (addr >= dev->storage_f.file_size) {
-        if (is_write) {
-            set_pcie_bar0_rd_status_addr_error(dev->csr);
-        } else {
-            set_pcie_bar0_rd_status_addr_error(dev->csr);
+    *ext_num = 0;
+
+    switch (sqe->opcode) {
+    case PCIE_OP_READ:
+    case PCIE_OP_WRITE:
+        if (sqe->buf_ofst >= dev->win_size
+            || sqe->size > dev->win_size - sqe->buf_ofst) {
+            set_pcie_cqe_status_size_error(cqe);
+            return 0;
         }
-        return 0;
+        break;
+    case PCIE_OP_FLUSH: return 1; // команда без данных
+    case PCIE_OP_DISCARD: break;  // окно не используется
+    default: set_pcie_cqe_status_op_error(cqe); return 0;
     }
 
-    if (addr + size > dev->storage_f.file_size) {
-        if (is_write) {
-            set_pcie_bar0_wr_status_addr_error(dev->csr);
-        } else {
-            set_pcie_bar0_rd_status_addr_error(dev->csr);
+    if (sqe->flags & PCIE_SQE_FLAG_SGL) {
+        if (sqe->opcode == PCIE_OP_DISCARD) {
+            set_pcie_cqe_status_op_error(cqe);
+            return 0;
         }
-        return 0;
+        if (!validate_sgl(dev, sqe, cqe, ext)) return 0;
+        *ext_num = sqe->sgl_num;
+        return 1;
     }
 
+    ext[0].addr = (uint64_t)sqe->addr_low | ((uint64_t)sqe->addr_high << 32);
+    ext[0].size = sqe->size;
+    if (!validate_extent(dev, &ext[0], cqe)) return 0;
+    *ext_num = 1;
     return 1;
 }
 
-#define INTERRUPT(_dev)                                                 \
-    if (!send_interrupt(_dev)) {                                        \
-        printf("unable to send interrupt (possibly broken socket)!\n"); \
-        goto end;                                                       \
+// сброс всех изменений хранилища
+static int pcie_dev_flush(struct pcie_dev *dev) {
+    size_t pages = 0;
+    enum storage_status stt = storage_flush(&dev->storage, &pages);
+
+    // записи гостя через bar4 хранилище не отслеживает
+    if (stt == STORAGE_OK && dev->opts.direct)
+        stt = storage_sync(&dev->storage, 0, dev->storage.size);
+
+    metrics_add(&dev->metrics.flushes, 1);
+    metrics_add(&dev->metrics.flushed_pages, pages);
+    return stt == STORAGE_OK;
+}
+
+// обеспечение сохранности записанного диапазона согласно политике (при
+// отложенном сбросе хранилище само отслеживает изменения)
+static int pcie_dev_persist(
+    struct pcie_dev *dev,
+    const struct pcie_sqe *sqe,
+    const struct extent *ext,
+    uint32_t ext_num
+) {
+    if (dev->opts.durability != PCIE_DEV_DURABILITY_SYNC
+        && !(sqe->flags & PCIE_SQE_FLAG_FUA))
+        return 1;
+
+    for (uint32_t i = 0; i < ext_num; ++i)
+        if (storage_sync(&dev->storage, ext[i].addr, ext[i].size)
+            != STORAGE_OK)
+            return 0;
+    return 1;
+}
+
+// замеры одной команды: гистограммы её очереди и запись трассы
+struct cmd_stat {
+    struct metrics_queue *m;
+    struct trace_record rec;
+};
+
+static inline void
+stage_set(struct cmd_stat *st, enum metrics_stage stage, uint64_t ns) {
+    metrics_record(&st->m->stages[stage], ns);
+    st->rec.stage_ns[stage] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+// учёт длительности стадии, начавшейся в *t, и начало следующей
+static inline void
+stage_end(struct cmd_stat *st, enum metrics_stage stage, uint64_t *t) {
+    uint64_t now = poller_now_ns();
+
+    stage_set(st, stage, now - *t);
+    *t = now;
+}
+
+// блокировка диапазона, охватывающего все экстенты команды и расширенного до
+// выравнивания хранилища. Один диапазон вместо блокировки каждого экстента
+// исключает взаимоблокировку команд с пересекающимися списками.
+static inline void pcie_dev_lock(
+    struct pcie_dev *dev,
+    struct cmd_stat *st,
+    struct range_lock_node *range,
+    const struct extent *ext,
+    uint32_t ext_num,
+    int exclusive
+) {
+    uint32_t a = dev->storage.align;
+    uint64_t start = UINT64_MAX, end = 0;
+    uint64_t t = poller_now_ns();
+
+    for (uint32_t i = 0; i < ext_num; ++i) {
+        if (ext[i].addr < start) start = ext[i].addr;
+        if (ext[i].addr + ext[i].size > end) end = ext[i].addr + ext[i].size;
     }
+    start = start / a * a;
+    end = (end + a - 1) / a * a;
 
-static void *rd_thread_func(void *arg) {
-    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    if (exclusive)
+        range_lock_exclusive(&dev->storage_lock, range, start, end - start);
+    else range_lock_shared(&dev->storage_lock, range, start, end - start);
+    stage_end(st, METRICS_LOCK, &t);
+}
 
-    while (!__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) {
-        if (!get_pcie_bar0_rd_ctrl_start(dev->csr)) {
-            usleep(POOLING_DELAY);
-            continue;
+static void pcie_dev_exec(
+    struct pcie_dev *dev,
+    struct cmd_stat *st,
+    const struct pcie_sqe *sqe,
+    struct pcie_cqe *cqe
+) {
+    struct extent ext[PCIE_SGL_MAX];
+    uint32_t ext_num, size = sqe->size, ofst = sqe->buf_ofst;
+    struct range_lock_node range;
+    uint64_t t;
+
+    // проверка дескриптора
+    if (!validate_descriptor(dev, sqe, cqe, ext, &ext_num)) return;
+
+    switch (sqe->opcode) {
+    case PCIE_OP_READ:
+        // блокировка чтения
+        pcie_dev_lock(dev, st, &range, ext, ext_num, 0);
+        t = poller_now_ns();
+
+        // копирование данных экстентов из памяти в пространство чтения
+        for (uint32_t i = 0; i < ext_num; ofst += ext[i++].size) {
+            if (storage_read(
+                    &dev->storage,
+                    (void *)(dev->rd_win + ofst),
+                    ext[i].addr,
+                    ext[i].size
+                )
+                != STORAGE_OK) {
+                set_pcie_cqe_status_io_error(cqe);
+                break;
+            }
+        }
+        stage_end(st, METRICS_COPY, &t);
+
+        // разблокировка чтения
+        range_unlock(&dev->storage_lock, &range);
+        break;
+    case PCIE_OP_WRITE:
+        // блокировка записи
+        pcie_dev_lock(dev, st, &range, ext, ext_num, 1);
+        t = poller_now_ns();
+
+        // копирование данных из пространства записи в экстенты памяти и
+        // синхронизация памяти устройства
+        for (uint32_t i = 0; i < ext_num; ofst += ext[i++].size) {
+            if (storage_write(
+                    &dev->storage,
+                    (void *)(dev->wr_win + ofst),
+                    ext[i].addr,
+                    ext[i].size
+                )
+                != STORAGE_OK) {
+                set_pcie_cqe_status_io_error(cqe);
+                break;
+            }
         }
+        stage_end(st, METRICS_COPY, &t);
+
+        if (!get_pcie_cqe_status_io_error(cqe)
+            && !pcie_dev_persist(dev, sqe, ext, ext_num))
+            set_pcie_cqe_status_io_error(cqe);
+        stage_end(st, METRICS_SYNC, &t);
+
+        // разблокировка записи
+        range_unlock(&dev->storage_lock, &range);
+        break;
+    case PCIE_OP_FLUSH:
+        // записи, завершённые до выборки команды, уже отмечены в карте
+        t = poller_now_ns();
+        if (!pcie_dev_flush(dev)) set_pcie_cqe_status_io_error(cqe);
+        stage_end(st, METRICS_SYNC, &t);
+        size = 0;
+        break;
+    case PCIE_OP_DISCARD:
+        pcie_dev_lock(dev, st, &range, ext, ext_num, 1);
+        t = poller_now_ns();
+        if (storage_discard(&dev->storage, ext[0].addr, ext[0].size)
+            != STORAGE_OK)
+            set_pcie_cqe_status_io_error(cqe);
+        stage_end(st, METRICS_COPY, &t);
+        range_unlock(&dev->storage_lock, &range);
+        break;
+    }
+
+    cqe->result = size;
+}
+
+static int queue_complete(
+    struct pcie_dev *dev, struct pcie_dev_queue *q, struct pcie_cqe *cqe
+) {
+    volatile struct pcie_cqe *slot;
+    uint32_t next = (q->cq_tail + 1) % QUEUE_DEPTH;
+
+    // ждём, пока хост не освободит место в очереди завершения
+    while (next == __atomic_load_n(&q->regs->cq_head, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) return 0;
+        usleep(POOLING_DELAY);
+    }
+
+    cqe->sq_head = __atomic_load_n(&q->sq_head, __ATOMIC_RELAXED);
+    if (q->phase) set_pcie_cqe_status_phase(cqe);
+
+    slot = &q->regs->cq[q->cq_tail];
+    slot->result = cqe->result;
+    slot->sq_head = cqe->sq_head;
+    slot->cid = cqe->cid;
+    // статус с битом фазы публикуется последним
+    __atomic_store_n(&slot->status, cqe->status, __ATOMIC_RELEASE);
+
+    q->cq_tail = next;
+    if (q->cq_tail == 0) q->phase ^= 1;
+    __atomic_store_n(
+        &q->regs->cq_tail,
+        q->cq_tail | (q->phase ? PCIE_CQ_TAIL_PHASE_MASK : 0),
+        __ATOMIC_RELEASE
+    );
+    return 1;
+}
 
-        unset_pcie_bar0_rd_ctrl_start(dev->csr);
-        unset_pcie_bar0_rd_status_comp(dev->csr);
-        unset_pcie_bar0_rd_status_addr_error(dev->csr);
-        unset_pcie_bar0_rd_status_size_error(dev->csr);
+// отправка прерывания о накопленных завершениях, вызывается под cq_lock,
+// возвращает длительность отправки
+static uint64_t
+queue_send_irq(struct pcie_dev *dev, enum pcie_queue_id qid) {
+    struct pcie_dev_queue *q = &dev->queues[qid];
+    struct metrics_queue *m = &dev->metrics.queues[qid];
+    uint64_t t = poller_now_ns();
 
-        // получение дескриптора
-        uint64_t addr = (uint64_t)dev->csr->rd_desc.addr_low
-                      | ((uint64_t)dev->csr->rd_desc.addr_high << 32);
-        uint32_t size = dev->csr->rd_desc.size;
+    q->irq_pending = 0;
+    q->irq_deadline_ns = 0;
+    if (!send_interrupt(dev, qid))
+        printf("unable to send interrupt (possibly broken socket)!\n");
+    t = poller_now_ns() - t;
+    metrics_record(&m->stages[METRICS_IRQ], t);
+    metrics_add(&m->irqs, 1);
+    return t;
+}
+
+// выполнение команды исполнителем пула
+static void
+pcie_dev_handle_cmd(void *arg, int worker, const struct work_item *item) {
+    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    struct pcie_dev_queue *q = &dev->queues[item->qid];
+    struct metrics_queue *m = &dev->metrics.queues[item->qid];
+    struct pcie_cqe cqe = {.cid = item->sqe.cid};
+    struct cmd_stat st = {
+        .m = m,
+        .rec = {
+            .ts_ns = item->fetch_ns,
+            .addr = (uint64_t)item->sqe.addr_low
+                  | ((uint64_t)item->sqe.addr_high << 32),
+            .size = item->sqe.size,
+            .cid = item->sqe.cid,
+            .qid = item->qid,
+            .opcode = item->sqe.opcode,
+            .stage_ns[METRICS_DOORBELL] = item->db_delay_ns,
+        },
+    };
+    uint32_t inflight, count, usec;
+    uint64_t t = item->fetch_ns;
+
+    stage_end(&st, METRICS_QUEUE, &t);
+    pcie_dev_exec(dev, &st, &item->sqe, &cqe);
 
-        if (size >= WIN_SIZE) size = WIN_SIZE;
+    pthread_mutex_lock(&q->cq_lock);
+    if (!queue_complete(dev, q, &cqe)) {
+        pthread_mutex_unlock(&q->cq_lock);
+        return;
+    }
+
+    t = item->fetch_ns;
+    stage_end(&st, METRICS_TOTAL, &t);
+    st.rec.status = cqe.status & ~PCIE_CQE_STATUS_PHASE_MASK;
+    st.rec.result = cqe.result;
+    metrics_add(&m->cmds, 1);
+    if (st.rec.status) metrics_add(&m->errors, 1);
+    else metrics_add(&m->bytes, cqe.result);
 
-        printf("read(addr=0x%lx, size=0x%x)\n", addr, size);
+    // пороги объединения прерываний хост может менять на ходу, пока он их
+    // не задал - прерывание на каждое завершение
+    count = dev->csr->irq_coalesce_count;
+    usec = dev->csr->irq_coalesce_usec;
+    if (count == 0) count = 1;
+
+    // прерывание отправляется по порогу количества, по порогу времени
+    // (потоком таймера), а без него - когда в очереди не осталось команд
+    inflight = __atomic_sub_fetch(&q->inflight, 1, __ATOMIC_ACQ_REL);
+    if (++q->irq_pending >= count || (usec == 0 && inflight == 0)) {
+        t = queue_send_irq(dev, item->qid);
+        st.rec.stage_ns[METRICS_IRQ] = t > UINT32_MAX ? UINT32_MAX : t;
+    } else if (usec != 0 && q->irq_deadline_ns == 0) {
+        q->irq_deadline_ns = poller_now_ns() + (uint64_t)usec * 1000;
+        event_signal(dev->irq_efd);
+    }
+    pthread_mutex_unlock(&q->cq_lock);
 
-        // проверка дескриптора
-        if (!validate_descriptor(dev, addr, size, 0)) {
-            set_pcie_bar0_rd_status_comp(dev->csr);
-            INTERRUPT(dev);
+    if (dev->trace.base) trace_write(&dev->trace, worker, &st.rec);
+
+    // поток выборки мог остановиться на пределе команд в работе
+    if (inflight == QUEUE_DEPTH - 2) event_signal(q->efd);
+}
+
+static void fetch_thread(struct pcie_dev *dev, enum pcie_queue_id qid) {
+    struct pcie_dev_queue *q = &dev->queues[qid];
+
+    poller_init(&q->poller, &dev->opts.poller);
+
+    while (!__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) {
+        uint32_t tail = __atomic_load_n(&q->regs->sq_tail, __ATOMIC_ACQUIRE);
+
+        if (tail == q->sq_head || tail >= QUEUE_DEPTH
+            || __atomic_load_n(&q->inflight, __ATOMIC_ACQUIRE)
+                   >= QUEUE_DEPTH - 1) {
+            queue_wait(dev, q);
             continue;
         }
 
-        // блокировка чтения
-        address_lock_rd_lock(&dev->storage_lock, addr, size);
+        uint64_t db_ns = __atomic_load_n(&q->db_ns, __ATOMIC_RELAXED);
+        uint64_t now = poller_now_ns();
+        uint32_t db_delay = 0;
 
-        // копирование данных из памяти в пространство чтения
-        memcpy((void *)dev->data->rd_data, dev->storage_f.base + addr, size);
+        poller_hit(&q->poller, db_ns);
+        // задержка учитывается один раз на doorbell (в режиме опроса
+        // сообщений нет и db_ns не меняется)
+        if (db_ns != q->db_seen_ns) {
+            metrics_record(
+                &dev->metrics.queues[qid].stages[METRICS_DOORBELL],
+                now - db_ns
+            );
+            db_delay = now - db_ns > UINT32_MAX ? UINT32_MAX : now - db_ns;
+            q->db_seen_ns = db_ns;
+        }
 
-        // разблокировка чтения
-        address_lock_rd_unlock(&dev->storage_lock);
+        // раздаём исполнителям всю пачку команд до текущего doorbell, не
+        // более QUEUE_DEPTH - 1 команд в работе (по размеру очереди завершения)
+        while (q->sq_head != tail
+               && __atomic_load_n(&q->inflight, __ATOMIC_ACQUIRE)
+                      < QUEUE_DEPTH - 1) {
+            struct work_item item = {
+                .qid = qid,
+                .fetch_ns = now,
+                .db_delay_ns = db_delay,
+                .sqe = *(struct pcie_sqe *)&q->regs->sq[q->sq_head],
+            };
+
+            db_delay = 0;
+            if (dev->capture.fd != -1)
+                capture_add(&dev->capture, qid, &item.sqe, now);
+
+            __atomic_store_n(
+                &q->sq_head, (q->sq_head + 1) % QUEUE_DEPTH, __ATOMIC_RELAXED
+            );
+            __atomic_store_n(&q->regs->sq_head, q->sq_head, __ATOMIC_RELEASE);
 
-        // информаруем о завершении чтения
-        set_pcie_bar0_rd_status_comp(dev->csr);
-        INTERRUPT(dev);
+            __atomic_add_fetch(&q->inflight, 1, __ATOMIC_ACQ_REL);
+            work_pool_push(&dev->pool, &item);
+        }
     }
-end:
+}
+
+static void *rd_thread_func(void *arg) {
+    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    fetch_thread(dev, PCIE_RD_QUEUE);
+    poller_report(&dev->queues[PCIE_RD_QUEUE].poller, "READ");
     printf("READ EXIT!\n");
     return NULL;
 }
 
 static void *wr_thread_func(void *arg) {
     struct pcie_dev *dev = (struct pcie_dev *)arg;
+    fetch_thread(dev, PCIE_WR_QUEUE);
+    poller_report(&dev->queues[PCIE_WR_QUEUE].poller, "WRITE");
+    printf("WRITE EXIT!\n");
+    return NULL;
+}
+
+// фоновый сброс изменённых страниц, просыпается раз в flush_interval_ms
+static void *flush_thread_func(void *arg) {
+    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    struct pollfd pfd = {.fd = dev->stop_efd, .events = POLLIN};
 
     while (!__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) {
-        if (!get_pcie_bar0_wr_ctrl_start(dev->csr)) {
-            usleep(POOLING_DELAY);
-            continue;
+        int n = poll(&pfd, 1, dev->opts.flush_interval_ms);
+        if (n == -1 && errno != EINTR) {
+            printf("poll error: %s\n", strerror(errno));
+            break;
         }
-        // сброс прерываний и csr
-        unset_pcie_bar0_wr_ctrl_start(dev->csr);
-        unset_pcie_bar0_wr_status_comp(dev->csr);
-        unset_pcie_bar0_wr_status_addr_error(dev->csr);
-        unset_pcie_bar0_wr_status_size_error(dev->csr);
+        if (n > 0) break;
 
-        // получение дескриптора
-        uint64_t addr = (uint64_t)dev->csr->wr_desc.addr_low
-                      | ((uint64_t)dev->csr->wr_desc.addr_high << 32);
-        uint32_t size = dev->csr->wr_desc.size;
+        if (!pcie_dev_flush(dev)) printf("background flush failed!\n");
+    }
 
-        if (size >= WIN_SIZE) size = WIN_SIZE;
+    printf("FLUSH EXIT!\n");
+    return NULL;
+}
 
-        printf("write(addr=0x%lx, size=0x%x)\n", addr, size);
+// периодическая выгрузка метрик, просыпается раз в metrics_interval_ms
+static void *metrics_thread_func(void *arg) {
+    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    struct pollfd pfd = {.fd = dev->stop_efd, .events = POLLIN};
 
-        // проверка дескриптора
-        if (!validate_descriptor(dev, addr, size, 1)) {
-            set_pcie_bar0_wr_status_comp(dev->csr);
-            INTERRUPT(dev);
-            continue;
+    while (!__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) {
+        int n = poll(&pfd, 1, dev->opts.metrics_interval_ms);
+        if (n == -1 && errno != EINTR) {
+            printf("poll error: %s\n", strerror(errno));
+            break;
         }
+        if (n > 0) break;
 
-        // блокировка записи
-        address_lock_wr_lock(&dev->storage_lock, addr, size);
+        if (!metrics_dump(&dev->metrics, dev->opts.metrics_path))
+            printf("unable to write metrics: %s\n", strerror(errno));
+    }
 
-        // копирование данных из пространства записи в память
-        memcpy(dev->storage_f.base + addr, (void *)dev->data->wr_data, size);
+    printf("METRICS EXIT!\n");
+    return NULL;
+}
 
-        // синхронизация памяти устройства
-        mf_sync(&dev->storage_f, addr, size, MS_SYNC);
+// отправка прерываний, срок которых истёк по порогу времени
+static void *irq_thread_func(void *arg) {
+    struct pcie_dev *dev = (struct pcie_dev *)arg;
+    struct pollfd pfd[2] = {
+        {.fd = dev->stop_efd, .events = POLLIN},
+        {.fd = dev->irq_efd,  .events = POLLIN},
+    };
+    struct timespec ts;
+    uint64_t cnt;
 
-        // разблокировка записи
-        set_pcie_bar0_wr_status_comp(dev->csr);
-        address_lock_wr_unlock(&dev->storage_lock);
+    while (!__atomic_load_n(&dev->stop_flag, __ATOMIC_ACQUIRE)) {
+        uint64_t now = poller_now_ns(), next = UINT64_MAX;
 
-        // информаруем о завершении записи
-        INTERRUPT(dev);
+        for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+            struct pcie_dev_queue *q = &dev->queues[qid];
+
+            pthread_mutex_lock(&q->cq_lock);
+            if (q->irq_deadline_ns && q->irq_deadline_ns <= now)
+                queue_send_irq(dev, qid);
+            else if (q->irq_deadline_ns && q->irq_deadline_ns < next)
+                next = q->irq_deadline_ns;
+            pthread_mutex_unlock(&q->cq_lock);
+        }
+
+        ts.tv_sec = (next - now) / 1000000000;
+        ts.tv_nsec = (next - now) % 1000000000;
+        int n = ppoll(pfd, 2, next == UINT64_MAX ? NULL : &ts, NULL);
+        if (n == -1 && errno != EINTR) {
+            printf("poll error: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[0].revents) break;
+        if (pfd[1].revents && read(dev->irq_efd, &cnt, sizeof(cnt)) == -1
+            && errno != EAGAIN)
+            printf("irq eventfd error: %s\n", strerror(errno));
     }
-end:
-    printf("WRITE EXIT!\n");
+
+    printf("IRQ TIMER EXIT!\n");
     return NULL;
 }
 
+// создание потока с привязкой к ядру (cpu >= 0) и политикой SCHED_FIFO
+static int pcie_dev_thread_create(
+    struct pcie_dev *ctx,
+    pthread_t *thread,
+    int cpu,
+    int fifo,
+    void *(*func)(void *),
+    void *arg
+) {
+    pthread_attr_t attr;
+    int res;
+
+    fifo = fifo && ctx->opts.fifo_prio > 0;
+    if (pthread_attr_init(&attr) != 0) return -1;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+
+    if (fifo) {
+        struct sched_param param = {.sched_priority = ctx->opts.fifo_prio};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    res = pthread_create(thread, &attr, func, arg);
+    if (res == EPERM && fifo) {
+        // без CAP_SYS_NICE остаёмся на обычном планировании
+        printf("SCHED_FIFO is not permitted, using default policy\n");
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        res = pthread_create(thread, &attr, func, arg);
+    }
+
+    pthread_attr_destroy(&attr);
+    return res;
+}
+
+static inline enum pcie_dev_status pcie_dev_start_threads(struct pcie_dev *ctx
+) {
+    static void *(*const fetch_funcs[PCIE_QUEUES_NUM])(void *) = {
+        [PCIE_RD_QUEUE] = rd_thread_func,
+        [PCIE_WR_QUEUE] = wr_thread_func,
+    };
+    static const enum pcie_dev_thread fetch_ids[PCIE_QUEUES_NUM] = {
+        [PCIE_RD_QUEUE] = PCIE_DEV_THREAD_RD,
+        [PCIE_WR_QUEUE] = PCIE_DEV_THREAD_WR,
+    };
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (work_pool_init(
+            &ctx->pool, ctx->opts.workers, pcie_dev_handle_cmd, ctx
+        )
+        != 0)
+        return PCIE_DEV_MEM_ERROR;
+
+    if (ctx->opts.capture_path
+        && capture_open(&ctx->capture, ctx->opts.capture_path, poller_now_ns())
+               != 0) {
+        printf(
+            "unable to create capture `%s`: %s\n",
+            ctx->opts.capture_path,
+            strerror(errno)
+        );
+        return PCIE_DEV_FILE_ERROR;
+    }
+
+    // по кольцу трассы на исполнителя, чтобы запись обходилась без блокировок
+    if (ctx->opts.trace_path
+        && trace_create(
+               &ctx->trace,
+               ctx->opts.trace_path,
+               ctx->pool.workers_num,
+               ctx->opts.trace_size
+           ) != 0) {
+        printf(
+            "unable to create trace `%s`: %s\n",
+            ctx->opts.trace_path,
+            strerror(errno)
+        );
+        return PCIE_DEV_FILE_ERROR;
+    }
+
+    for (int i = 0; i < ctx->pool.workers_num; ++i) {
+        struct work_worker *w = &ctx->pool.workers[i];
+        int cpu = ctx->opts.worker_cpu < 0
+                    ? -1
+                    : (ctx->opts.worker_cpu + i) % ncpu;
+
+        if (pcie_dev_thread_create(
+                ctx, &w->thread, cpu, 1, work_pool_worker_func, w
+            )
+            != 0)
+            return PCIE_DEV_THREAD_ERROR;
+    }
+
+    if (pcie_dev_thread_create(
+            ctx, &ctx->irq_thread, -1, 0, irq_thread_func, ctx
+        )
+        != 0)
+        return PCIE_DEV_THREAD_ERROR;
+
+    if (ctx->opts.durability == PCIE_DEV_DURABILITY_PERIODIC
+        && pcie_dev_thread_create(
+               ctx, &ctx->flush_thread, -1, 0, flush_thread_func, ctx
+           ) != 0)
+        return PCIE_DEV_THREAD_ERROR;
+
+    if (ctx->opts.metrics_path
+        && pcie_dev_thread_create(
+               ctx, &ctx->metrics_thread, -1, 0, metrics_thread_func, ctx
+           ) != 0)
+        return PCIE_DEV_THREAD_ERROR;
+
+    if (pcie_dev_thread_create(
+            ctx,
+            &ctx->sock_thread,
+            ctx->opts.cpus[PCIE_DEV_THREAD_SOCK],
+            0,
+            sock_thread_func,
+            ctx
+        )
+        != 0)
+        return PCIE_DEV_THREAD_ERROR;
+
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        if (pcie_dev_thread_create(
+                ctx,
+                &ctx->fetch_threads[qid],
+                ctx->opts.cpus[fetch_ids[qid]],
+                1,
+                fetch_funcs[qid],
+                ctx
+            )
+            != 0)
+            return PCIE_DEV_THREAD_ERROR;
+    }
+
+    return PCIE_DEV_OK;
+}
+
+void pcie_dev_opts_default(struct pcie_dev_opts *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->irq_port = 17887;
+    opts->doorbell = PCIE_DEV_DOORBELL_EVENT;
+    poller_opts_default(&opts->poller);
+    for (int i = 0; i < PCIE_DEV_THREADS_NUM; ++i) opts->cpus[i] = -1;
+    opts->workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts->workers <= 0) opts->workers = 2;
+    opts->worker_cpu = -1;
+    opts->durability = PCIE_DEV_DURABILITY_SYNC;
+    opts->flush_interval_ms = 1000;
+    opts->metrics_interval_ms = 1000;
+    opts->trace_size = 65536;
+    opts->storage = STORAGE_MMAP;
+}
+
 enum pcie_dev_status pcie_dev_init(
     struct pcie_dev *ctx,
     const char *bar0_filename,
     const char *bar2_filename,
-    const char *storage_filename
+    const char *storage_filename,
+    const struct pcie_dev_opts *opts
 ) {
     enum pcie_dev_status stt;
     memset(ctx, 0, sizeof(*ctx));
 
+    if (opts) ctx->opts = *opts;
+    else pcie_dev_opts_default(&ctx->opts);
+
+    ctx->epoll_fd = -1;
+    ctx->stop_efd = -1;
+    ctx->irq_efd = -1;
+    ctx->trace.fd = -1;
+    ctx->capture.fd = -1;
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        ctx->queues[qid].efd = -1;
+        pthread_mutex_init(&ctx->queues[qid].cq_lock, NULL);
+    }
+
     socket_init(&ctx->irq_socket);
-    if (!socket_connect(&ctx->irq_socket, "127.0.0.1", 17887))
+    if (!socket_connect(&ctx->irq_socket, "127.0.0.1", ctx->opts.irq_port))
         return PCIE_DEV_SOCKET_ERROR;
 
-    if (address_lock_init(&ctx->storage_lock) != 0) return PCIE_DEV_MEM_ERROR;
+    TRY_PCIE_DEV(pcie_dev_open_events(ctx), stt = error_status; goto err);
 
-    TRY_PCIE_DEV(pcie_dev_open_csr(ctx, bar0_filename), goto err);
-    TRY_PCIE_DEV(pcie_dev_open_data(ctx, bar2_filename), goto err);
+    if (range_lock_init(&ctx->storage_lock) != 0) {
+        stt = PCIE_DEV_MEM_ERROR;
+        goto err;
+    }
+
+    TRY_PCIE_DEV(pcie_dev_open_csr(ctx, bar0_filename),
+                 stt = error_status;
+                 goto err);
+    TRY_PCIE_DEV(pcie_dev_open_data(ctx, bar2_filename),
+                 stt = error_status;
+                 goto err);
     TRY_PCIE_DEV(pcie_dev_open_storage(ctx, storage_filename),
                  stt = error_status;
                  goto err);
 
     memset((void *)ctx->csr, 0, sizeof(*ctx->csr));
-    ctx->csr->disk_size = ctx->storage_f.file_size;
-
-    if (pthread_create(&ctx->rd_thread, NULL, rd_thread_func, ctx) != 0) {
-        stt = PCIE_DEV_THREAD_ERROR;
-        goto err;
-    }
+    ctx->csr->disk_size = ctx->storage.size;
+    ctx->csr->win_size = ctx->win_size;
+    ctx->csr->rd_win_ofst = 0;
+    ctx->csr->wr_win_ofst = ctx->win_size;
+    pcie_dev_init_queues(ctx);
 
-    if (pthread_create(&ctx->wr_thread, NULL, wr_thread_func, ctx) != 0) {
-        stt = PCIE_DEV_THREAD_ERROR;
-        goto err;
-    }
+    TRY_PCIE_DEV(pcie_dev_start_threads(ctx), stt = error_status; goto err);
 
     return PCIE_DEV_OK;
 
@@ -228,14 +1011,67 @@ err:
 void pcie_dev_cleanup(struct pcie_dev *ctx) {
     __atomic_store_n(&ctx->stop_flag, 1, __ATOMIC_RELEASE);
 
+    // будим потоки, заблокированные в ожидании событий
+    event_signal(ctx->stop_efd);
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid)
+        event_signal(ctx->queues[qid].efd);
+
+    if (ctx->sock_thread) pthread_join(ctx->sock_thread, NULL);
+    ctx->sock_thread = 0;
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid) {
+        if (ctx->fetch_threads[qid]) pthread_join(ctx->fetch_threads[qid], NULL);
+        ctx->fetch_threads[qid] = 0;
+    }
+
+    // потоки выборки остановлены - их буферы записи можно дописать
+    capture_close(&ctx->capture);
+
+    // исполнители останавливаются после потоков выборки
+    if (ctx->pool.workers) {
+        work_pool_stop(&ctx->pool);
+        for (int i = 0; i < ctx->pool.workers_num; ++i) {
+            if (ctx->pool.workers[i].thread)
+                pthread_join(ctx->pool.workers[i].thread, NULL);
+        }
+        work_pool_report(&ctx->pool);
+        work_pool_cleanup(&ctx->pool);
+    }
+
+    if (ctx->flush_thread) pthread_join(ctx->flush_thread, NULL);
+    ctx->flush_thread = 0;
+    if (ctx->irq_thread) pthread_join(ctx->irq_thread, NULL);
+    ctx->irq_thread = 0;
+    if (ctx->metrics_thread) pthread_join(ctx->metrics_thread, NULL);
+    ctx->metrics_thread = 0;
+
+    // после остановки исполнителей сбрасываем всё, что накопилось
+    if ((ctx->opts.durability != PCIE_DEV_DURABILITY_SYNC || ctx->opts.direct)
+        && ctx->storage.ops) {
+        pcie_dev_flush(ctx);
+        printf(
+            "FLUSH: %lu flushes, %lu pages\n",
+            ctx->metrics.flushes,
+            ctx->metrics.flushed_pages
+        );
+    }
+
+    // итоговые метрики, включая последний сброс
+    if (ctx->opts.metrics_path && ctx->storage.ops
+        && !metrics_dump(&ctx->metrics, ctx->opts.metrics_path))
+        printf("unable to write metrics: %s\n", strerror(errno));
+
+    // файл трассы остаётся для trace_dump
+    trace_close(&ctx->trace);
+
     if (ctx->irq_socket.fd) socket_close(&ctx->irq_socket);
+    pcie_dev_close_events(ctx);
 
-    if (ctx->rd_thread) pthread_join(ctx->rd_thread, NULL);
-    if (ctx->wr_thread) pthread_join(ctx->wr_thread, NULL);
+    for (int qid = 0; qid < PCIE_QUEUES_NUM; ++qid)
+        pthread_mutex_destroy(&ctx->queues[qid].cq_lock);
 
-    address_lock_cleanup(&ctx->storage_lock);
+    range_lock_cleanup(&ctx->storage_lock);
 
     mf_cleanup(&ctx->bar0_f);
     mf_cleanup(&ctx->bar2_f);
-    mf_cleanup(&ctx->storage_f);
+    storage_close(&ctx->storage);
 }
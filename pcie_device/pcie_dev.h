@@ -1,11 +1,18 @@
 #pragma once
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
-#include "address_lock.h"
 #include "bars.h"
+#include "capture.h"
 #include "mapped_file.h"
+#include "metrics.h"
+#include "poller.h"
+#include "range_lock.h"
 #include "socket.h"
+#include "storage.h"
+#include "trace.h"
+#include "work_pool.h"
 
 enum pcie_dev_status {
     PCIE_DEV_OK = 0,
@@ -15,28 +22,148 @@ enum pcie_dev_status {
     PCIE_DEV_MEM_ERROR,
     PCIE_DEV_THREAD_ERROR,
     PCIE_DEV_SOCKET_ERROR,
+    PCIE_DEV_SIZE_ERROR,
+};
+
+enum pcie_dev_doorbell {
+    // ожидание сообщений о записи в doorbell от QEMU
+    PCIE_DEV_DOORBELL_EVENT = 0,
+    // периодический опрос sq_tail (для QEMU без страницы doorbell)
+    PCIE_DEV_DOORBELL_POLL,
+};
+
+enum pcie_dev_durability {
+    // сброс на носитель после каждой записи
+    PCIE_DEV_DURABILITY_SYNC = 0,
+    // фоновый сброс изменённых страниц раз в flush_interval_ms
+    PCIE_DEV_DURABILITY_PERIODIC,
+    // сброс только по команде FLUSH и для записей с флагом FUA
+    PCIE_DEV_DURABILITY_ONDEMAND,
+};
+
+enum pcie_dev_thread {
+    PCIE_DEV_THREAD_RD = 0,
+    PCIE_DEV_THREAD_WR,
+    PCIE_DEV_THREAD_SOCK,
+    PCIE_DEV_THREADS_NUM,
+};
+
+struct pcie_dev_opts {
+    // порт сокета прерываний QEMU на 127.0.0.1
+    int irq_port;
+    enum pcie_dev_doorbell doorbell;
+    struct poller_opts poller;
+
+    enum pcie_dev_durability durability;
+    uint32_t flush_interval_ms;
+    enum storage_type storage;
+    // STORAGE_POPULATE/HUGEPAGE/SEQUENTIAL/RANDOM
+    unsigned storage_flags;
+    // файл хранилища отображён гостю в bar4: записи через него минуют команды,
+    // поэтому FLUSH сохраняет файл целиком
+    int direct;
+
+    // ядро, к которому привязывается поток (-1 - без привязки)
+    int cpus[PCIE_DEV_THREADS_NUM];
+    // приоритет SCHED_FIFO потоков очередей и исполнителей (0 - обычное
+    // планирование)
+    int fifo_prio;
+
+    // количество исполнителей команд
+    int workers;
+    // ядро первого исполнителя, остальные привязываются к следующим по кругу
+    // (-1 - без привязки)
+    int worker_cpu;
+
+    // файл метрик в текстовом формате Prometheus (NULL - не выгружаются),
+    // перезаписывается раз в metrics_interval_ms и при остановке
+    const char *metrics_path;
+    uint32_t metrics_interval_ms;
+
+    // файл двоичной трассы команд (NULL - не ведётся) и размер кольца
+    // каждого исполнителя в записях
+    const char *trace_path;
+    uint32_t trace_size;
+
+    // запись выбранных дескрипторов для воспроизведения (NULL - не ведётся)
+    const char *capture_path;
+};
+
+// состояние пары очередей со стороны устройства
+struct pcie_dev_queue {
+    volatile struct pcie_queue *regs;
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    uint8_t phase;
+
+    // eventfd, взводится при получении doorbell очереди
+    int efd;
+    // момент получения последнего doorbell (для статистики)
+    uint64_t db_ns;
+    // db_ns, задержка обнаружения которого уже учтена в метриках
+    uint64_t db_seen_ns;
+
+    struct poller poller;
+
+    // запись в очередь завершения ведётся исполнителями параллельно
+    pthread_mutex_t cq_lock;
+    // команды, выбранные из sq, но ещё не завершённые
+    uint32_t inflight;
+    // завершения, о которых ещё не отправлено прерывание
+    uint32_t irq_pending;
+    // момент, когда их прерывание отправит поток таймера (0 - не взведён)
+    uint64_t irq_deadline_ns;
 };
 
 struct pcie_dev {
-    struct mapped_file storage_f;
+    struct storage storage;
     struct mapped_file bar0_f;
     struct mapped_file bar2_f;
     volatile struct pcie_bar0 *csr;
-    volatile struct pcie_bar2 *data;
+    // окна передачи в bar2 размером win_size каждое
+    volatile uint8_t *rd_win;
+    volatile uint8_t *wr_win;
+    uint32_t win_size;
+
+    struct pcie_dev_opts opts;
 
     struct socket irq_socket;
+    struct pcie_dev_queue queues[PCIE_QUEUES_NUM];
+
+    int epoll_fd;
+    int stop_efd;
 
-    pthread_t rd_thread;
-    pthread_t wr_thread;
+    pthread_t sock_thread;
+    // потоки выборки команд из очередей отправки
+    pthread_t fetch_threads[PCIE_QUEUES_NUM];
+    struct work_pool pool;
+    // фоновый сброс изменённых страниц (PCIE_DEV_DURABILITY_PERIODIC)
+    pthread_t flush_thread;
+    // отправка отложенных прерываний по порогу времени, irq_efd будит его
+    // при взведении нового срока
+    pthread_t irq_thread;
+    int irq_efd;
+    // периодическая выгрузка метрик в opts.metrics_path
+    pthread_t metrics_thread;
     int stop_flag;
-    struct address_lock storage_lock;
+
+    struct metrics metrics;
+    // открыта, если задан opts.trace_path
+    struct trace trace;
+    // открыта, если задан opts.capture_path
+    struct capture capture;
+
+    struct range_lock storage_lock;
 };
 
+void pcie_dev_opts_default(struct pcie_dev_opts *opts);
+
 enum pcie_dev_status pcie_dev_init(
     struct pcie_dev *ctx,
     const char *bar0_filename,
     const char *bar2_filename,
-    const char *storage_filename
+    const char *storage_filename,
+    const struct pcie_dev_opts *opts
 );
 
 void pcie_dev_cleanup(struct pcie_dev *ctx);
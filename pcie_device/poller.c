@@ -0,0 +1,124 @@
+#include "poller.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC  1000000000ull
+#define NSEC_PER_USEC 1000ull
+
+#define SPIN_DEFAULT_NS      20000
+#define SLEEP_MIN_DEFAULT_US 10
+#define SLEEP_MAX_DEFAULT_US 1000
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+static inline uint64_t clock_ns(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+uint64_t poller_now_ns(void) { return clock_ns(CLOCK_MONOTONIC); }
+
+void poller_opts_default(struct poller_opts *opts) {
+    opts->spin_ns = SPIN_DEFAULT_NS;
+    opts->sleep_min_us = SLEEP_MIN_DEFAULT_US;
+    opts->sleep_max_us = SLEEP_MAX_DEFAULT_US;
+}
+
+void poller_init(struct poller *p, const struct poller_opts *opts) {
+    memset(p, 0, sizeof(*p));
+    p->opts = *opts;
+    if (p->opts.sleep_min_us == 0) p->opts.sleep_min_us = 1;
+    if (p->opts.sleep_max_us < p->opts.sleep_min_us)
+        p->opts.sleep_max_us = p->opts.sleep_min_us;
+    p->sleep_us = p->opts.sleep_min_us;
+    p->wall_start_ns = poller_now_ns();
+    p->cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+int poller_spin(struct poller *p) {
+    uint64_t now = poller_now_ns();
+
+    p->last_check_ns = now;
+    if (p->idle_since_ns == 0) p->idle_since_ns = now;
+
+    if (now - p->idle_since_ns >= p->opts.spin_ns) return 0;
+
+    cpu_relax();
+    p->last_wait = POLLER_WAIT_SPIN;
+    return 1;
+}
+
+void poller_sleep(struct poller *p) {
+    p->last_wait = POLLER_WAIT_SLEEP;
+    usleep(p->sleep_us);
+
+    p->sleep_us *= 2;
+    if (p->sleep_us > p->opts.sleep_max_us) p->sleep_us = p->opts.sleep_max_us;
+}
+
+void poller_block(struct poller *p) { p->last_wait = POLLER_WAIT_BLOCK; }
+
+void poller_hit(struct poller *p, uint64_t event_ns) {
+    struct poller_stats *st = &p->stats;
+    enum poller_wait w = p->last_wait;
+    uint64_t now = poller_now_ns();
+    uint64_t since = p->last_check_ns;
+    uint64_t delay = 0;
+
+    if (w == POLLER_WAIT_BLOCK && event_ns != 0) since = event_ns;
+    if (w != POLLER_WAIT_NONE && since != 0 && now > since) delay = now - since;
+
+    st->hits[w]++;
+    st->delay_sum_ns[w] += delay;
+    if (delay > st->delay_max_ns[w]) st->delay_max_ns[w] = delay;
+
+    // новый бюджет активного ожидания отсчитывается от конца этой пачки
+    p->idle_since_ns = 0;
+    p->sleep_us = p->opts.sleep_min_us;
+    p->last_wait = POLLER_WAIT_NONE;
+}
+
+void poller_report(const struct poller *p, const char *name) {
+    static const char *wait_names[POLLER_WAIT_NUM] = {
+        [POLLER_WAIT_NONE] = "busy",
+        [POLLER_WAIT_SPIN] = "spin",
+        [POLLER_WAIT_SLEEP] = "sleep",
+        [POLLER_WAIT_BLOCK] = "event",
+    };
+    const struct poller_stats *st = &p->stats;
+    uint64_t wall = poller_now_ns() - p->wall_start_ns;
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - p->cpu_start_ns;
+
+    printf(
+        "%s poller: spin=%uus sleep=%u..%uus cpu=%.2f%% of %.3fs\n",
+        name,
+        (unsigned)(p->opts.spin_ns / NSEC_PER_USEC),
+        p->opts.sleep_min_us,
+        p->opts.sleep_max_us,
+        wall ? 100.0 * cpu / wall : 0.0,
+        (double)wall / NSEC_PER_SEC
+    );
+
+    for (int w = 0; w < POLLER_WAIT_NUM; ++w) {
+        if (st->hits[w] == 0) continue;
+        printf(
+            "  %-5s hits=%lu detect avg=%.2fus max=%.2fus\n",
+            wait_names[w],
+            st->hits[w],
+            (double)st->delay_sum_ns[w] / st->hits[w] / NSEC_PER_USEC,
+            (double)st->delay_max_ns[w] / NSEC_PER_USEC
+        );
+    }
+}
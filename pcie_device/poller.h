@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+
+// Гибридное ожидание работы потоком очереди:
+// - после каждой обработанной пачки поток крутится на `pause` в течение
+//   spin_ns, перечитывая sq_tail;
+// - по истечении бюджета - либо блокируется на событии doorbell, либо спит,
+//   удваивая интервал от sleep_min_us до sleep_max_us.
+//
+// Для оценки бюджета ведётся статистика задержки обнаружения команды: время
+// между последней пустой проверкой (или получением doorbell) и моментом, когда
+// поток увидел новую команду.
+
+struct poller_opts {
+    // бюджет активного ожидания после пачки команд, нс (0 - не крутиться)
+    uint32_t spin_ns;
+    // границы экспоненциального сна в режиме опроса, мкс
+    uint32_t sleep_min_us;
+    uint32_t sleep_max_us;
+};
+
+enum poller_wait {
+    POLLER_WAIT_NONE = 0,
+    POLLER_WAIT_SPIN,
+    POLLER_WAIT_SLEEP,
+    POLLER_WAIT_BLOCK,
+    POLLER_WAIT_NUM,
+};
+
+struct poller_stats {
+    // количество обнаруженных пачек по способу последнего ожидания
+    uint64_t hits[POLLER_WAIT_NUM];
+    uint64_t delay_sum_ns[POLLER_WAIT_NUM];
+    uint64_t delay_max_ns[POLLER_WAIT_NUM];
+};
+
+struct poller {
+    struct poller_opts opts;
+
+    // начало текущего простоя, 0 - поток занят работой
+    uint64_t idle_since_ns;
+    // момент последней проверки, не обнаружившей работы
+    uint64_t last_check_ns;
+    uint32_t sleep_us;
+    enum poller_wait last_wait;
+
+    struct poller_stats stats;
+    uint64_t wall_start_ns;
+    uint64_t cpu_start_ns;
+};
+
+void poller_opts_default(struct poller_opts *opts);
+
+// вызывается из потока, который будет ожидать работу (для учёта cpu времени)
+void poller_init(struct poller *p, const struct poller_opts *opts);
+
+// активное ожидание: 1 - бюджет не исчерпан и выполнен один `pause`,
+// 0 - бюджет исчерпан, нужно спать или блокироваться
+int poller_spin(struct poller *p);
+
+// сон с экспоненциальным увеличением интервала
+void poller_sleep(struct poller *p);
+
+// отметка о переходе к блокирующему ожиданию события
+void poller_block(struct poller *p);
+
+// обнаружена работа. event_ns - момент получения doorbell, если известен (0 -
+// иначе), используется вместо последней пустой проверки после блокировки
+void poller_hit(struct poller *p, uint64_t event_ns);
+
+void poller_report(const struct poller *p, const char *name);
+
+uint64_t poller_now_ns(void);
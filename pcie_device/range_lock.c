@@ -0,0 +1,197 @@
+#include "range_lock.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// порядок узлов в дереве: по началу диапазона, затем по номеру запроса
+static inline int node_less(
+    const struct range_lock_node *a, const struct range_lock_node *b
+) {
+    return a->start < b->start || (a->start == b->start && a->seq < b->seq);
+}
+
+static inline int overlaps(
+    const struct range_lock_node *n, uint64_t start, uint64_t end
+) {
+    return n->start < end && start < n->end;
+}
+
+static inline int conflicts(
+    const struct range_lock_node *a, const struct range_lock_node *b
+) {
+    return (a->exclusive || b->exclusive) && overlaps(a, b->start, b->end);
+}
+
+static inline uint64_t max_end(const struct range_lock_node *n) {
+    return n ? n->max_end : 0;
+}
+
+static inline void update(struct range_lock_node *n) {
+    uint64_t l = max_end(n->left), r = max_end(n->right);
+    n->max_end = n->end;
+    if (l > n->max_end) n->max_end = l;
+    if (r > n->max_end) n->max_end = r;
+}
+
+static uint32_t next_prio(struct range_lock *lock) {
+    // xorshift32
+    uint32_t x = lock->rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    lock->rand = x;
+    return x;
+}
+
+// разделение дерева на узлы меньше key и все остальные
+static void split(
+    struct range_lock_node *t,
+    const struct range_lock_node *key,
+    struct range_lock_node **l,
+    struct range_lock_node **r
+) {
+    if (!t) {
+        *l = *r = NULL;
+    } else if (node_less(t, key)) {
+        split(t->right, key, &t->right, r);
+        update(t);
+        *l = t;
+    } else {
+        split(t->left, key, l, &t->left);
+        update(t);
+        *r = t;
+    }
+}
+
+static struct range_lock_node *
+merge(struct range_lock_node *a, struct range_lock_node *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+static struct range_lock_node *
+insert(struct range_lock_node *t, struct range_lock_node *n) {
+    if (!t) return n;
+    if (n->prio > t->prio) {
+        split(t, n, &n->left, &n->right);
+        update(n);
+        return n;
+    }
+    if (node_less(n, t)) t->left = insert(t->left, n);
+    else t->right = insert(t->right, n);
+    update(t);
+    return t;
+}
+
+static struct range_lock_node *
+erase(struct range_lock_node *t, struct range_lock_node *n) {
+    if (t == n) return merge(t->left, t->right);
+    if (node_less(n, t)) t->left = erase(t->left, n);
+    else t->right = erase(t->right, n);
+    update(t);
+    return t;
+}
+
+// количество узлов дерева, конфликтующих с n
+static uint32_t count_conflicts(
+    const struct range_lock_node *t, const struct range_lock_node *n
+) {
+    uint32_t cnt = 0;
+
+    if (!t || t->max_end <= n->start) return 0;
+
+    cnt += count_conflicts(t->left, n);
+    if (conflicts(t, n)) cnt++;
+    // правое поддерево начинается не раньше t->start
+    if (t->start < n->end) cnt += count_conflicts(t->right, n);
+
+    return cnt;
+}
+
+// освобождение более поздних запросов, которых ждал снятый узел n
+static void release_waiters(
+    struct range_lock_node *t, const struct range_lock_node *n
+) {
+    if (!t || t->max_end <= n->start) return;
+
+    release_waiters(t->left, n);
+    if (t->seq > n->seq && conflicts(t, n) && --t->blocking == 0)
+        pthread_cond_signal(&t->cond);
+    if (t->start < n->end) release_waiters(t->right, n);
+}
+
+int range_lock_init(struct range_lock *lock) {
+    memset(lock, 0, sizeof(*lock));
+    lock->rand = 2463534242u;
+    return pthread_mutex_init(&lock->mutex, NULL);
+}
+
+void range_lock_cleanup(struct range_lock *lock) {
+    pthread_mutex_destroy(&lock->mutex);
+    memset(lock, 0, sizeof(*lock));
+}
+
+static void range_lock_acquire(
+    struct range_lock *lock,
+    struct range_lock_node *node,
+    uint64_t addr,
+    uint64_t size,
+    int exclusive
+) {
+    node->start = addr;
+    node->end = addr + size;
+    node->exclusive = exclusive;
+    node->left = node->right = NULL;
+    node->max_end = node->end;
+
+    pthread_mutex_lock(&lock->mutex);
+
+    node->seq = lock->seq++;
+    node->prio = next_prio(lock);
+    node->blocking = count_conflicts(lock->root, node);
+    lock->root = insert(lock->root, node);
+    lock->acquired++;
+
+    if (node->blocking != 0) {
+        lock->contended++;
+        // условная переменная нужна только ожидающему запросу
+        pthread_cond_init(&node->cond, NULL);
+        while (node->blocking != 0) pthread_cond_wait(&node->cond, &lock->mutex);
+        pthread_cond_destroy(&node->cond);
+    }
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+void range_lock_shared(
+    struct range_lock *lock,
+    struct range_lock_node *node,
+    uint64_t addr,
+    uint64_t size
+) {
+    range_lock_acquire(lock, node, addr, size, 0);
+}
+
+void range_lock_exclusive(
+    struct range_lock *lock,
+    struct range_lock_node *node,
+    uint64_t addr,
+    uint64_t size
+) {
+    range_lock_acquire(lock, node, addr, size, 1);
+}
+
+void range_unlock(struct range_lock *lock, struct range_lock_node *node) {
+    pthread_mutex_lock(&lock->mutex);
+    lock->root = erase(lock->root, node);
+    release_waiters(lock->root, node);
+    pthread_mutex_unlock(&lock->mutex);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+// Блокировка диапазонов адресов хранилища.
+//
+// Все запросы (удерживаемые и ожидающие) хранятся в дереве интервалов
+// (декартово дерево по началу диапазона, в узлах - максимальный конец
+// поддерева). Запрос конфликтует с более ранним пересекающимся запросом, если
+// хотя бы один из них исключительный. Запрос получает блокировку, когда все
+// конфликтующие с ним более ранние запросы сняты, поэтому на пересечениях
+// соблюдается порядок FIFO, а непересекающиеся диапазоны и разделяемые
+// блокировки удерживаются одновременно в любом количестве.
+//
+// Ожидающий поток спит на собственной условной переменной узла и будится
+// только тогда, когда снята последняя мешающая ему блокировка.
+
+struct range_lock_node {
+    uint64_t start;
+    // конец диапазона (не включительно)
+    uint64_t end;
+    // порядковый номер запроса
+    uint64_t seq;
+    int exclusive;
+    // количество более ранних конфликтующих запросов в дереве
+    uint32_t blocking;
+    pthread_cond_t cond;
+
+    // дерево интервалов
+    uint32_t prio;
+    uint64_t max_end;
+    struct range_lock_node *left;
+    struct range_lock_node *right;
+};
+
+struct range_lock {
+    pthread_mutex_t mutex;
+    struct range_lock_node *root;
+    uint64_t seq;
+    uint32_t rand;
+
+    // статистика: всего запросов и из них ожидавших
+    uint64_t acquired;
+    uint64_t contended;
+};
+
+int range_lock_init(struct range_lock *lock);
+void range_lock_cleanup(struct range_lock *lock);
+
+// узел принадлежит вызывающему и должен жить до range_unlock
+void range_lock_shared(
+    struct range_lock *lock,
+    struct range_lock_node *node,
+    uint64_t addr,
+    uint64_t size
+);
+void range_lock_exclusive(
+    struct range_lock *lock,
+    struct range_lock_node *node,
+    uint64_t addr,
+    uint64_t size
+);
+void range_unlock(struct range_lock *lock, struct range_lock_node *node);
@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "range_lock.h"
+
+// Микробенчмарк range_lock: стоимость пары lock/unlock при 1..64 потоках.
+//
+// Сценарии:
+// - disjoint - каждый поток блокирует (исключительно) собственный диапазон
+// - shared   - все потоки разделяемо блокируют один и тот же диапазон
+// - mixed    - случайные диапазоны по 4 КиБ в 1 МиБ, 20% исключительных
+
+#define MAX_THREADS  64
+#define DEFAULT_OPS  100000
+#define MIXED_SPACE  (1024 * 1024)
+#define MIXED_RANGE  4096
+#define MIXED_EXCL_P 20
+
+enum bench_mode {
+    BENCH_DISJOINT = 0,
+    BENCH_SHARED,
+    BENCH_MIXED,
+    BENCH_MODES_NUM,
+};
+
+static const char *mode_names[BENCH_MODES_NUM] = {
+    [BENCH_DISJOINT] = "disjoint",
+    [BENCH_SHARED] = "shared",
+    [BENCH_MIXED] = "mixed",
+};
+
+struct bench_ctx {
+    struct range_lock lock;
+    enum bench_mode mode;
+    int ops;
+    pthread_barrier_t start;
+};
+
+struct bench_thread {
+    struct bench_ctx *ctx;
+    pthread_t thread;
+    int id;
+};
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *bench_func(void *arg) {
+    struct bench_thread *t = (struct bench_thread *)arg;
+    struct bench_ctx *ctx = t->ctx;
+    struct range_lock_node node;
+    uint32_t rnd = 0x9e3779b9u * (t->id + 1);
+
+    pthread_barrier_wait(&ctx->start);
+
+    for (int i = 0; i < ctx->ops; ++i) {
+        switch (ctx->mode) {
+        case BENCH_DISJOINT:
+            range_lock_exclusive(
+                &ctx->lock, &node, (uint64_t)t->id * MIXED_RANGE, MIXED_RANGE
+            );
+            break;
+        case BENCH_SHARED:
+            range_lock_shared(&ctx->lock, &node, 0, MIXED_RANGE);
+            break;
+        case BENCH_MIXED: {
+            uint64_t addr;
+            rnd ^= rnd << 13;
+            rnd ^= rnd >> 17;
+            rnd ^= rnd << 5;
+            addr = rnd % (MIXED_SPACE - MIXED_RANGE);
+            if (rnd % 100 < MIXED_EXCL_P)
+                range_lock_exclusive(&ctx->lock, &node, addr, MIXED_RANGE);
+            else range_lock_shared(&ctx->lock, &node, addr, MIXED_RANGE);
+            break;
+        }
+        default: break;
+        }
+        range_unlock(&ctx->lock, &node);
+    }
+
+    return NULL;
+}
+
+static int run(enum bench_mode mode, int threads_num, int ops) {
+    struct bench_ctx ctx = {.mode = mode, .ops = ops};
+    struct bench_thread threads[MAX_THREADS];
+    uint64_t start, elapsed;
+    double total;
+
+    if (range_lock_init(&ctx.lock) != 0) return -1;
+    pthread_barrier_init(&ctx.start, NULL, threads_num + 1);
+
+    for (int i = 0; i < threads_num; ++i) {
+        threads[i].ctx = &ctx;
+        threads[i].id = i;
+        if (pthread_create(&threads[i].thread, NULL, bench_func, &threads[i])
+            != 0) {
+            fprintf(stderr, "unable to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ctx.start);
+    start = now_ns();
+    for (int i = 0; i < threads_num; ++i) pthread_join(threads[i].thread, NULL);
+    elapsed = now_ns() - start;
+
+    total = (double)threads_num * ops;
+    printf(
+        "%-8s %7d %12.1f %12.3f %9.2f%%\n",
+        mode_names[mode],
+        threads_num,
+        (double)elapsed * threads_num / total,
+        total / elapsed * 1000.0,
+        ctx.lock.acquired ? 100.0 * ctx.lock.contended / ctx.lock.acquired : 0
+    );
+
+    pthread_barrier_destroy(&ctx.start);
+    range_lock_cleanup(&ctx.lock);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int ops = argc > 1 ? atoi(argv[1]) : DEFAULT_OPS;
+
+    if (ops <= 0) {
+        printf("USAGE: %s [ops_per_thread]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %7s %12s %12s %10s\n", "mode", "threads", "ns/op", "Mops/s",
+           "contended");
+    for (int mode = 0; mode < BENCH_MODES_NUM; ++mode) {
+        for (int n = 1; n <= MAX_THREADS; n *= 2) run(mode, n, ops);
+    }
+
+    return EXIT_SUCCESS;
+}
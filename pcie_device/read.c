@@ -29,7 +29,7 @@ int main(int argc, const char **argv) {
     uint32_t addr = 0;
     uint32_t size = WIN_SIZE;
 
-    if ((stt = mf_init(&mf, argv[1])) != MF_OK) goto err;
+    if ((stt = mf_init(&mf, argv[1], 0)) != MF_OK) goto err;
 
     bar2 = (volatile struct pcie_bar2 *)mf.base;
 
@@ -1,5 +1,7 @@
 #pragma once
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
@@ -15,9 +17,16 @@ static inline void socket_init(struct socket *s) {
 }
 
 static inline int socket_connect(struct socket *s, const char *host, int port) {
+    int one = 1;
+
     s->addr.sin_port = htons(port);
     inet_pton(AF_INET, host, &s->addr.sin_addr);
-    return connect(s->fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) == 0;
+    if (connect(s->fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) != 0)
+        return 0;
+    // сообщения о прерываниях короткие: без TCP_NODELAY следующее ждёт
+    // подтверждения предыдущего (алгоритм Нейгла и отложенный ACK, ~40 мс)
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 1;
 }
 
 static inline int socket_send(const struct socket *s, const char *msg) {
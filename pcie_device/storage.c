@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *const storage_type_names[STORAGE_TYPES_NUM] = {
+    [STORAGE_MMAP] = "mmap",
+    [STORAGE_PIO] = "pio",
+    [STORAGE_URING] = "uring",
+};
+
+int storage_type_parse(const char *name) {
+    for (int i = 0; i < STORAGE_TYPES_NUM; ++i) {
+        if (strcmp(name, storage_type_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+enum storage_status
+storage_punch_hole(struct storage *s, uint64_t addr, uint64_t size) {
+    if (fallocate(
+            s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, addr, size
+        )
+        == -1)
+        return STORAGE_IO_ERROR;
+    return STORAGE_OK;
+}
+
+/* ---------------------------------- mmap ---------------------------------- */
+
+static enum storage_status
+mmap_open(struct storage *s, const char *filename, unsigned flags) {
+    unsigned mf_flags = 0;
+
+    if (flags & STORAGE_POPULATE) mf_flags |= MF_POPULATE;
+    if (flags & STORAGE_HUGEPAGE) mf_flags |= MF_HUGEPAGE;
+    if (flags & STORAGE_SEQUENTIAL) mf_flags |= MF_SEQUENTIAL;
+    if (flags & STORAGE_RANDOM) mf_flags |= MF_RANDOM;
+
+    switch (mf_init(&s->mf, filename, mf_flags)) {
+    case MF_OK: break;
+    case MF_MMAP_ERROR: return STORAGE_MMAP_ERROR;
+    default: return STORAGE_FILE_ERROR;
+    }
+
+    s->size = s->mf.file_size;
+    s->fd = s->mf.fd;
+    s->align = 1;
+
+    if ((flags & STORAGE_TRACK_DIRTY) && mf_track_dirty(&s->mf) != MF_OK)
+        return STORAGE_MEM_ERROR;
+    return STORAGE_OK;
+}
+
+static void mmap_close(struct storage *s) {
+    mf_cleanup(&s->mf);
+    s->fd = -1;
+}
+
+static enum storage_status
+mmap_read(struct storage *s, void *dst, uint64_t addr, uint32_t size) {
+    memcpy(dst, s->mf.base + addr, size);
+    return STORAGE_OK;
+}
+
+static enum storage_status
+mmap_write(struct storage *s, const void *src, uint64_t addr, uint32_t size) {
+    memcpy(s->mf.base + addr, src, size);
+    mf_mark_dirty(&s->mf, addr, size);
+    return STORAGE_OK;
+}
+
+static enum storage_status
+mmap_sync(struct storage *s, uint64_t addr, uint64_t size) {
+    if (mf_sync(&s->mf, addr, size, MS_SYNC) != MF_OK) return STORAGE_IO_ERROR;
+    return STORAGE_OK;
+}
+
+static enum storage_status mmap_flush(struct storage *s, size_t *pages) {
+    if (mf_flush_dirty(&s->mf, pages) != MF_OK) return STORAGE_IO_ERROR;
+    return STORAGE_OK;
+}
+
+static const struct storage_ops storage_mmap_ops = {
+    .open = mmap_open,
+    .close = mmap_close,
+    .read = mmap_read,
+    .write = mmap_write,
+    .sync = mmap_sync,
+    .flush = mmap_flush,
+    .discard = storage_punch_hole,
+};
+
+/* ---------------------------------- pio ----------------------------------- */
+
+static enum storage_status
+pio_open(struct storage *s, const char *filename, unsigned flags) {
+    struct stat st;
+
+    s->fd = open(filename, O_RDWR | O_CLOEXEC);
+    if (s->fd == -1) return STORAGE_FILE_ERROR;
+    if (fstat(s->fd, &st) == -1) return STORAGE_FILE_ERROR;
+
+    s->size = st.st_size;
+    s->align = 1;
+
+    // подсказки необязательны, ошибки игнорируются
+    if (flags & STORAGE_SEQUENTIAL)
+        posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    else if (flags & STORAGE_RANDOM)
+        posix_fadvise(s->fd, 0, 0, POSIX_FADV_RANDOM);
+    if (flags & STORAGE_POPULATE)
+        posix_fadvise(s->fd, 0, 0, POSIX_FADV_WILLNEED);
+    return STORAGE_OK;
+}
+
+static void pio_close(struct storage *s) {
+    if (s->fd != -1) close(s->fd);
+    s->fd = -1;
+}
+
+static enum storage_status
+pio_read(struct storage *s, void *dst, uint64_t addr, uint32_t size) {
+    while (size) {
+        ssize_t n = pread(s->fd, dst, size, addr);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return STORAGE_IO_ERROR;
+        dst = (uint8_t *)dst + n;
+        addr += n;
+        size -= n;
+    }
+    return STORAGE_OK;
+}
+
+static enum storage_status
+pio_write(struct storage *s, const void *src, uint64_t addr, uint32_t size) {
+    while (size) {
+        ssize_t n = pwrite(s->fd, src, size, addr);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return STORAGE_IO_ERROR;
+        src = (const uint8_t *)src + n;
+        addr += n;
+        size -= n;
+    }
+    __atomic_store_n(&s->dirty, 1, __ATOMIC_RELEASE);
+    return STORAGE_OK;
+}
+
+static enum storage_status
+pio_sync(struct storage *s, uint64_t addr, uint64_t size) {
+    // fdatasync сбрасывает файл целиком
+    (void)addr;
+    (void)size;
+    if (fdatasync(s->fd) == -1) return STORAGE_IO_ERROR;
+    return STORAGE_OK;
+}
+
+static enum storage_status pio_flush(struct storage *s, size_t *pages) {
+    if (pages) *pages = 0;
+    if (!__atomic_exchange_n(&s->dirty, 0, __ATOMIC_ACQ_REL)) return STORAGE_OK;
+    if (fdatasync(s->fd) == -1) {
+        // несохранённые записи остаются за следующим flush
+        __atomic_store_n(&s->dirty, 1, __ATOMIC_RELEASE);
+        return STORAGE_IO_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+static const struct storage_ops storage_pio_ops = {
+    .open = pio_open,
+    .close = pio_close,
+    .read = pio_read,
+    .write = pio_write,
+    .sync = pio_sync,
+    .flush = pio_flush,
+    .discard = storage_punch_hole,
+};
+
+/* --------------------------------- common --------------------------------- */
+
+static const struct storage_ops *const storage_ops[STORAGE_TYPES_NUM] = {
+    [STORAGE_MMAP] = &storage_mmap_ops,
+    [STORAGE_PIO] = &storage_pio_ops,
+    [STORAGE_URING] = &storage_uring_ops,
+};
+
+enum storage_status storage_open(
+    struct storage *s,
+    enum storage_type type,
+    const char *filename,
+    unsigned flags
+) {
+    enum storage_status stt;
+
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    if (type >= STORAGE_TYPES_NUM) return STORAGE_FILE_ERROR;
+
+    s->type = type;
+    s->ops = storage_ops[type];
+    pthread_mutex_init(&s->flush_lock, NULL);
+    stt = s->ops->open(s, filename, flags);
+    if (stt != STORAGE_OK) storage_close(s);
+    return stt;
+}
+
+void storage_close(struct storage *s) {
+    if (s->ops) {
+        s->ops->close(s);
+        pthread_mutex_destroy(&s->flush_lock);
+    }
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
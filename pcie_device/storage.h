@@ -0,0 +1,137 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mapped_file.h"
+
+// Хранилище устройства с подменяемой реализацией:
+// - mmap  - отображение всего файла в память (mapped_file)
+// - pio   - pread/pwrite через page cache
+// - uring - io_uring с O_DIRECT и зарегистрированными буферами, по кольцу и
+//           буферу на поток, минуя page cache
+//
+// Все операции потокобезопасны. Операции над диапазоном, не выровненным по
+// storage.align, могут затрагивать соседние байты того же блока
+// (read-modify-write), поэтому блокировать нужно выровненный диапазон.
+
+enum storage_type {
+    STORAGE_MMAP = 0,
+    STORAGE_PIO,
+    STORAGE_URING,
+    STORAGE_TYPES_NUM,
+};
+
+enum storage_status {
+    STORAGE_OK = 0,
+    STORAGE_FILE_ERROR,
+    STORAGE_MMAP_ERROR,
+    STORAGE_IO_ERROR,
+    STORAGE_MEM_ERROR,
+};
+
+// отслеживать изменённые данные для flush (иначе записи сохраняются только
+// через sync)
+#define STORAGE_TRACK_DIRTY (1 << 0)
+// подсказки по работе с файлом (см. MF_* в mapped_file.h): mmap применяет
+// их к отображению, pio - через posix_fadvise, uring (O_DIRECT) игнорирует
+#define STORAGE_POPULATE   (1 << 1)
+#define STORAGE_HUGEPAGE   (1 << 2)
+#define STORAGE_SEQUENTIAL (1 << 3)
+#define STORAGE_RANDOM     (1 << 4)
+
+struct storage;
+
+struct storage_ops {
+    enum storage_status (*open)(
+        struct storage *s, const char *filename, unsigned flags
+    );
+    void (*close)(struct storage *s);
+
+    enum storage_status (*read)(
+        struct storage *s, void *dst, uint64_t addr, uint32_t size
+    );
+    enum storage_status (*write)(
+        struct storage *s, const void *src, uint64_t addr, uint32_t size
+    );
+    // сохранение диапазона на носителе
+    enum storage_status (*sync)(
+        struct storage *s, uint64_t addr, uint64_t size
+    );
+    // сохранение всех изменений, pages - сброшено страниц (если известно)
+    enum storage_status (*flush)(struct storage *s, size_t *pages);
+    // освобождение диапазона, после чего он читается нулями
+    enum storage_status (*discard)(
+        struct storage *s, uint64_t addr, uint64_t size
+    );
+};
+
+struct storage {
+    const struct storage_ops *ops;
+    enum storage_type type;
+    uint64_t size;
+    // выравнивание операций с носителем
+    uint32_t align;
+    int fd;
+
+    // mmap
+    struct mapped_file mf;
+    // pio/uring: были записи после последнего flush
+    int dirty;
+    // сбросы выполняются по одному: flush, начатый во время чужого, ждёт его
+    // завершения, а не видит уже обнулённые признаки изменений
+    pthread_mutex_t flush_lock;
+    // uring: данные реализации
+    void *priv;
+};
+
+extern const char *const storage_type_names[STORAGE_TYPES_NUM];
+
+// разбор имени реализации, -1 если неизвестно
+int storage_type_parse(const char *name);
+
+enum storage_status storage_open(
+    struct storage *s,
+    enum storage_type type,
+    const char *filename,
+    unsigned flags
+);
+void storage_close(struct storage *s);
+
+static inline enum storage_status
+storage_read(struct storage *s, void *dst, uint64_t addr, uint32_t size) {
+    return s->ops->read(s, dst, addr, size);
+}
+
+static inline enum storage_status storage_write(
+    struct storage *s, const void *src, uint64_t addr, uint32_t size
+) {
+    return s->ops->write(s, src, addr, size);
+}
+
+static inline enum storage_status
+storage_sync(struct storage *s, uint64_t addr, uint64_t size) {
+    return s->ops->sync(s, addr, size);
+}
+
+static inline enum storage_status
+storage_flush(struct storage *s, size_t *pages) {
+    enum storage_status stt;
+
+    pthread_mutex_lock(&s->flush_lock);
+    stt = s->ops->flush(s, pages);
+    pthread_mutex_unlock(&s->flush_lock);
+    return stt;
+}
+
+static inline enum storage_status
+storage_discard(struct storage *s, uint64_t addr, uint64_t size) {
+    return s->ops->discard(s, addr, size);
+}
+
+// discard через fallocate(PUNCH_HOLE) для реализаций с файловым дескриптором
+enum storage_status
+storage_punch_hole(struct storage *s, uint64_t addr, uint64_t size);
+
+// реализация uring (storage_uring.c)
+extern const struct storage_ops storage_uring_ops;
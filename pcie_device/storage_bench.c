@@ -0,0 +1,217 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "storage.h"
+
+// Сравнение реализаций хранилища на существующем файле (размер должен быть
+// кратен 4 КиБ, чтобы uring работал с O_DIRECT).
+//
+// Сценарии (каждый - для всех реализаций и 1..MAX_THREADS потоков):
+// - rand-read/rand-write - случайные блоки по 4 КиБ
+// - seq-read/seq-write   - последовательные блоки по 32 КиБ (размер окна),
+//                          каждый поток в своей части файла
+// - seq-wsync            - то же, с sync после каждой записи
+
+#define MAX_THREADS 8
+#define DEFAULT_OPS 20000
+#define RAND_BLOCK  4096
+#define SEQ_BLOCK   (32 * 1024)
+
+enum bench_mode {
+    BENCH_RAND_READ = 0,
+    BENCH_RAND_WRITE,
+    BENCH_SEQ_READ,
+    BENCH_SEQ_WRITE,
+    BENCH_SEQ_WRITE_SYNC,
+    BENCH_MODES_NUM,
+};
+
+static const char *mode_names[BENCH_MODES_NUM] = {
+    [BENCH_RAND_READ] = "rand-read",
+    [BENCH_RAND_WRITE] = "rand-write",
+    [BENCH_SEQ_READ] = "seq-read",
+    [BENCH_SEQ_WRITE] = "seq-write",
+    [BENCH_SEQ_WRITE_SYNC] = "seq-wsync",
+};
+
+struct bench_ctx {
+    struct storage *s;
+    enum bench_mode mode;
+    int ops;
+    int threads_num;
+    pthread_barrier_t start;
+};
+
+struct bench_thread {
+    struct bench_ctx *ctx;
+    pthread_t thread;
+    int id;
+    int errors;
+    uint64_t lat_max;
+};
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint32_t block_size(enum bench_mode mode) {
+    return mode == BENCH_RAND_READ || mode == BENCH_RAND_WRITE ? RAND_BLOCK
+                                                               : SEQ_BLOCK;
+}
+
+static void *bench_func(void *arg) {
+    struct bench_thread *t = (struct bench_thread *)arg;
+    struct bench_ctx *ctx = t->ctx;
+    uint32_t bs = block_size(ctx->mode);
+    uint64_t blocks = ctx->s->size / bs;
+    uint64_t part = blocks / ctx->threads_num;
+    uint32_t rnd = 0x9e3779b9u * (t->id + 1);
+    uint8_t buf[SEQ_BLOCK];
+
+    memset(buf, t->id, sizeof(buf));
+    pthread_barrier_wait(&ctx->start);
+
+    for (int i = 0; i < ctx->ops; ++i) {
+        uint64_t blk, start;
+        enum storage_status stt = STORAGE_OK;
+
+        if (ctx->mode == BENCH_RAND_READ || ctx->mode == BENCH_RAND_WRITE) {
+            rnd ^= rnd << 13;
+            rnd ^= rnd >> 17;
+            rnd ^= rnd << 5;
+            blk = rnd % blocks;
+        } else {
+            blk = (uint64_t)t->id * part + i % part;
+        }
+
+        start = now_ns();
+        switch (ctx->mode) {
+        case BENCH_RAND_READ:
+        case BENCH_SEQ_READ:
+            stt = storage_read(ctx->s, buf, blk * bs, bs);
+            break;
+        case BENCH_RAND_WRITE:
+        case BENCH_SEQ_WRITE:
+            stt = storage_write(ctx->s, buf, blk * bs, bs);
+            break;
+        case BENCH_SEQ_WRITE_SYNC:
+            stt = storage_write(ctx->s, buf, blk * bs, bs);
+            if (stt == STORAGE_OK) stt = storage_sync(ctx->s, blk * bs, bs);
+            break;
+        default: break;
+        }
+        start = now_ns() - start;
+
+        if (stt != STORAGE_OK) t->errors++;
+        if (start > t->lat_max) t->lat_max = start;
+    }
+
+    return NULL;
+}
+
+static int
+run(struct storage *s, enum bench_mode mode, int threads_num, int ops) {
+    struct bench_ctx ctx = {
+        .s = s, .mode = mode, .ops = ops, .threads_num = threads_num
+    };
+    struct bench_thread threads[MAX_THREADS];
+    uint64_t start, elapsed, lat_max = 0;
+    int errors = 0;
+    double total;
+
+    // для синхронной записи хватит и меньшего числа операций
+    if (mode == BENCH_SEQ_WRITE_SYNC) ctx.ops = ops / 20 ? ops / 20 : 1;
+
+    pthread_barrier_init(&ctx.start, NULL, threads_num + 1);
+    for (int i = 0; i < threads_num; ++i) {
+        memset(&threads[i], 0, sizeof(threads[i]));
+        threads[i].ctx = &ctx;
+        threads[i].id = i;
+        if (pthread_create(&threads[i].thread, NULL, bench_func, &threads[i])
+            != 0) {
+            fprintf(stderr, "unable to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ctx.start);
+    start = now_ns();
+    for (int i = 0; i < threads_num; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+        if (threads[i].lat_max > lat_max) lat_max = threads[i].lat_max;
+    }
+    elapsed = now_ns() - start;
+    storage_flush(s, NULL);
+
+    total = (double)threads_num * ctx.ops;
+    printf(
+        "%-6s %-10s %7d %10.1f %10.1f %10.1f %6d\n",
+        storage_type_names[s->type],
+        mode_names[mode],
+        threads_num,
+        total * block_size(mode) / elapsed * 1e9 / (1 << 20),
+        (double)elapsed * threads_num / total / 1000.0,
+        lat_max / 1000.0,
+        errors
+    );
+
+    pthread_barrier_destroy(&ctx.start);
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    int ops = argc > 2 ? atoi(argv[2]) : DEFAULT_OPS;
+    int ret = EXIT_SUCCESS;
+
+    if (argc < 2 || ops <= 0) {
+        printf("USAGE: %s <storage_file> [ops_per_thread]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%-6s %-10s %7s %10s %10s %10s %6s\n",
+        "type",
+        "mode",
+        "threads",
+        "MiB/s",
+        "avg_us",
+        "max_us",
+        "errors"
+    );
+    for (int type = 0; type < STORAGE_TYPES_NUM; ++type) {
+        struct storage s;
+
+        if (storage_open(&s, type, argv[1], STORAGE_TRACK_DIRTY)
+            != STORAGE_OK) {
+            fprintf(
+                stderr,
+                "unable to open `%s` as %s\n",
+                argv[1],
+                storage_type_names[type]
+            );
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        if (s.size < (uint64_t)SEQ_BLOCK * MAX_THREADS) {
+            fprintf(stderr, "storage file is too small\n");
+            storage_close(&s);
+            return EXIT_FAILURE;
+        }
+
+        for (int mode = 0; mode < BENCH_MODES_NUM; ++mode) {
+            for (int n = 1; n <= MAX_THREADS; n *= 2) {
+                if (run(&s, mode, n, ops) != 0) ret = EXIT_FAILURE;
+            }
+        }
+        storage_close(&s);
+    }
+
+    return ret;
+}
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bars.h"
+
+// Реализация хранилища на io_uring (системные вызовы напрямую, без liburing).
+//
+// У каждого потока, обращающегося к хранилищу, своё кольцо и свой
+// зарегистрированный буфер, поэтому синхронизация между потоками не нужна.
+// Файл открывается с O_DIRECT: операции выполняются блоками по DIRECT_ALIGN
+// через буфер, невыровненные края записи дочитываются (read-modify-write).
+// Если файловая система не поддерживает O_DIRECT или размер файла не кратен
+// блоку, используется обычный режим без выравнивания.
+
+#define DIRECT_ALIGN 4096
+#define RING_ENTRIES 4
+
+struct uring {
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct uring_thread {
+    struct uring ring;
+    uint8_t *buf;
+    struct uring_thread *next;
+};
+
+struct uring_priv {
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    // все созданные контексты потоков (для освобождения)
+    struct uring_thread *threads;
+    size_t buf_size;
+};
+
+static inline int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(
+    int fd, unsigned to_submit, unsigned min_complete, unsigned flags
+) {
+    return syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0
+    );
+}
+
+static inline int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(struct uring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_size);
+    if (r->fd > 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+}
+
+static int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(
+        NULL,
+        r->sq_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        r->fd,
+        IORING_OFF_SQ_RING
+    );
+    if (r->sq_ptr == MAP_FAILED) goto err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(
+            NULL,
+            r->cq_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            r->fd,
+            IORING_OFF_CQ_RING
+        );
+        if (r->cq_ptr == MAP_FAILED) goto err;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(
+        NULL,
+        r->sqes_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        r->fd,
+        IORING_OFF_SQES
+    );
+    if (r->sqes == MAP_FAILED) goto err;
+
+    r->sq_tail = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((uint8_t *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((uint8_t *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((uint8_t *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((uint8_t *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((uint8_t *)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+err:
+    if (r->sq_ptr == MAP_FAILED) r->sq_ptr = NULL;
+    if (r->cq_ptr == MAP_FAILED) r->cq_ptr = NULL;
+    if (r->sqes == MAP_FAILED) r->sqes = NULL;
+    uring_exit(r);
+    return -1;
+}
+
+// отправка одного запроса и ожидание его завершения, возвращает res
+static int uring_submit_wait(struct uring *r, const struct io_uring_sqe *req) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    unsigned head;
+    int res;
+
+    r->sqes[idx] = *req;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do {
+        res = sys_io_uring_enter(r->fd, 1, 1, IORING_ENTER_GETEVENTS);
+    } while (res == -1 && errno == EINTR);
+    if (res == -1) return -errno;
+
+    // запрос у кольца единственный, завершение - первое в очереди
+    head = *r->cq_head;
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        res = sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (res == -1 && errno != EINTR) return -errno;
+    }
+
+    res = r->cqes[head & *r->cq_mask].res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+static int uring_rw(
+    struct uring *r, int write, int fd, void *buf, unsigned len, uint64_t off
+) {
+    struct io_uring_sqe req = {
+        .opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED,
+        .fd = fd,
+        .off = off,
+        .addr = (uint64_t)(uintptr_t)buf,
+        .len = len,
+        .buf_index = 0,
+    };
+    unsigned done = 0;
+
+    // короткие операции продолжаются с места остановки
+    while (done < len) {
+        int res = uring_submit_wait(r, &req);
+        if (res <= 0) return res < 0 ? res : -EIO;
+        done += res;
+        req.off += res;
+        req.addr += res;
+        req.len -= res;
+    }
+    return done;
+}
+
+static struct uring_thread *uring_thread_get(struct storage *s) {
+    struct uring_priv *priv = s->priv;
+    struct uring_thread *t = pthread_getspecific(priv->key);
+    struct iovec iov;
+
+    if (t) return t;
+
+    t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+
+    if (posix_memalign((void **)&t->buf, DIRECT_ALIGN, priv->buf_size) != 0)
+        goto err_free;
+    if (uring_init(&t->ring, RING_ENTRIES) != 0) goto err_free_buf;
+
+    // буфер регистрируется один раз, ядро не закрепляет страницы на каждый
+    // запрос
+    iov.iov_base = t->buf;
+    iov.iov_len = priv->buf_size;
+    if (sys_io_uring_register(t->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1)
+        != 0)
+        goto err_exit;
+
+    pthread_mutex_lock(&priv->lock);
+    t->next = priv->threads;
+    priv->threads = t;
+    pthread_mutex_unlock(&priv->lock);
+
+    pthread_setspecific(priv->key, t);
+    return t;
+
+err_exit:
+    uring_exit(&t->ring);
+err_free_buf:
+    free(t->buf);
+err_free:
+    free(t);
+    return NULL;
+}
+
+static enum storage_status
+uring_open(struct storage *s, const char *filename, unsigned flags) {
+    struct uring_priv *priv;
+    struct uring probe;
+    struct stat st;
+
+    // признак записей ведётся всегда, STORAGE_TRACK_DIRTY не нужен
+    (void)flags;
+
+    // проверяем, что io_uring доступен
+    if (uring_init(&probe, 1) != 0) return STORAGE_FILE_ERROR;
+    uring_exit(&probe);
+
+    s->fd = open(filename, O_RDWR | O_CLOEXEC);
+    if (s->fd == -1) return STORAGE_FILE_ERROR;
+    if (fstat(s->fd, &st) == -1) return STORAGE_FILE_ERROR;
+    s->size = st.st_size;
+    s->align = 1;
+
+    if (s->size % DIRECT_ALIGN == 0) {
+        int dfd = open(filename, O_RDWR | O_CLOEXEC | O_DIRECT);
+        if (dfd != -1) {
+            close(s->fd);
+            s->fd = dfd;
+            s->align = DIRECT_ALIGN;
+        }
+    }
+    if (s->align == 1)
+        printf("uring storage: O_DIRECT is unavailable, using page cache\n");
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) return STORAGE_MEM_ERROR;
+    s->priv = priv;
+
+    // окно минимального размера с невыровненными краями, более крупные
+    // команды выполняются по частям (uring_chunk)
+    priv->buf_size = WIN_SIZE + 2 * DIRECT_ALIGN;
+    pthread_mutex_init(&priv->lock, NULL);
+    if (pthread_key_create(&priv->key, NULL) != 0) {
+        pthread_mutex_destroy(&priv->lock);
+        free(priv);
+        s->priv = NULL;
+        return STORAGE_MEM_ERROR;
+    }
+
+    return STORAGE_OK;
+}
+
+static void uring_close(struct storage *s) {
+    struct uring_priv *priv = s->priv;
+
+    if (priv) {
+        struct uring_thread *t = priv->threads;
+        while (t) {
+            struct uring_thread *next = t->next;
+            uring_exit(&t->ring);
+            free(t->buf);
+            free(t);
+            t = next;
+        }
+        pthread_key_delete(priv->key);
+        pthread_mutex_destroy(&priv->lock);
+        free(priv);
+        s->priv = NULL;
+    }
+
+    if (s->fd != -1) close(s->fd);
+    s->fd = -1;
+}
+
+static inline uint64_t align_down(uint64_t v, uint32_t a) { return v / a * a; }
+static inline uint64_t align_up(uint64_t v, uint32_t a) {
+    return (v + a - 1) / a * a;
+}
+
+// очередной блок операции: [start, end) выровнен и умещается в буфер
+static inline void uring_chunk(
+    struct storage *s,
+    uint64_t addr,
+    uint32_t size,
+    uint64_t *start,
+    uint64_t *end
+) {
+    struct uring_priv *priv = s->priv;
+
+    *start = align_down(addr, s->align);
+    *end = align_up(addr + size, s->align);
+    if (*end - *start > priv->buf_size) *end = *start + priv->buf_size;
+    if (*end > s->size) *end = s->size;
+}
+
+static enum storage_status
+uring_read(struct storage *s, void *dst, uint64_t addr, uint32_t size) {
+    struct uring_thread *t = uring_thread_get(s);
+    uint64_t start, end;
+
+    if (!t) return STORAGE_MEM_ERROR;
+
+    while (size) {
+        uint32_t copy;
+
+        uring_chunk(s, addr, size, &start, &end);
+        copy = end - addr < size ? end - addr : size;
+
+        if (uring_rw(&t->ring, 0, s->fd, t->buf, end - start, start) < 0)
+            return STORAGE_IO_ERROR;
+
+        memcpy(dst, t->buf + (addr - start), copy);
+        dst = (uint8_t *)dst + copy;
+        addr += copy;
+        size -= copy;
+    }
+    return STORAGE_OK;
+}
+
+static enum storage_status
+uring_write(struct storage *s, const void *src, uint64_t addr, uint32_t size) {
+    struct uring_thread *t = uring_thread_get(s);
+    uint64_t start, end;
+
+    if (!t) return STORAGE_MEM_ERROR;
+
+    while (size) {
+        uint32_t copy;
+
+        uring_chunk(s, addr, size, &start, &end);
+        copy = end - addr < size ? end - addr : size;
+
+        // невыровненные края блока дочитываем с носителя
+        if ((addr != start || addr + copy != end)
+            && uring_rw(&t->ring, 0, s->fd, t->buf, end - start, start) < 0)
+            return STORAGE_IO_ERROR;
+
+        memcpy(t->buf + (addr - start), src, copy);
+        if (uring_rw(&t->ring, 1, s->fd, t->buf, end - start, start) < 0)
+            return STORAGE_IO_ERROR;
+
+        src = (const uint8_t *)src + copy;
+        addr += copy;
+        size -= copy;
+    }
+
+    __atomic_store_n(&s->dirty, 1, __ATOMIC_RELEASE);
+    return STORAGE_OK;
+}
+
+static enum storage_status uring_fsync(struct storage *s) {
+    struct uring_thread *t = uring_thread_get(s);
+    struct io_uring_sqe req = {
+        .opcode = IORING_OP_FSYNC,
+        .fd = s->fd,
+        .fsync_flags = IORING_FSYNC_DATASYNC,
+    };
+
+    if (!t) return STORAGE_MEM_ERROR;
+    // O_DIRECT минует page cache, но не кэш записи самого носителя
+    if (uring_submit_wait(&t->ring, &req) < 0) return STORAGE_IO_ERROR;
+    return STORAGE_OK;
+}
+
+static enum storage_status
+uring_sync(struct storage *s, uint64_t addr, uint64_t size) {
+    // fsync сбрасывает файл целиком
+    (void)addr;
+    (void)size;
+    return uring_fsync(s);
+}
+
+static enum storage_status uring_flush(struct storage *s, size_t *pages) {
+    if (pages) *pages = 0;
+    if (!__atomic_exchange_n(&s->dirty, 0, __ATOMIC_ACQ_REL)) return STORAGE_OK;
+    if (uring_fsync(s) != STORAGE_OK) {
+        // несохранённые записи остаются за следующим flush
+        __atomic_store_n(&s->dirty, 1, __ATOMIC_RELEASE);
+        return STORAGE_IO_ERROR;
+    }
+    return STORAGE_OK;
+}
+
+const struct storage_ops storage_uring_ops = {
+    .open = uring_open,
+    .close = uring_close,
+    .read = uring_read,
+    .write = uring_write,
+    .sync = uring_sync,
+    .flush = uring_flush,
+    .discard = storage_punch_hole,
+};
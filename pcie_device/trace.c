@@ -0,0 +1,144 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline size_t trace_file_size(uint32_t rings_num, uint32_t ring_size) {
+    return sizeof(struct trace_header)
+         + (size_t)rings_num
+               * (sizeof(struct trace_ring)
+                  + (size_t)ring_size * sizeof(struct trace_record));
+}
+
+static int trace_map(struct trace *t, int prot) {
+    t->base = mmap(NULL, t->size, prot, MAP_SHARED, t->fd, 0);
+    if (t->base == MAP_FAILED) {
+        t->base = NULL;
+        return -1;
+    }
+    t->hdr = (struct trace_header *)t->base;
+    return 0;
+}
+
+int trace_create(
+    struct trace *t, const char *path, uint32_t rings_num, uint32_t ring_size
+) {
+    struct timespec ts;
+    uint32_t size = 1;
+
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+    if (rings_num == 0 || ring_size == 0 || ring_size > (1u << 31)) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (size < ring_size) size <<= 1;
+
+    t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd == -1) return -1;
+
+    t->size = trace_file_size(rings_num, size);
+    if (ftruncate(t->fd, t->size) == -1
+        || trace_map(t, PROT_READ | PROT_WRITE)) {
+        trace_close(t);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->hdr->version = TRACE_VERSION;
+    t->hdr->rings_num = rings_num;
+    t->hdr->ring_size = size;
+    t->hdr->record_size = sizeof(struct trace_record);
+    t->hdr->start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    // читатель проверяет заголовок по magic, поэтому он пишется последним
+    __atomic_store_n(&t->hdr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int trace_open(struct trace *t, const char *path) {
+    struct stat st;
+
+    memset(t, 0, sizeof(*t));
+    t->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (t->fd == -1) return -1;
+
+    if (fstat(t->fd, &st) == -1) goto err;
+    t->size = st.st_size;
+    if (t->size < sizeof(struct trace_header)) {
+        errno = EINVAL;
+        goto err;
+    }
+    if (trace_map(t, PROT_READ)) goto err;
+
+    if (__atomic_load_n(&t->hdr->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC
+        || t->hdr->version != TRACE_VERSION
+        || t->hdr->record_size != sizeof(struct trace_record)
+        || t->hdr->ring_size == 0
+        || (t->hdr->ring_size & (t->hdr->ring_size - 1))
+        || t->size < trace_file_size(t->hdr->rings_num, t->hdr->ring_size)) {
+        errno = EINVAL;
+        goto err;
+    }
+    return 0;
+
+err:
+    trace_close(t);
+    return -1;
+}
+
+void trace_close(struct trace *t) {
+    if (t->base) munmap(t->base, t->size);
+    if (t->fd != -1) close(t->fd);
+    t->base = NULL;
+    t->hdr = NULL;
+    t->fd = -1;
+}
+
+void trace_write(
+    struct trace *t, uint32_t ring, const struct trace_record *rec
+) {
+    struct trace_ring *r = trace_ring(t, ring);
+    uint64_t idx = r->claimed;
+
+    __atomic_store_n(&r->claimed, idx + 1, __ATOMIC_RELAXED);
+    // слот не должен измениться раньше, чем станет виден claimed
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->records[idx & (t->hdr->ring_size - 1)] = *rec;
+    __atomic_store_n(&r->head, idx + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t trace_read(
+    const struct trace *t,
+    uint32_t ring,
+    uint64_t *pos,
+    struct trace_record *out
+) {
+    const struct trace_ring *r = trace_ring(t, ring);
+    uint32_t size = t->hdr->ring_size;
+    uint64_t head, claimed, start, valid, n;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    start = *pos;
+    if (head > size && start < head - size) start = head - size;
+
+    for (uint64_t i = start; i < head; ++i)
+        out[i - start] = r->records[i & (size - 1)];
+
+    // записи, чьи слоты писатель занял во время копирования, недостоверны
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    claimed = __atomic_load_n(&r->claimed, __ATOMIC_RELAXED);
+    valid = claimed > size ? claimed - size : 0;
+
+    *pos = head;
+    if (valid >= head) return 0;
+    if (valid <= start) return head - start;
+
+    n = head - valid;
+    memmove(out, out + (valid - start), n * sizeof(*out));
+    return n;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+// Двоичная трасса команд эмулятора в разделяемом файле (например, в
+// /dev/shm): по кольцу записей фиксированного размера на каждого исполнителя.
+//
+// Кольцо пишет только его исполнитель, без блокировок: перед записью в слот
+// публикуется claimed, после - head. Читатель (trace_dump, в том числе при
+// работающем эмуляторе) копирует записи до head и отбрасывает те, чей слот
+// мог быть занят новой записью по claimed, прочитанному после копирования.
+
+#define TRACE_MAGIC   0x52303454u // "R04T"
+#define TRACE_VERSION 1
+
+struct trace_record {
+    // момент выборки команды из очереди отправки (CLOCK_MONOTONIC), нс
+    uint64_t ts_ns;
+    uint64_t addr;
+    uint32_t size;
+    // cqe.result
+    uint32_t result;
+    uint16_t cid;
+    uint8_t qid;
+    uint8_t opcode;
+    // cqe.status без бита фазы
+    uint8_t status;
+    uint8_t pad[3];
+    // длительности стадий (enum metrics_stage), нс; задержка doorbell
+    // указывается только у первой команды пачки
+    uint32_t stage_ns[METRICS_STAGES_NUM];
+};
+
+_Static_assert(sizeof(struct trace_record) == 64, "trace record size");
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rings_num;
+    // записей в кольце, степень двойки
+    uint32_t ring_size;
+    uint32_t record_size;
+    uint32_t pad0;
+    // момент создания файла (CLOCK_MONOTONIC), нс
+    uint64_t start_ns;
+    uint8_t pad1[32];
+};
+
+struct trace_ring {
+    // номер записи, которая пишется или будет записана следующей
+    uint64_t claimed;
+    // количество полностью записанных записей
+    uint64_t head;
+    uint8_t pad[48];
+    struct trace_record records[];
+};
+
+struct trace {
+    int fd;
+    uint8_t *base;
+    size_t size;
+    struct trace_header *hdr;
+};
+
+// создание файла трассы (пишущая сторона), ring_size округляется вверх до
+// степени двойки: 0 - успех, -1 - ошибка (errno)
+int trace_create(
+    struct trace *t, const char *path, uint32_t rings_num, uint32_t ring_size
+);
+
+// открытие существующего файла только для чтения
+int trace_open(struct trace *t, const char *path);
+
+void trace_close(struct trace *t);
+
+static inline struct trace_ring *
+trace_ring(const struct trace *t, uint32_t i) {
+    size_t stride = sizeof(struct trace_ring)
+                  + (size_t)t->hdr->ring_size * sizeof(struct trace_record);
+    return (struct trace_ring *)(t->base + sizeof(struct trace_header)
+                                 + i * stride);
+}
+
+void trace_write(
+    struct trace *t, uint32_t ring, const struct trace_record *rec
+);
+
+// копирование в out (не менее ring_size записей) ещё не прочитанных записей
+// кольца начиная с *pos; перезаписанные пропускаются. Возвращает количество
+// скопированных записей, *pos продвигается за последнюю из них
+uint32_t trace_read(
+    const struct trace *t,
+    uint32_t ring,
+    uint64_t *pos,
+    struct trace_record *out
+);
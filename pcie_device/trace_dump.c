@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Разбор трассы эмулятора (dev_handle --trace=PATH), в том числе во время его
+// работы:
+// - по умолчанию - перцентили длительности стадий по каждой операции;
+// - -t - все записи по времени выборки;
+// - -f - то же, с дописыванием новых записей до Ctrl+C.
+
+#define OPS_NUM       5
+#define FOLLOW_PERIOD 100000 // мкс
+
+static const char *const op_names[OPS_NUM] = {
+    [0] = "unknown",
+    [PCIE_OP_READ] = "read",
+    [PCIE_OP_WRITE] = "write",
+    [PCIE_OP_FLUSH] = "flush",
+    [PCIE_OP_DISCARD] = "discard",
+};
+
+static const char *const stage_names[METRICS_STAGES_NUM] = {
+    [METRICS_DOORBELL] = "doorbell",
+    [METRICS_QUEUE] = "queue",
+    [METRICS_LOCK] = "lock",
+    [METRICS_COPY] = "copy",
+    [METRICS_SYNC] = "sync",
+    [METRICS_IRQ] = "irq",
+    [METRICS_TOTAL] = "total",
+};
+
+#define STAGE(s) (1u << (s))
+
+// стадии, которые проходит команда (у FLUSH нет блокировки и копирования)
+static const unsigned op_stages[OPS_NUM] = {
+    [PCIE_OP_READ] = STAGE(METRICS_LOCK) | STAGE(METRICS_COPY),
+    [PCIE_OP_WRITE] =
+        STAGE(METRICS_LOCK) | STAGE(METRICS_COPY) | STAGE(METRICS_SYNC),
+    [PCIE_OP_FLUSH] = STAGE(METRICS_SYNC),
+    [PCIE_OP_DISCARD] = STAGE(METRICS_LOCK) | STAGE(METRICS_COPY),
+};
+
+// doorbell и irq приходятся на одну команду из пачки, остальным - 0
+static const unsigned sparse_stages = STAGE(METRICS_DOORBELL)
+                                    | STAGE(METRICS_IRQ);
+
+static const unsigned common_stages = STAGE(METRICS_DOORBELL)
+                                    | STAGE(METRICS_QUEUE) | STAGE(METRICS_IRQ)
+                                    | STAGE(METRICS_TOTAL);
+
+// запись трассы с номером кольца (исполнителя)
+struct entry {
+    struct trace_record rec;
+    uint32_t worker;
+};
+
+struct entries {
+    struct entry *items;
+    size_t count;
+    size_t cap;
+};
+
+static volatile sig_atomic_t done = 0;
+
+static void term(int signum) {
+    (void)signum;
+    done = 1;
+}
+
+static inline int op_index(uint8_t opcode) {
+    return opcode < OPS_NUM ? opcode : 0;
+}
+
+static int entries_push(
+    struct entries *e, uint32_t worker, const struct trace_record *rec
+) {
+    if (e->count == e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 4096;
+        struct entry *items = realloc(e->items, cap * sizeof(*items));
+        if (!items) return 0;
+        e->items = items;
+        e->cap = cap;
+    }
+    e->items[e->count].rec = *rec;
+    e->items[e->count].worker = worker;
+    e->count++;
+    return 1;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t ta = ((const struct entry *)a)->rec.ts_ns;
+    uint64_t tb = ((const struct entry *)b)->rec.ts_ns;
+    return ta < tb ? -1 : ta > tb;
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    uint32_t va = *(const uint32_t *)a, vb = *(const uint32_t *)b;
+    return va < vb ? -1 : va > vb;
+}
+
+// дочитывание новых записей всех колец, pos - позиции чтения колец
+static int collect(
+    const struct trace *t,
+    uint64_t *pos,
+    struct trace_record *buf,
+    struct entries *e
+) {
+    for (uint32_t i = 0; i < t->hdr->rings_num; ++i) {
+        uint32_t n = trace_read(t, i, &pos[i], buf);
+        for (uint32_t j = 0; j < n; ++j)
+            if (!entries_push(e, i, &buf[j])) return 0;
+    }
+    qsort(e->items, e->count, sizeof(*e->items), entry_cmp);
+    return 1;
+}
+
+static inline double percentile(const uint32_t *v, size_t n, double q) {
+    size_t i = (size_t)(q * n);
+    return (i >= n ? v[n - 1] : v[i]) / 1e3;
+}
+
+static void print_summary(const struct entries *e) {
+    uint32_t *v = malloc((e->count ? e->count : 1) * sizeof(*v));
+    if (!v) {
+        fprintf(stderr, "out of memory\n");
+        return;
+    }
+
+    printf(
+        "%-8s %-9s %9s %6s %9s %9s %9s %9s %9s %9s\n",
+        "OP",
+        "STAGE",
+        "COUNT",
+        "ERRORS",
+        "MEAN,us",
+        "P50",
+        "P90",
+        "P99",
+        "P99.9",
+        "MAX"
+    );
+
+    for (int op = 0; op < OPS_NUM; ++op) {
+        unsigned stages = op_stages[op] | common_stages;
+        size_t errors = 0, cmds = 0;
+
+        for (size_t i = 0; i < e->count; ++i) {
+            if (op_index(e->items[i].rec.opcode) != op) continue;
+            cmds++;
+            if (e->items[i].rec.status) errors++;
+        }
+        if (cmds == 0) continue;
+
+        for (int s = 0; s < METRICS_STAGES_NUM; ++s) {
+            uint64_t sum = 0;
+            size_t n = 0;
+
+            if (!(stages & STAGE(s))) continue;
+            for (size_t i = 0; i < e->count; ++i) {
+                const struct trace_record *r = &e->items[i].rec;
+                if (op_index(r->opcode) != op) continue;
+                if ((sparse_stages & STAGE(s)) && r->stage_ns[s] == 0)
+                    continue;
+                v[n++] = r->stage_ns[s];
+                sum += r->stage_ns[s];
+            }
+            if (n == 0) continue;
+
+            qsort(v, n, sizeof(*v), u32_cmp);
+            printf(
+                "%-8s %-9s %9zu %6zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                op_names[op],
+                stage_names[s],
+                n,
+                s == METRICS_TOTAL ? errors : 0,
+                sum / 1e3 / n,
+                percentile(v, n, 0.5),
+                percentile(v, n, 0.9),
+                percentile(v, n, 0.99),
+                percentile(v, n, 0.999),
+                v[n - 1] / 1e3
+            );
+        }
+    }
+
+    free(v);
+}
+
+static void print_timeline_header(void) {
+    printf(
+        "%14s %3s %5s %-7s %4s %12s %8s %4s %9s %9s %9s %9s %9s %9s %9s\n",
+        "TIME,us",
+        "W",
+        "QUEUE",
+        "OP",
+        "CID",
+        "ADDR",
+        "SIZE",
+        "ST",
+        "DOORBELL",
+        "QUEUE",
+        "LOCK",
+        "COPY",
+        "SYNC",
+        "IRQ",
+        "TOTAL"
+    );
+}
+
+static void print_timeline(const struct entries *e, uint64_t start_ns) {
+    for (size_t i = 0; i < e->count; ++i) {
+        const struct trace_record *r = &e->items[i].rec;
+
+        printf(
+            "%14.3f %3u %5s %-7s %4u %#12lx %8u %#4x",
+            (r->ts_ns - start_ns) / 1e3,
+            e->items[i].worker,
+            r->qid == PCIE_RD_QUEUE ? "rd" : "wr",
+            op_names[op_index(r->opcode)],
+            r->cid,
+            r->addr,
+            r->size,
+            r->status
+        );
+        for (int s = 0; s < METRICS_STAGES_NUM; ++s)
+            printf(" %9.1f", r->stage_ns[s] / 1e3);
+        printf("\n");
+    }
+}
+
+static const struct option long_opts[] = {
+    {"timeline", no_argument, NULL, 't'},
+    {"follow",   no_argument, NULL, 'f'},
+    {"help",     no_argument, NULL, 'h'},
+    {NULL,       0,           NULL, 0  },
+};
+
+int main(int argc, char **argv) {
+    struct trace t;
+    struct entries e = {0};
+    struct trace_record *buf;
+    uint64_t *pos;
+    int timeline = 0, follow = 0, opt, ret = 0;
+
+    while ((opt = getopt_long(argc, argv, "tfh", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 't': timeline = 1; break;
+        case 'f': timeline = follow = 1; break;
+        default:
+            printf(
+                "USAGE: %s [-t|--timeline] [-f|--follow] <trace_file>\n",
+                argv[0]
+            );
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        printf(
+            "USAGE: %s [-t|--timeline] [-f|--follow] <trace_file>\n", argv[0]
+        );
+        return 1;
+    }
+
+    if (trace_open(&t, argv[optind]) != 0) {
+        fprintf(
+            stderr,
+            "unable to open trace `%s`: %s\n",
+            argv[optind],
+            strerror(errno)
+        );
+        return 1;
+    }
+
+    buf = malloc((size_t)t.hdr->ring_size * sizeof(*buf));
+    pos = calloc(t.hdr->rings_num, sizeof(*pos));
+    if (!buf || !pos) {
+        fprintf(stderr, "out of memory\n");
+        ret = 1;
+        goto out;
+    }
+
+    signal(SIGINT, term);
+    signal(SIGTERM, term);
+
+    if (timeline) print_timeline_header();
+    do {
+        if (!collect(&t, pos, buf, &e)) {
+            fprintf(stderr, "out of memory\n");
+            ret = 1;
+            break;
+        }
+        if (timeline) {
+            print_timeline(&e, t.hdr->start_ns);
+            fflush(stdout);
+            e.count = 0;
+        }
+        if (follow) usleep(FOLLOW_PERIOD);
+    } while (follow && !done);
+
+    if (!timeline) print_summary(&e);
+
+out:
+    free(e.items);
+    free(pos);
+    free(buf);
+    trace_close(&t);
+    return ret;
+}
@@ -0,0 +1,162 @@
+#include "work_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int deque_push_back(struct work_deque *dq, const struct work_item *it) {
+    int pushed = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count < WORK_DEQUE_SIZE) {
+        dq->items[(dq->head + dq->count) % WORK_DEQUE_SIZE] = *it;
+        dq->count++;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return pushed;
+}
+
+static int deque_pop_front(struct work_deque *dq, struct work_item *it) {
+    int popped = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        *it = dq->items[dq->head];
+        dq->head = (dq->head + 1) % WORK_DEQUE_SIZE;
+        dq->count--;
+        popped = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return popped;
+}
+
+static int deque_pop_back(struct work_deque *dq, struct work_item *it) {
+    int popped = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *it = dq->items[(dq->head + dq->count) % WORK_DEQUE_SIZE];
+        popped = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return popped;
+}
+
+int work_pool_init(
+    struct work_pool *pool, int workers_num, work_fn fn, void *arg
+) {
+    memset(pool, 0, sizeof(*pool));
+    if (workers_num <= 0) return -1;
+
+    pool->workers = calloc(workers_num, sizeof(*pool->workers));
+    if (!pool->workers) return -1;
+
+    pool->workers_num = workers_num;
+    pool->fn = fn;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < workers_num; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pthread_mutex_init(&pool->workers[i].dq.lock, NULL);
+    }
+
+    return 0;
+}
+
+void work_pool_cleanup(struct work_pool *pool) {
+    if (!pool->workers) return;
+
+    for (int i = 0; i < pool->workers_num; ++i)
+        pthread_mutex_destroy(&pool->workers[i].dq.lock);
+    free(pool->workers);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void work_pool_push(struct work_pool *pool, const struct work_item *item) {
+    uint32_t start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+
+    // если дека выбранного исполнителя заполнена, отдаём следующему
+    for (int i = 0; i < pool->workers_num; ++i) {
+        struct work_worker *w =
+            &pool->workers[(start + i) % pool->workers_num];
+        if (deque_push_back(&w->dq, item)) break;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void work_pool_stop(struct work_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// попытка украсть команду с конца деки другого исполнителя
+static int work_steal(struct work_worker *self, struct work_item *item) {
+    struct work_pool *pool = self->pool;
+
+    for (int i = 1; i < pool->workers_num; ++i) {
+        struct work_worker *victim =
+            &pool->workers[(self->id + i) % pool->workers_num];
+        if (deque_pop_back(&victim->dq, item)) return 1;
+    }
+    return 0;
+}
+
+void *work_pool_worker_func(void *arg) {
+    struct work_worker *self = (struct work_worker *)arg;
+    struct work_pool *pool = self->pool;
+    struct work_item item;
+
+    while (1) {
+        if (deque_pop_front(&self->dq, &item)) {
+            // своя команда
+        } else if (work_steal(self, &item)) {
+            self->stolen++;
+        } else {
+            // команд нет ни у кого - ждём следующей отправки
+            pthread_mutex_lock(&pool->lock);
+            while (__atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0
+                   && !pool->stop)
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+
+            if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) break;
+            continue;
+        }
+
+        __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) break;
+
+        pool->fn(pool->arg, self->id, &item);
+        self->done++;
+    }
+
+    return NULL;
+}
+
+void work_pool_report(const struct work_pool *pool) {
+    for (int i = 0; i < pool->workers_num; ++i) {
+        printf(
+            "WORKER %d: done=%lu stolen=%lu\n",
+            i,
+            pool->workers[i].done,
+            pool->workers[i].stolen
+        );
+    }
+}
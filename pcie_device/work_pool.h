@@ -0,0 +1,77 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+#include "bars.h"
+
+// ёмкость очереди одного исполнителя: больше, чем команд может одновременно
+// находиться в работе во всех очередях устройства
+#define WORK_DEQUE_SIZE (PCIE_QUEUES_NUM * QUEUE_DEPTH)
+
+// команда, выбранная из очереди отправки
+struct work_item {
+    uint32_t qid;
+    // момент выборки из очереди отправки (для метрик)
+    uint64_t fetch_ns;
+    // задержка обнаружения doorbell, у первой команды пачки (для трассы)
+    uint32_t db_delay_ns;
+    struct pcie_sqe sqe;
+};
+
+// кольцевая дека команд исполнителя: владелец забирает с начала,
+// остальные исполнители крадут с конца
+struct work_deque {
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t count;
+    struct work_item items[WORK_DEQUE_SIZE];
+};
+
+struct work_pool;
+
+struct work_worker {
+    struct work_pool *pool;
+    int id;
+    pthread_t thread;
+    struct work_deque dq;
+
+    // статистика: выполнено команд и из них украдено у других исполнителей
+    uint64_t done;
+    uint64_t stolen;
+};
+
+// worker - номер исполнителя (0..workers_num-1)
+typedef void (*work_fn)(void *arg, int worker, const struct work_item *item);
+
+struct work_pool {
+    // защищает pending/stop для ожидания на cond
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // количество команд во всех деках
+    uint32_t pending;
+    int stop;
+
+    int workers_num;
+    struct work_worker *workers;
+    // исполнитель, которому будет отдана следующая команда
+    uint32_t next;
+
+    work_fn fn;
+    void *arg;
+};
+
+int work_pool_init(
+    struct work_pool *pool, int workers_num, work_fn fn, void *arg
+);
+void work_pool_cleanup(struct work_pool *pool);
+
+// точка входа потока исполнителя, аргумент - struct work_worker
+void *work_pool_worker_func(void *arg);
+
+// распределение команды по декам исполнителей (по кругу)
+void work_pool_push(struct work_pool *pool, const struct work_item *item);
+
+// остановка исполнителей, невыполненные команды отбрасываются
+void work_pool_stop(struct work_pool *pool);
+
+void work_pool_report(const struct work_pool *pool);
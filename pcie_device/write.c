@@ -28,7 +28,7 @@ int main(int argc, const char **argv) {
     uint32_t size = 1024;
     FILE *wr_ct;
 
-    if ((stt = mf_init(&mf, argv[1])) != MF_OK) goto mf_err;
+    if ((stt = mf_init(&mf, argv[1], 0)) != MF_OK) goto mf_err;
     if ((wr_ct = fopen(argv[2], "rb")) == NULL) {
         fprintf(
             stderr, "unable to open file '%s': `%s`\n", argv[2], strerror(errno)